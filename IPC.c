@@ -7,19 +7,88 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include "IPC.h"
+#include "ipc_transport.h"
+#include "keyhash.h"
 
 #define SOCKET_DIR "/tmp/distributed_cache_sockets"
-#define MAX_PROCESSES 64
+#define DEFAULT_ENDPOINTS 65 //64 processes and the manager, if nobody reserved a count
 
-static int sender_sockets[MAX_PROCESSES];
-static int sender_sockets_initialized = 0;
+static const Transport *transport = &unix_transport;
+static int reserved_endpoints = 0;
+int ipc_receive_buffer = 1048576;  //SO_RCVBUF of every receiving socket
 
-static void init_sender_sockets(){
-    if(!sender_sockets_initialized){
-        for (int i = 0; i < MAX_PROCESSES; i++){
-            sender_sockets[i] = -1;
+//One sending socket per receiver, a slow receiver only fills its own send buffer
+static int *sender_sockets = NULL;
+static int num_endpoints = 0;
+
+static int unix_reserve(int count){
+    if(sender_sockets != NULL) return count <= num_endpoints ? 0 : -1;
+    sender_sockets = malloc(count * sizeof(int));
+    if(sender_sockets == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : Could not allocate %d sender sockets\n", count);
+        return -1;
+    }
+    for (int i = 0; i < count; i++){
+        sender_sockets[i] = -1;
+    }
+    num_endpoints = count;
+    return 0;
+}
+
+//Switches every endpoint of this process to TCP, the file maps endpoint ids to host and port.
+//Has to come before ipc_reserve_endpoints, all processes of a run have to use the same map.
+int ipc_use_address_map(const char *path){
+    if(tcp_load_address_map(path) != 0) return -1;
+    transport = &tcp_transport;
+    printf("[SUCCESS] : IPC uses %s with the address map %s\n", transport->name, path);
+    return 0;
+}
+
+//Unix datagrams through io_uring: whole rounds of receives and corked sends per system call.
+//Stays on plain system calls if the kernel has no io_uring, or if TCP was chosen.
+int ipc_use_io_uring(){
+    if(transport != &unix_transport){
+        printf("[SUCCESS] : IPC keeps %s, io_uring only drives unix datagram sockets\n", transport->name);
+        return -1;
+    }
+    if(uring_available() != 0){
+        printf("[SUCCESS] : io_uring is not available, IPC keeps plain system calls\n");
+        return -1;
+    }
+    transport = &uring_transport;
+    printf("[SUCCESS] : IPC uses %s\n", transport->name);
+    return 0;
+}
+
+//Has to come before the endpoints are opened, the kernel may cap it at net.core.rmem_max
+void ipc_set_receive_buffer(int bytes){
+    ipc_receive_buffer = bytes;
+}
+
+//Every sender needs room for all receivers, the manager included (its id is num_processes).
+//Has to be called before initiate_communication and before any thread sends.
+int ipc_reserve_endpoints(int count){
+    if(transport->reserve(count) != 0) return -1;
+    reserved_endpoints = count;
+
+    //With hundreds of processes the sender sockets alone pass the usual soft limit of 1024 fds,
+    //TCP also keeps one accepted connection per sender
+    struct rlimit lim;
+    rlim_t need = (rlim_t)count * (transport == &tcp_transport ? 2 : 1) + 64;
+    if(getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < need){
+        lim.rlim_cur = lim.rlim_max == RLIM_INFINITY || lim.rlim_max >= need ? need : lim.rlim_max;
+        if(setrlimit(RLIMIT_NOFILE, &lim) != 0 || lim.rlim_cur < need){
+            fprintf(stderr, "[ERROR HAPPENED] : Only %lu file descriptors for %d endpoints\n", (unsigned long)lim.rlim_cur, count);
         }
-        sender_sockets_initialized = 1;
+    }
+    return 0;
+}
+
+static void init_sender_sockets(){
+    if(reserved_endpoints == 0){
+        ipc_reserve_endpoints(DEFAULT_ENDPOINTS);
     }
 }
 
@@ -35,20 +104,18 @@ static void make_nonblocking(int fd){
 }
 
 
-//The recvbuf set to 1mb, but we may need to adapt according to our benchmarking
-int initiate_communication(int process_id){
-    char sock_path[108];
-    struct sockaddr_un addr;
-    int fd;
-
-    init_sender_sockets();
-
-    if(mkdir(SOCKET_DIR, 0777) < 0 && errno != EEXIST){
-        perror("[ERROR HAPPENED] : Error happened when making the directory for sockets");
-        exit(EXIT_FAILURE);
+static void socket_path(char *path, size_t path_size, int process_id, int queue){
+    if(queue < 0){
+        snprintf(path, path_size, "%s/proc_%d.sock", SOCKET_DIR, process_id);
+    } else {
+        snprintf(path, path_size, "%s/proc_%d_q%d.sock", SOCKET_DIR, process_id, queue);
     }
+}
 
-    snprintf(sock_path, sizeof(sock_path), "%s/proc_%d.sock", SOCKET_DIR, process_id);
+//The recvbuf is ipc_receive_buffer, 1mb unless ipc_set_receive_buffer changed it
+static int bind_endpoint(const char *sock_path){
+    struct sockaddr_un addr;
+    int fd;
 
     unlink(sock_path);
 
@@ -57,8 +124,7 @@ int initiate_communication(int process_id){
         exit(EXIT_FAILURE);
     }
 
-    int rcvbuf = 1048576; 
-    if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0){
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &ipc_receive_buffer, sizeof(ipc_receive_buffer)) < 0){
         perror("[ERROR HAPPENED] : Error happened when increasing the socket size");
     }
 
@@ -73,57 +139,159 @@ int initiate_communication(int process_id){
     }
 
     make_nonblocking(fd);
-
-    printf("[SUCCESS] : Process %d initialized on %s\n", process_id, sock_path);
     return fd;
 }
 
-int send_msg(int sender_id, int receiver_id, const char *msg){
-    (void) sender_id;
-    struct sockaddr_un addr;
+static int unix_open_endpoint(int id, int queue){
     char sock_path[108];
+
+    if(mkdir(SOCKET_DIR, 0777) < 0 && errno != EEXIST){
+        perror("[ERROR HAPPENED] : Error happened when making the directory for sockets");
+        exit(EXIT_FAILURE);
+    }
+    socket_path(sock_path, sizeof(sock_path), id, queue);
+    return bind_endpoint(sock_path);
+}
+
+int initiate_communication(int process_id){
     int fd;
-    ssize_t n;
-    size_t msg_len = strlen(msg) + 1;
 
-    if(msg_len > 65000){
-        fprintf(stderr, "[ERROR HAPPENED] : Message size is too large");
+    init_sender_sockets();
+    fd = transport->open_endpoint(process_id, -1);
+
+    printf("[SUCCESS] : Process %d initialized on %s\n", process_id, transport->name);
+    return fd;
+}
+
+//Extra receive endpoints next to the main one, one per reader thread (proc_N_q0..proc_N_q(K-1).sock
+//for Unix sockets). Has to be called after initiate_communication. fds must hold num_queues entries.
+int initiate_queue_endpoints(int process_id, int num_queues, int *fds){
+    for(int q = 0; q < num_queues; q++){
+        fds[q] = transport->open_endpoint(process_id, q);
+    }
+    printf("[SUCCESS] : Process %d initialized %d receive queues\n", process_id, num_queues);
+    return 0;
+}
+
+//All senders have to agree on this, otherwise a key lands on a reader that does not own it
+int pick_receive_queue(int key_or_req, int num_queues){
+    if(num_queues <= 0) return -1;
+    return key_shard(key_or_req, num_queues);
+}
+
+//The socket this process sends to receiver_id from, -1 if there is none
+int unix_sender_socket(int receiver_id){
+    int fd;
+
+    if(receiver_id < 0 || receiver_id >= num_endpoints){
+        fprintf(stderr, "[ERROR HAPPENED] : No endpoint %d, only %d reserved\n", receiver_id, num_endpoints);
         return -1;
     }
 
-    if(sender_sockets[receiver_id] < 0){
+    //Worker threads may race to create the same socket, the loser closes its own and uses the winner's
+    fd = __atomic_load_n(&sender_sockets[receiver_id], __ATOMIC_ACQUIRE);
+    if(fd < 0){
+        int expected = -1;
         if((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0){
             perror("[ERROR HAPPENED] : Tried to initialize socket when sending a message, but failed");
             return -1;
         }
-        sender_sockets[receiver_id] = fd;
-    } else {
-        fd = sender_sockets[receiver_id];
+        if(!__atomic_compare_exchange_n(&sender_sockets[receiver_id], &expected, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            close(fd);
+            fd = expected;
+        }
     }
+    return fd;
+}
 
-    snprintf(sock_path, sizeof(sock_path), "%s/proc_%d.sock", SOCKET_DIR, receiver_id);
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+void unix_endpoint_address(struct sockaddr_un *addr, int id, int queue){
+    char sock_path[108];
+
+    socket_path(sock_path, sizeof(sock_path), id, queue);
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, sock_path, sizeof(addr->sun_path) - 1);
+}
+
+//A missing receiver is not reported, it has not started yet or is being re-spawned
+int unix_send_error(int receiver_id, int err){
+    if(err == ENOENT){
+        return -1;
+    }
+    if(err == EAGAIN || err == EWOULDBLOCK){
+        fprintf(stderr, "[ERROR HAPPENED] : Send buffer is full, receiver %d is slow\n", receiver_id);
+        return -1;
+    }
+    errno = err;
+    perror("[ERROR HAPPENED] : Sending the message failed");
+    return -1;
+}
+
+//Sends len bytes as one datagram, the data does not have to be a string
+static int unix_send(int receiver_id, int queue, const void *data, size_t msg_len){
+    struct sockaddr_un addr;
+    int fd;
+    ssize_t n;
+
+    if((fd = unix_sender_socket(receiver_id)) < 0){
+        return -1;
+    }
+    unix_endpoint_address(&addr, receiver_id, queue);
 
-    n = sendto(fd, msg, msg_len, 0, (struct sockaddr*)&addr, sizeof(addr));
+    n = sendto(fd, data, msg_len, 0, (struct sockaddr*)&addr, sizeof(addr));
 
     if(n < 0){
-        if(errno == ENOENT){
-            return -1;
-        }
-        if(errno == EAGAIN || errno == EWOULDBLOCK){
-            fprintf(stderr, "[ERROR HAPPENED] : Send buffer is full, receiver %d is slow\n", receiver_id);
-            return -1;
-        }
-        perror("[ERROR HAPPENED] : Sending the message failed");
+        return unix_send_error(receiver_id, errno);
+    }
+    return 0;
+}
+
+//Every message stays one unit on every transport: one datagram, or one frame on a TCP stream
+static int send_message(int receiver_id, int queue, const void *data, size_t msg_len){
+    if(msg_len > MAX_DATAGRAM_SIZE){
+        fprintf(stderr, "[ERROR HAPPENED] : Message size is too large");
+        return -1;
+    }
+    return transport->send(receiver_id, queue, data, msg_len);
+}
+
+//queue < 0 sends to the main socket of the receiver
+int send_msg_to_queue(int sender_id, int receiver_id, int queue, const char *msg){
+    if(send_message(receiver_id, queue, msg, strlen(msg) + 1) < 0){
         return -1;
     }
     printf("[SUCCESS] : Process %d send message to Process %d: %s\n", sender_id, receiver_id, msg);
     return 0;
 }
 
+//For binary payloads, receive_msg returns the exact length so the receiver can parse them
+int send_bytes(int sender_id, int receiver_id, const void *data, size_t len){
+    if(send_message(receiver_id, -1, data, len) < 0){
+        return -1;
+    }
+    printf("[SUCCESS] : Process %d send %zu bytes to Process %d\n", sender_id, len, receiver_id);
+    return 0;
+}
+
+int send_msg(int sender_id, int receiver_id, const char *msg){
+    return send_msg_to_queue(sender_id, receiver_id, -1, msg);
+}
+
 int receive_msg(int fd, char *buf, size_t buf_size){
+    return transport->receive(fd, buf, buf_size);
+}
+
+//Sends to the same receiver are kept back until ipc_uncork and go out together.
+//Per thread, e.g. around one round of an event loop. No-op for Unix datagrams.
+void ipc_cork(){
+    if(transport->cork != NULL) transport->cork();
+}
+
+void ipc_uncork(){
+    if(transport->uncork != NULL) transport->uncork();
+}
+
+static int unix_receive(int fd, char *buf, size_t buf_size){
     ssize_t n = recv(fd, buf, buf_size - 1, 0);
     if(n < 0){
         if(errno == EAGAIN || errno == EWOULDBLOCK){
@@ -136,29 +304,51 @@ int receive_msg(int fd, char *buf, size_t buf_size){
     return n;
 }
 
-void close_communication(int process_id, int fd){
+static void unix_close_endpoint(int id, int queue, int fd){
     char sock_path[108];
 
-    for (int i = 0; i < MAX_PROCESSES; i++){
+    socket_path(sock_path, sizeof(sock_path), id, queue);
+    if(fd >= 0){
+        close(fd);
+    }
+    unlink(sock_path);
+}
+
+static void unix_close_senders(){
+    for (int i = 0; i < num_endpoints; i++){
         if(sender_sockets[i] >= 0){
             close(sender_sockets[i]);
             sender_sockets[i] = -1;
         }
     }
+}
 
-    snprintf(sock_path, sizeof(sock_path), "%s/proc_%d.sock", SOCKET_DIR, process_id);
-    close(fd);
-    unlink(sock_path);
+const Transport unix_transport = {
+    "unix datagram sockets",
+    unix_reserve,
+    unix_open_endpoint,
+    unix_send,
+    unix_receive,
+    unix_close_endpoint,
+    unix_close_senders,
+    NULL,
+    NULL
+};
+
+void close_communication(int process_id, int fd){
+    transport->close_senders();
+    transport->close_endpoint(process_id, -1, fd);
 
     printf("[SUCCESS] Process %d closed communication\n", process_id);
 }
 
-void cleanup_ipc(){
-    for (int i = 0; i < MAX_PROCESSES; i++){
-        if(sender_sockets[i] >= 0){
-            close(sender_sockets[i]);
-            sender_sockets[i] = -1;
-        }
+void close_queue_endpoints(int process_id, int num_queues, const int *fds){
+    for(int q = 0; q < num_queues; q++){
+        transport->close_endpoint(process_id, q, fds[q]);
     }
 }
 
+void cleanup_ipc(){
+    transport->close_senders();
+}
+
@@ -4,10 +4,24 @@
 #define IPC_H
 #include <stddef.h>
 
+#define MAX_DATAGRAM_SIZE 65000
+#define VALUE_INLINE_MAX 16384  //Larger values are passed as a shared memory path and offset instead of bytes
+
+int ipc_use_address_map(const char *path);
+int ipc_use_io_uring();
+void ipc_set_receive_buffer(int bytes);
+int ipc_reserve_endpoints(int count);
 int initiate_communication(int process_id);
+int initiate_queue_endpoints(int process_id, int num_queues, int *fds);
+int pick_receive_queue(int key_or_req, int num_queues);
 int send_msg(int sender_id, int receiver_id, const char *msg);
+int send_msg_to_queue(int sender_id, int receiver_id, int queue, const char *msg);
+int send_bytes(int sender_id, int receiver_id, const void *data, size_t len);
 int receive_msg(int fd, char *buf, size_t buf_size);
+void ipc_cork();
+void ipc_uncork();
 void close_communication(int process_id, int fd);
+void close_queue_endpoints(int process_id, int num_queues, const int *fds);
 void cleanup_ipc();
 
 
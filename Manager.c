@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 199309L
+#define _DEFAULT_SOURCE  //usleep next to the POSIX clocks
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,209 +7,1038 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "IPC.h"
+#include "keyhash.h"
+#include "affinity.h"
+#include "config.h"
+#include "sweep.h"
+#include "workload.h"
 
 
 #define MAX_MSG_LEN 65536 //NEED TO check if it works for our benchmark, it is set to 64kb, the max unix dgram size
-#define BLOOM_EXCHANGE_TIME 30 //MAY NEED TO adapt, I did this for a safe threshold
-#define MAX_KEYS_PER_CHUNK 7000
 
-int num_processes = 64; //Change this for tests
-int keys_per_process = 156250; //NEEd to change this too if needed
+#define MAX_PROCESS_ARGS 64 //process id, snapshot tag, rejoin and every config parameter
+
+//Taken from the config in main, the defaults and their meaning are in config.c
+int num_processes;
+int keys_per_process;
+const char *process_binary;
+unsigned int workload_seed;
+const char *key_file = NULL; //NULL generates the keys, "-" reads text from stdin, *.bin is raw int32 keys
 
 pid_t *process_pids;
 int manager_fd;
 
-int *all_keys;
 int total_keys;
-
-int **process_keys;
 int *process_key_counts;
+uint64_t snapshot_tag = 0;     //id of the workload, processes only restore a snapshot written for the same one
+int *process_restored = NULL;  //process answered SNAPSHOT_LOADED, it gets no keys
+
+//Supervision: SIGCHLD reports crashes, PING/PONG finds processes that hang. A dead or silent process
+//is masked at its peers (PEER_DOWN), a dead one is re-spawned, reloads its keys from its snapshot or
+//from the key stream, and is unmasked (PEER_UP) once it reports READY.
+typedef enum{
+    PROC_UP = 0,
+    PROC_SUSPECT,          //missed heartbeats, masked but still running
+    PROC_RESTARTING        //re-spawned, masked until READY
+} ProcessState;
+
+ProcessState *process_state = NULL;
+long *last_pong_ms = NULL;
+long last_ping_ms = 0;
+unsigned long ping_seq = 0;
+int supervising = 0;           //heartbeats start after the initial load, a build can keep the main loop busy
+int shutting_down = 0;
+int respawns = 0;
+volatile sig_atomic_t child_exited = 0;
+
+//Keys go from their source straight into one KEYS batch per process, the manager never holds the key set.
+//Only a uniform sample (reservoir) is kept to pick queries and deletes from.
+typedef struct KeySource{
+    int (*next)(struct KeySource *src, int *key); //returns 0 once the source is exhausted
+    FILE *file;
+    long total;     //keys the source will produce, -1 if unknown (text and stdin)
+    KeyGenerator generator;  //seeded, a re-spawned process gets the same keys again
+} KeySource;
+
+//Owner of a key, index is its position in the stream
+typedef int (*PlacementFn)(int key, long index);
+
+typedef struct{
+    int key;
+    int owner;
+} SampledKey;
+
+SampledKey *key_sample = NULL;
+int sample_capacity = 0;
+int sample_count = 0;
+WorkloadRng sample_rng;
 
 typedef struct{
     int key;
+    int expected;  //1 if the key was loaded, 0 for the misses of query_hit_ratio
     int answered;
+    int found;
+    int timed_out; //peer(s) never answered, the process gave up after its PQUERY timeout
 } QueryTracker;
 
 QueryTracker *query_trackers = NULL;
 int num_queries_total = 0;
 
+//rejoin tells the process that its peers are already running and have exported their filters
+void spawn_process(int i, int rejoin){
+    pid_t pid = fork();
+
+    if(pid == 0){
+        char process_id_str[10];
+        char snapshot_str[40];
+        char rejoin_str[16];
+        char *args[MAX_PROCESS_ARGS + 1];
+        int num_args = 0;
+        if(config.pin_processes){
+            placement_pin_process(i, config.workers_per_process);
+        }
+        snprintf(process_id_str, sizeof(process_id_str), "%d", i);
+        snprintf(snapshot_str, sizeof(snapshot_str), "--snapshot_tag=%lu", (unsigned long)snapshot_tag);
+        snprintf(rejoin_str, sizeof(rejoin_str), "--rejoin=%d", rejoin);
+        args[num_args++] = "process";
+        args[num_args++] = process_id_str;
+        args[num_args++] = snapshot_str;
+        args[num_args++] = rejoin_str;
+        //The process runs with exactly the manager's configuration
+        num_args += config_to_args(args + num_args, MAX_PROCESS_ARGS - num_args);
+        args[num_args] = NULL;
+
+        execv(process_binary, args);
+        perror("ERROR HAPPENED: execv failed");
+        exit(1);
+    } else if (pid > 0){
+        process_pids[i] = pid;
+        printf("Manager created process %d with PID %d\n", i, pid);
+    } else{
+        perror("ERROR HAPPENED fork failed");
+        exit(1);
+    }
+}
+
 void create_processes(){
     process_pids = malloc(num_processes * sizeof(pid_t));
+    process_state = calloc(num_processes, sizeof(ProcessState));
+    last_pong_ms = calloc(num_processes, sizeof(long));
+    if(process_pids == NULL || process_state == NULL || last_pong_ms == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] Manager failed to allocate the process table\n");
+        exit(1);
+    }
     for (int i = 0; i < num_processes; i++){
-        pid_t pid = fork();
-
-        if(pid == 0){
-            char process_id_str[10];
-            char num_proc_str[10];
-            snprintf(process_id_str, sizeof(process_id_str), "%d", i);
-            snprintf(num_proc_str, sizeof(num_proc_str), "%d", num_processes);
-
-            execl("./process", "process", process_id_str, num_proc_str, NULL);
-            perror("ERROR HAPPENED: execl failed");
-            exit(1);
-        } else if (pid > 0){
-            process_pids[i] = pid;
-            printf("Manager created process %d with PID %d\n", i, pid);
-        } else{
-            perror("ERROR HAPPENED fork failed");
-            exit(1);
-        }
+        spawn_process(i, 0);
     }
     sleep(5); //I did this for safety, we can decrease if needed
 }
 
-void create_random_keys(){
-    total_keys = num_processes * keys_per_process;
-    all_keys = malloc(total_keys*sizeof(int));
+static int next_generated_key(KeySource *src, int *key){
+    return key_generator_next(&src->generator, key);
+}
+
+//Any run of non digits separates keys, so one per line and comma lists both work
+static int next_text_key(KeySource *src, int *key){
+    int c;
+    do {
+        c = getc(src->file);
+    } while(c != EOF && !isdigit(c) && c != '-');
+    if(c == EOF) return 0;
+    ungetc(c, src->file);
+    return fscanf(src->file, "%d", key) == 1;
+}
+
+static int next_binary_key(KeySource *src, int *key){
+    int32_t value;
+    if(fread(&value, sizeof(value), 1, src->file) != 1) return 0;
+    *key = value;
+    return 1;
+}
+
+static int place_by_position(int key, long index){
+    (void)key;
+    return (int)((index / keys_per_process) % num_processes);
+}
 
-    if(all_keys == NULL){
-        fprintf(stderr, "[ERROR HAPPENED] Manager failed to allocate memory for %d keys\n", total_keys);
+//Processes compute the same home with key_home(), so routing skips the filters for these keys
+static int place_by_hash(int key, long index){
+    (void)index;
+    return key_home(key, config.key_placement, num_processes);
+}
+
+PlacementFn place_key = place_by_hash;  //place_by_position for KEY_PLACEMENT_POSITION, set in main
+
+static void open_key_source(KeySource *src){
+    memset(src, 0, sizeof(*src));
+    if(key_file == NULL){
+        src->next = next_generated_key;
+        src->total = (long)num_processes * keys_per_process;
+        key_generator_init(&src->generator, config.key_distribution, src->total, config.key_space,
+                           config.key_zipf_exponent, config.key_cluster_size, workload_seed);
+        printf("Manager generating %ld %s keys below %d\n", src->total, key_distribution_name(config.key_distribution), config.key_space);
+        return;
+    }
+    size_t len = strlen(key_file);
+    int binary = len > 4 && strcmp(key_file + len - 4, ".bin") == 0;
+    src->file = strcmp(key_file, "-") == 0 ? stdin : fopen(key_file, binary ? "rb" : "r");
+    if(src->file == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] Manager could not open key file %s\n", key_file);
         exit(1);
     }
+    src->next = binary ? next_binary_key : next_text_key;
+    struct stat st;
+    src->total = binary && src->file != stdin && fstat(fileno(src->file), &st) == 0 ? (long)(st.st_size / sizeof(int32_t)) : -1;
+    printf("Manager reading keys from %s (%s)\n", strcmp(key_file, "-") == 0 ? "stdin" : key_file, binary ? "binary" : "text");
+}
 
-    process_keys = malloc(num_processes * sizeof(int*));
-    process_key_counts = calloc(num_processes, sizeof(int));
+static void sample_key(int key, int owner, long index){
+    if(sample_count < sample_capacity){
+        key_sample[sample_count].key = key;
+        key_sample[sample_count].owner = owner;
+        sample_count++;
+        return;
+    }
+    long slot = (long)workload_below(&sample_rng, (uint64_t)index + 1);
+    if(slot < sample_capacity){
+        key_sample[slot].key = key;
+        key_sample[slot].owner = owner;
+    }
+}
 
-    for (int p = 0; p < num_processes; p++){
-        process_keys[p] = malloc(keys_per_process * sizeof(int));
+//A lost batch would silently leave its keys out of the benchmark
+static void send_key_batch(int p, char *msg, int *msg_pos, int *keys_in_chunk, int *chunks){
+    if(*keys_in_chunk == 0) return;
+    if(send_msg(num_processes, p, msg) != 0){
+        fprintf(stderr, "[ERROR HAPPENED] Manager could not send %d keys (%d bytes) to process %d\n", *keys_in_chunk, *msg_pos, p);
+        exit(1);
     }
+    *msg_pos = sprintf(msg, "KEYS:");
+    *keys_in_chunk = 0;
+    chunks[p]++;
+    usleep(100);
+}
 
-    printf("Manager creating %d random keys\n", total_keys);
-    srand(time(NULL));
-    for (int i =0; i < total_keys; i++){
-        all_keys[i] = rand() % 100000000; //NEED TO MODIFY THIS ACCORDING TO THE NUMBER OF KEYS
+static int restored_count(){
+    int restored = 0;
+    for(int p = 0; p < num_processes; p++){
+        restored += process_restored[p];
+    }
+    return restored;
+}
 
-        int process_id = i / keys_per_process;
-        int key_index = i % keys_per_process;
-        process_keys[process_id][key_index] = all_keys[i];
-        process_key_counts[process_id]++;
+//Every process reports SNAPSHOT_LOADED:<p>:<keys> or SNAPSHOT_MISSING:<p> right after it starts
+void wait_for_snapshots(){
+    process_restored = calloc(num_processes, sizeof(int));
+    if(process_restored == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] Manager failed to allocate snapshot table\n");
+        exit(1);
+    }
+    if(!config.snapshots) return;
 
-        if((i+1) % 1000000 == 0){
-            printf("Manager created %d/%d keys (%.1f%%)\n", i+1, total_keys, (i+1) * 100.0 / total_keys);
+    char buf[256];
+    int replies = 0;
+    for(int iterations = 0; replies < num_processes && iterations < 20000; ){
+        if(receive_msg(manager_fd, buf, sizeof(buf)) <= 0){
+            usleep(100);
+            iterations++;
+            continue;
+        }
+        if(strncmp(buf, "SNAPSHOT_LOADED:", 16) == 0){
+            int p = atoi(buf + 16);
+            if(p >= 0 && p < num_processes) process_restored[p] = 1;
+            replies++;
+        } else if(strncmp(buf, "SNAPSHOT_MISSING:", 17) == 0){
+            replies++;
         }
     }
-    printf("MANAGER created %d random keys \n", total_keys);
+    printf("Manager: %d of %d processes restored from snapshots, the others get their keys streamed\n", restored_count(), num_processes);
 }
 
-void assign_random_keys_chuncked(){
-    printf("\nManager starting chuncked key assignment\n");
+//Processes with skip[p] set get nothing: restored from a snapshot, or still running while another one
+//is re-spawned. Only the initial pass counts the keys and samples the query keys, a replay after a
+//re-spawn reads the same stream again (generated keys use their own seeded generator).
+static void stream_keys(const int *skip, int initial){
+    KeySource src;
+    open_key_source(&src);
+
+    char **batches = malloc(num_processes * sizeof(char*));
+    int *batch_pos = malloc(num_processes * sizeof(int));
+    int *batch_keys = calloc(num_processes, sizeof(int));
+    int *chunks = calloc(num_processes, sizeof(int));
+    if(batches == NULL || batch_pos == NULL || batch_keys == NULL || chunks == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] Manager failed to allocate key batches\n");
+        exit(1);
+    }
     for(int p = 0; p < num_processes; p++){
-        int start_idx = p * keys_per_process;
-        int keys_sent = 0;
-        int chunk_num = 0;
+        batches[p] = malloc(MAX_MSG_LEN);
+        if(batches[p] == NULL){
+            fprintf(stderr, "[ERROR HAPPENED] Manager failed to allocate key batches\n");
+            exit(1);
+        }
+        batch_pos[p] = sprintf(batches[p], "KEYS:");
+    }
 
-        printf("Manager sends %d keys to process %d", keys_per_process, p);
+    int replicas = config.replication_factor < num_processes ? config.replication_factor : num_processes;
+    //Processes size their key arena from this, hash placement gets some slack over the average
+    if(src.total > 0){
+        long expected = src.total * replicas / num_processes;
+        if(config.key_placement != KEY_PLACEMENT_POSITION) expected += expected / 50 + 1000;
+        char msg[64];
+        snprintf(msg, sizeof(msg), "KEYS_EXPECTED:%ld", expected);
+        for(int p = 0; p < num_processes; p++){
+            if(!skip[p]) send_msg(num_processes, p, msg);
+        }
+    }
+    long index = 0;
+    int key;
+    while(src.next(&src, &key)){
+        int home = place_key(key, index);
+        for(int r = 0; r < replicas; r++){
+            int p = (home + r) % num_processes;
+            if(initial) process_key_counts[p]++;
+            if(skip[p]) continue;
+            char key_str[20];
+            int key_str_len = snprintf(key_str, sizeof(key_str), batch_keys[p] == 0 ? "%d" : ",%d", key);
+            //The batch and its terminating zero have to fit one datagram
+            if(batch_pos[p] + key_str_len > MAX_DATAGRAM_SIZE - 1 || batch_keys[p] >= config.max_keys_per_chunk){
+                send_key_batch(p, batches[p], &batch_pos[p], &batch_keys[p], chunks);
+                key_str_len = snprintf(key_str, sizeof(key_str), "%d", key);
+            }
+            memcpy(batches[p] + batch_pos[p], key_str, key_str_len + 1);
+            batch_pos[p] += key_str_len;
+            batch_keys[p]++;
+        }
+        if(initial) sample_key(key, home, index);
+        index++;
 
-        time_t start_time = time(NULL);
+        if(initial && index % 1000000 == 0){
+            printf("Manager streamed %ld keys\n", index);
+        }
+    }
+    if(src.file != NULL && src.file != stdin) fclose(src.file);
+    if(initial) total_keys = (int)index;
 
-        while(keys_sent < keys_per_process){
-            char msg[MAX_MSG_LEN];
-            int msg_pos = sprintf(msg, "KEYS:");
-            int keys_in_chunk = 0;
+    for(int p = 0; p < num_processes; p++){
+        send_key_batch(p, batches[p], &batch_pos[p], &batch_keys[p], chunks);
+        if(!skip[p]){
+            send_msg(num_processes, p, "KEYS_DONE");
+            printf("Manager completed %d keys in %d chunks to process %d\n", process_key_counts[p], chunks[p], p);
+        }
+        free(batches[p]);
+    }
+    free(batches);
+    free(batch_pos);
+    free(batch_keys);
+    free(chunks);
+}
 
-            while(keys_sent < keys_per_process && keys_in_chunk < MAX_KEYS_PER_CHUNK){
-                char key_str[20];
-                int key_str_len;
+static long now_ms(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
 
-                if(keys_in_chunk == 0){
-                    key_str_len = snprintf(key_str, sizeof(key_str), "%d", all_keys[start_idx + keys_sent]);
-                } else {
-                    key_str_len = snprintf(key_str, sizeof(key_str), ",%d", all_keys[start_idx + keys_sent]);
-                }
+static void on_child_exit(int signum){
+    (void)signum;
+    child_exited = 1;
+}
+
+//"PEER_DOWN:<p>" or "PEER_UP:<p>" to every other process
+static void broadcast_peer_state(int p, const char *state){
+    char msg[32];
+    snprintf(msg, sizeof(msg), "%s:%d", state, p);
+    for(int q = 0; q < num_processes; q++){
+        if(q != p) send_msg(num_processes, q, msg);
+    }
+}
 
-                if(msg_pos + key_str_len >= MAX_MSG_LEN - 1) break;
+static void restream_keys(int p){
+    if(key_file != NULL && strcmp(key_file, "-") == 0){
+        fprintf(stderr, "[ERROR HAPPENED] Manager cannot read stdin again, re-spawned process %d stays masked\n", p);
+        return;
+    }
+    int *skip = malloc(num_processes * sizeof(int));
+    if(skip == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] Manager failed to allocate key batches\n");
+        return;
+    }
+    for(int q = 0; q < num_processes; q++){
+        skip[q] = q != p;
+    }
+    printf("Manager streaming the keys of process %d again\n", p);
+    stream_keys(skip, 0);
+    free(skip);
+}
 
-                strcpy(msg + msg_pos, key_str);
-                msg_pos += key_str_len;
-                keys_in_chunk++;
-                keys_sent++;
-            }
+static void respawn_process(int p, int status){
+    if(WIFSIGNALED(status)){
+        printf("Manager: process %d (PID %d) was killed by signal %d, re-spawning it\n", p, process_pids[p], WTERMSIG(status));
+    } else {
+        printf("Manager: process %d (PID %d) exited with status %d, re-spawning it\n", p, process_pids[p], WEXITSTATUS(status));
+    }
+    if(process_state[p] == PROC_UP) broadcast_peer_state(p, "PEER_DOWN");
+    process_state[p] = PROC_RESTARTING;
+    last_pong_ms[p] = now_ms();
+    respawns++;
+    spawn_process(p, 1);
+}
+
+//Returns 1 if buf was a supervision message, the reply loops skip it then
+int handle_supervision_message(const char *buf){
+    int p;
+    if(strncmp(buf, "PONG:", 5) == 0){
+        p = atoi(buf + 5);
+        if(p < 0 || p >= num_processes) return 1;
+        last_pong_ms[p] = now_ms();
+        if(process_state[p] == PROC_SUSPECT){
+            printf("Manager: process %d answers again, unmasking it\n", p);
+            process_state[p] = PROC_UP;
+            broadcast_peer_state(p, "PEER_UP");
+        }
+        return 1;
+    }
+    if(strncmp(buf, "READY:", 6) == 0){
+        p = atoi(buf + 6);
+        if(p < 0 || p >= num_processes || process_state[p] != PROC_RESTARTING) return 1;
+        printf("Manager: re-spawned process %d is ready, unmasking it\n", p);
+        process_state[p] = PROC_UP;
+        last_pong_ms[p] = now_ms();
+        broadcast_peer_state(p, "PEER_UP");
+        //The new process starts with every peer up
+        char msg[32];
+        for(int q = 0; q < num_processes; q++){
+            if(q == p || process_state[q] == PROC_UP) continue;
+            snprintf(msg, sizeof(msg), "PEER_DOWN:%d", q);
             send_msg(num_processes, p, msg);
-            chunk_num++;
+        }
+        return 1;
+    }
+    if(strncmp(buf, "SNAPSHOT_MISSING:", 17) == 0){
+        p = atoi(buf + 17);
+        if(p >= 0 && p < num_processes && process_state[p] == PROC_RESTARTING) restream_keys(p);
+        return 1;
+    }
+    return strncmp(buf, "SNAPSHOT_LOADED:", 16) == 0;
+}
 
-            if(chunk_num % 100 == 0){
-                printf("Manager send %d/%d keys (%.1f%%) - %d chunks to process %d \n", keys_sent, keys_per_process, keys_sent * 100.0 / keys_per_process, chunk_num, p);
+//Called from every idle branch of the reply loops once the keys are loaded
+void supervise(){
+    if(!supervising || shutting_down) return;
+    if(child_exited){
+        child_exited = 0;
+        int status;
+        pid_t pid;
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+            for(int p = 0; p < num_processes; p++){
+                if(process_pids[p] == pid) respawn_process(p, status);
             }
-            usleep(100);
         }
-        send_msg(num_processes, p, "KEYS_DONE");
-        time_t end_time = time(NULL);
-        printf("Manager completed %d keys in %d chunks to process %d ( took %ld seconds)\n", keys_sent, chunk_num, p, end_time - start_time);
     }
-    printf("\n Manager assigned all keys. Waiting %d seconds for bloom filter exchange\n", BLOOM_EXCHANGE_TIME);
-    sleep(BLOOM_EXCHANGE_TIME);
+
+    long now = now_ms();
+    if(now - last_ping_ms < config.heartbeat_ms) return;
+    //The manager itself was busy (streaming keys, writing values), nobody could answer
+    if(now - last_ping_ms > config.heartbeat_timeout_ms){
+        for(int p = 0; p < num_processes; p++){
+            last_pong_ms[p] = now;
+        }
+    }
+    last_ping_ms = now;
+    ping_seq++;
+    char msg[32];
+    snprintf(msg, sizeof(msg), "PING:%lu", ping_seq);
+    for(int p = 0; p < num_processes; p++){
+        //A re-spawned process is busy loading its keys until READY
+        if(process_state[p] == PROC_RESTARTING) continue;
+        send_msg(num_processes, p, msg);
+        long silent = now - last_pong_ms[p];
+        if(process_state[p] == PROC_UP && silent > config.heartbeat_timeout_ms){
+            printf("Manager: process %d missed heartbeats for %ld ms, masking it\n", p, silent);
+            process_state[p] = PROC_SUSPECT;
+            broadcast_peer_state(p, "PEER_DOWN");
+        } else if(process_state[p] == PROC_SUSPECT && silent > config.heartbeat_kill_ms){
+            printf("Manager: process %d silent for %ld ms, killing it\n", p, silent);
+            kill(process_pids[p], SIGKILL); //reaped and re-spawned through SIGCHLD
+        }
+    }
 }
 
+//Heartbeats start over, whatever kept the manager from pinging does not count as silence
+static void resume_supervision(){
+    long now = now_ms();
+    for(int p = 0; p < num_processes; p++){
+        last_pong_ms[p] = now;
+    }
+    last_ping_ms = now;
+    supervising = 1;
+}
 
-void process_has_key(int process_id, int key){
-    for(int i = 0; i < process_key_counts[process_id]; i++){
-        if(process_keys[process_id][i] == key){
-            return 1;
+//Replaces plain sleeps once processes are supervised. Other replies that arrive meanwhile are dropped.
+static void wait_supervised(long ms, int until_all_up){
+    char buf[256];
+    long end = now_ms() + ms;
+    while(now_ms() < end){
+        if(until_all_up){
+            int up = 0;
+            for(int p = 0; p < num_processes; p++){
+                up += process_state[p] == PROC_UP;
+            }
+            if(up == num_processes) return;
+        }
+        if(receive_msg(manager_fd, buf, sizeof(buf)) > 0){
+            handle_supervision_message(buf);
+            continue;
         }
+        supervise();
+        usleep(1000);
     }
-    return 0;
 }
 
-void handle_process_response(const char *msg){
-    if(strncmp(msg, "FOUND:", 6) == 0){
-        int key = atoi(msg + 6);
-        const char *process_marker = strstr(msg, ":PROCESS_");
+void assign_keys_streamed(){
+    printf("\nManager starting streamed key assignment\n");
+    time_t start_time = time(NULL);
+    workload_rng_seed(&sample_rng, workload_seed, WORKLOAD_STREAM_SAMPLE);
+
+    sample_capacity = config.num_queries + config.num_updates;
+    key_sample = malloc(sample_capacity * sizeof(SampledKey));
+    process_key_counts = calloc(num_processes, sizeof(int));
+    if(key_sample == NULL || process_key_counts == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] Manager failed to allocate key batches\n");
+        exit(1);
+    }
+    stream_keys(process_restored, 1);
+
+    time_t end_time = time(NULL);
+    printf("MANAGER streamed %d keys to %d processes in %ld seconds\n", total_keys, num_processes, end_time - start_time);
+    printf("\n Manager assigned all keys. Waiting %d seconds for bloom filter exchange\n", config.bloom_exchange_time);
+    sleep(config.bloom_exchange_time);
+    resume_supervision();
+}
+
+//Trackers are already updated by the collection loop, this only reports what came back.
+//entry is one element of a FOUND/NOTFOUND list, e.g. "123:PROCESS_4" or "123:CHECKED_BY_PROCESS_2:TIMEOUT"
+//expected is 0 for the keys query_hit_ratio asks for although nobody holds them
+void handle_process_response(const char *entry, int found, int expected){
+    int key = atoi(entry);
+    if(found){
+        const char *process_marker = strstr(entry, ":PROCESS_");
         int found_in_process = -1;
         if(process_marker != NULL){
             found_in_process = atoi(process_marker+9);
         }
+        printf("USER RECEIVED RESPONSE FOR KEY %d by Process %d\n", key, found_in_process);
+    } else {
+        const char *process_marker = strstr(entry, ":CHECKED_BY_PROCESS_");
+        int checked_process = -1;
+        if(process_marker != NULL){
+            checked_process = atoi(process_marker + 20);
+        }
+        printf("Manager received not found signal for Key %d Checked by process %d\n", key, checked_process);
+        if(strstr(entry, ":TIMEOUT") != NULL){
+            printf("  ✗ KEY %d NOT FOUND (peer did not answer in time)\n", key);
+        } else if(!expected){
+            printf("  ✓ KEY %d NOT FOUND (not in the key set)\n", key);
+        } else {
+            printf("  ✗ KEY %d NOT FOUND (ERROR - should exist!)\n", key);
+        }
+    }
+}
+
+static int compare_doubles(const void *a, const void *b){
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+//Peak and current resident memory of every process, read before they are stopped
+void report_process_memory(){
+    long total_peak = 0, max_peak = 0;
+    int reported = 0;
+    for(int i = 0; i < num_processes; i++){
+        char path[64], line[256];
+        snprintf(path, sizeof(path), "/proc/%d/status", process_pids[i]);
+        FILE *f = fopen(path, "r");
+        if(f == NULL) continue;
+        long peak_kb = -1, rss_kb = -1;
+        while(fgets(line, sizeof(line), f) != NULL){
+            if(strncmp(line, "VmHWM:", 6) == 0) peak_kb = atol(line + 6);
+            if(strncmp(line, "VmRSS:", 6) == 0) rss_kb = atol(line + 6);
+        }
+        fclose(f);
+        printf("[BENCH] Process %d peak_rss_kb %ld rss_kb %ld\n", i, peak_kb, rss_kb);
+        if(peak_kb > max_peak) max_peak = peak_kb;
+        total_peak += peak_kb;
+        reported++;
+    }
+    if(reported > 0){
+        printf("    Peak memory per process: avg %ld KB, max %ld KB\n", total_peak / reported, max_peak);
+    }
+}
+
+//Collects reply lists until expected entries arrived or ~2 seconds passed.
+//keys[i] is marked in result[i] with 1 for FOUND/UPDATED entries and 0 for NOTFOUND ones.
+static int collect_entries(const char *prefix, const int *keys, int *result, int n, int expected){
+    char buf[MAX_MSG_LEN];
+    int collected = 0;
+    size_t prefix_len = strlen(prefix);
+    for(int iterations = 0; collected < expected && iterations < 20000; ){
+        if(receive_msg(manager_fd, buf, sizeof(buf)) <= 0){
+            supervise();
+            usleep(100);
+            iterations++;
+            continue;
+        }
+        if(handle_supervision_message(buf)) continue;
+        int found = 1;
+        const char *entry;
+        if(strncmp(buf, prefix, prefix_len) == 0){
+            entry = buf + prefix_len;
+        } else if(strncmp(prefix, "FOUND:", 6) == 0 && strncmp(buf, "NOTFOUND:", 9) == 0){
+            entry = buf + 9;
+            found = 0;
+        } else {
+            continue;
+        }
+        while(entry != NULL && *entry != '\0'){
+            int key = atoi(entry);
+            for(int i = 0; i < n; i++){
+                if(keys[i] == key && result[i] < 0){
+                    result[i] = found;
+                    collected++;
+                    break;
+                }
+            }
+            entry = strchr(entry, ',');
+            if(entry != NULL) entry++;
+        }
+    }
+    return collected;
+}
+
+//Checks PUT/DELETE end to end: new keys have to be found and deleted ones not,
+//both asked at a process that does not own them so the peer filter sync is exercised
+void run_update_check(){
+    if(config.num_updates <= 0 || sample_count == 0) return;
+    int n = config.num_updates;
+    int *update_keys = malloc(2 * n * sizeof(int));
+    int *owners = malloc(2 * n * sizeof(int));
+    int *result = malloc(2 * n * sizeof(int));
+    char msg[64];
+    WorkloadRng rng;
+    workload_rng_seed(&rng, workload_seed, WORKLOAD_STREAM_UPDATES);
+
+    printf("\n[Manager] Update check: adding %d keys and deleting %d keys\n", n, n);
+    for(int i = 0; i < n; i++){
+        update_keys[i] = config.key_space + i; //generated keys are below key_space, these are new
+        owners[i] = (int)workload_below(&rng, num_processes);
+        //The sample holds config.num_queries + config.num_updates keys, the tail was not queried
+        SampledKey *old = &key_sample[(config.num_queries + i) % sample_count];
+        update_keys[n + i] = old->key;
+        owners[n + i] = old->owner;
+    }
+    //New keys go to one process only, deletes have to reach every replica
+    int replicas = config.replication_factor < num_processes ? config.replication_factor : num_processes;
+    int num_acks = n + n * replicas;
+    int *ack_keys = malloc(num_acks * sizeof(int));
+    int *ack_result = malloc(num_acks * sizeof(int));
+    int sent = 0;
+    for(int i = 0; i < 2 * n; i++){
+        snprintf(msg, sizeof(msg), "%s:%d", i < n ? "PUT" : "DELETE", update_keys[i]);
+        for(int r = 0; r < (i < n ? 1 : replicas); r++){
+            send_msg(num_processes, (owners[i] + r) % num_processes, msg);
+            ack_keys[sent] = update_keys[i];
+            ack_result[sent++] = -1;
+        }
+    }
+    int acked = collect_entries("UPDATED:", ack_keys, ack_result, num_acks, num_acks);
+    free(ack_keys);
+    free(ack_result);
+
+    //Peers pull filter changes every FILTER_SYNC_MS (200 ms in Process.c), wait for a couple of rounds
+    wait_supervised(500, 0);
+
+    for(int i = 0; i < 2 * n; i++){
+        snprintf(msg, sizeof(msg), "QUERY:%d", update_keys[i]);
+        send_msg(num_processes, (owners[i] + replicas) % num_processes, msg);
+        result[i] = -1;
+    }
+    collect_entries("FOUND:", update_keys, result, 2 * n, 2 * n);
+
+    int puts_found = 0, deletes_gone = 0;
+    for(int i = 0; i < n; i++){
+        if(result[i] == 1) puts_found++;
+        if(result[n + i] == 0) deletes_gone++;
+    }
+    printf("    Updates acked: %d/%d\n", acked, num_acks);
+    printf("    New keys found: %d/%d, deleted keys gone: %d/%d\n", puts_found, n, deletes_gone, n);
+
+    free(update_keys);
+    free(owners);
+    free(result);
+}
+
+//Checkpoints the loaded keys for the next start. Runs before the update and value checks: what they
+//PUT, DELETE and SET depends on num_queries and num_updates, which the snapshot tag does not cover
+void write_snapshots(){
+    if(!config.snapshots) return;
+    int *ids = malloc(num_processes * sizeof(int));
+    int *result = malloc(num_processes * sizeof(int));
+    for(int p = 0; p < num_processes; p++){
+        ids[p] = p;
+        result[p] = -1;
+        send_msg(num_processes, p, "SNAPSHOT");
+    }
+    int written = collect_entries("SNAPSHOT_DONE:", ids, result, num_processes, num_processes);
+    printf("    Snapshots written: %d/%d\n", written, num_processes);
+    free(ids);
+    free(result);
+}
+
+//Deterministic value of the i-th checked key, every 4th one is too big to go inline
+static int value_length(int i, int key){
+    return i % 4 == 3 ? VALUE_INLINE_MAX + 1000 * i : 1 + key % 2000;
+}
+
+static char value_byte(int key, int j){
+    return (char)(key * 31 + j * 7);
+}
+
+static int value_matches(int i, int key, const char *data, long len){
+    if(len != value_length(i, key)) return 0;
+    for(long j = 0; j < len; j++){
+        if(data[j] != value_byte(key, j)) return 0;
+    }
+    return 1;
+}
+
+//Compares a VALUE or VALUE_SHM reply with what was SET, returns the key or -1 if the reply is broken
+static int check_value_reply(const char *buf, int n, const int *keys, int *result, int count){
+    int shm = strncmp(buf, "VALUE_SHM:", 10) == 0;
+    char *end;
+    int key = (int)strtol(buf + (shm ? 10 : 6), &end, 10);
+    const char *marker = strstr(end, ":PROCESS_");
+    if(marker == NULL) return -1;
+    strtol(marker + 9, &end, 10);
+    long len = strtol(end + 1, &end, 10);
+    if(*end != ':') return -1;
+
+    int i = 0;
+    while(i < count && keys[i] != key) i++;
+    if(i == count || result[i] >= 0) return key;
 
-        for(int i = 0; i < num_queries_total; i++){
-            if(query_trackers[i].key == key && !query_trackers[i].answered){
-                query_trackers[i].answered = 1;
-                printf("USER RECEIVED RESPONSE FOR KEY %d by Process %d\n", key, found_in_process);
-                break;
+    if(!shm){
+        result[i] = (end + 1 + len <= buf + n) && value_matches(i, key, end + 1, len);
+        return key;
+    }
+    char path[128];
+    unsigned long offset = 0;
+    if(sscanf(end + 1, "%127[^:]:%lu", path, &offset) != 2) return -1;
+    char *data = malloc(len > 0 ? len : 1);
+    int fd = open(path, O_RDONLY);
+    result[i] = data != NULL && fd >= 0 && lseek(fd, (off_t)offset, SEEK_SET) == (off_t)offset &&
+                read(fd, data, len) == len && value_matches(i, key, data, len);
+    if(fd >= 0) close(fd);
+    free(data);
+    return key;
+}
+
+//Checks SET/GET end to end: values are written to every replica and read back through
+//a process that does not hold the key, so the PGET path and the shared memory values are used
+void run_value_check(){
+    int n = config.num_values;
+    int queried = sample_count < config.num_queries ? sample_count : config.num_queries;
+    if(n > queried) n = queried;
+    if(n <= 0) return;
+
+    int replicas = config.replication_factor < num_processes ? config.replication_factor : num_processes;
+    int *keys = malloc(n * sizeof(int));
+    int *result = malloc(n * sizeof(int));
+    int *ack_keys = malloc(n * replicas * sizeof(int));
+    int *ack_result = malloc(n * replicas * sizeof(int));
+    char *msg = malloc(MAX_MSG_LEN);
+    char path[128];
+
+    printf("\n[Manager] Value check: setting %d values\n", n);
+    int sent = 0;
+    for(int i = 0; i < n; i++){
+        keys[i] = key_sample[i].key;
+        int len = value_length(i, keys[i]);
+        int msg_len;
+        if(len <= VALUE_INLINE_MAX){
+            msg_len = snprintf(msg, MAX_MSG_LEN, "SET:%d:%d:", keys[i], len);
+            for(int j = 0; j < len; j++) msg[msg_len + j] = value_byte(keys[i], j);
+            msg_len += len;
+        } else {
+            snprintf(path, sizeof(path), "/dev/shm/manager_value_%d.val", i);
+            FILE *f = fopen(path, "wb");
+            if(f == NULL){
+                fprintf(stderr, "[ERROR HAPPENED] Manager could not write %s\n", path);
+                continue;
             }
+            for(int j = 0; j < len; j++) fputc(value_byte(keys[i], j), f);
+            fclose(f);
+            msg_len = snprintf(msg, MAX_MSG_LEN, "SET_SHM:%d:%d:%s", keys[i], len, path);
         }
-        
-    } else if(strncmp(msg, "NOTFOUND:", 9) == 0){
-        int key = atoi(msg + 9);
-        const char *process_marker = strstr(msg, ":CHECKED_BY_PROCESS_");
-        int checked_process = -1;
-        if(process_marker != NULL){
-            printf("Manager received not found signal for Key %d Checked by process %d\n", key, checked_process);
+        for(int r = 0; r < replicas; r++){
+            send_bytes(num_processes, (key_sample[i].owner + r) % num_processes, msg, msg_len);
+            ack_keys[sent] = keys[i];
+            ack_result[sent++] = -1;
         }
-        for (int i = 0; i < num_queries_total; i++) {
-            if (query_trackers[i].key == key && !query_trackers[i].answered) {
-                query_trackers[i].answered = 1;
-                printf("  ✗ KEY %d NOT FOUND (ERROR - should exist!)\n", key);
-                break;
+    }
+    int acked = collect_entries("UPDATED:", ack_keys, ack_result, sent, sent);
+    //The processes copied the large values out of the files while handling SET_SHM
+    for(int i = 3; i < n; i += 4){
+        snprintf(path, sizeof(path), "/dev/shm/manager_value_%d.val", i);
+        unlink(path);
+    }
+
+    for(int i = 0; i < n; i++){
+        snprintf(msg, MAX_MSG_LEN, "GET:%d", keys[i]);
+        send_msg(num_processes, (key_sample[i].owner + replicas) % num_processes, msg);
+        result[i] = -1;
+    }
+    int collected = 0;
+    for(int iterations = 0; collected < n && iterations < 20000; ){
+        int len = receive_msg(manager_fd, msg, MAX_MSG_LEN);
+        if(len <= 0){
+            supervise();
+            usleep(100);
+            iterations++;
+            continue;
+        }
+        if(handle_supervision_message(msg)) continue;
+        if(strncmp(msg, "VALUE", 5) == 0){
+            if(check_value_reply(msg, len, keys, result, n) >= 0) collected++;
+        } else if(strncmp(msg, "NOTFOUND:", 9) == 0){
+            int key = atoi(msg + 9);
+            for(int i = 0; i < n; i++){
+                if(keys[i] == key && result[i] < 0){
+                    result[i] = 0;
+                    collected++;
+                    break;
+                }
             }
         }
     }
+
+    int matched = 0;
+    for(int i = 0; i < n; i++){
+        if(result[i] == 1) matched++;
+    }
+    printf("    Values acked: %d/%d\n", acked, sent);
+    printf("    Values read back: %d/%d (%d large)\n", matched, n, n / 4);
+
+    free(keys);
+    free(result);
+    free(ack_keys);
+    free(ack_result);
+    free(msg);
+}
+
+//Keys nobody holds: above key_space and above the keys the update check adds.
+//A key file can hold keys up there, such a miss is found then.
+static int miss_key(WorkloadRng *rng){
+    long first = (long)config.key_space + config.num_updates;
+    return (int)(first + (long)workload_below(rng, (uint64_t)(2147483647L - first)));
 }
 
-int main(){
+//Picks the key and the target process of every query from the query stream, so a seed gives the same
+//queries whatever else changes. Hits come from the sample of loaded keys, each one once in order or,
+//with query_locality, zipf distributed over it so hot keys are asked again.
+static void pick_queries(int num_queries, int *query_targets){
+    WorkloadRng rng;
+    ZipfSampler hot;
+    int replicas = config.replication_factor < num_processes ? config.replication_factor : num_processes;
+    int next_hit = 0, hits = 0, local = 0;
+    workload_rng_seed(&rng, workload_seed, WORKLOAD_STREAM_QUERIES);
+    if(config.query_locality > 0) zipf_init(&hot, num_queries, config.query_locality);
+
+    for(int i = 0; i < num_queries; i++){
+        QueryTracker *q = &query_trackers[i];
+        int owner = -1;
+        if(workload_unit(&rng) < config.query_hit_ratio){
+            int k = config.query_locality > 0 ? (int)zipf_sample(&hot, &rng) : next_hit++;
+            q->key = key_sample[k].key;
+            q->expected = 1;
+            owner = key_sample[k].owner;
+            hits++;
+        } else {
+            q->key = miss_key(&rng);
+            q->expected = 0;
+        }
+        q->answered = 0;
+
+        //Local hits go to one of the key's replicas, if it is up
+        if(owner >= 0 && workload_unit(&rng) >= config.query_remote_share){
+            int target = (owner + (int)workload_below(&rng, replicas)) % num_processes;
+            if(process_state[target] == PROC_UP){
+                query_targets[i] = target;
+                local++;
+                continue;
+            }
+        }
+        int target_process;
+        int attempts = 0;
+        //Ask a process without a replica so the query really has to be routed, and one that is up
+        do {
+            target_process = (int)workload_below(&rng, num_processes);
+        } while ((owner >= 0 && (target_process - owner + num_processes) % num_processes < config.replication_factor &&
+                  num_processes > config.replication_factor) ||
+                 (process_state[target_process] != PROC_UP && ++attempts < 1000));
+        query_targets[i] = target_process;
+    }
+    printf("[Manager] Query stream: %d hits (%d asked where the key lives), %d misses\n", hits, local, num_queries - hits);
+}
+
+//usage: ./manager [process_binary] [seed] [key_file] [num_processes] [--name=value ...] [--config=path]
+//                 [--sweep="name=v1,v2 name=v1,v2 ..."]
+//The positional arguments are the engine, seed, key_file and num_processes parameters. Parameters
+//are applied in the order given, ./manager --help lists them. An empty key_file ("") generates the keys.
+int main(int argc, char *argv[]){
+    static const char *positional_params[] = {"engine", "seed", "key_file", "num_processes"};
+    int num_positional = 0;
+    const char *sweep = NULL;
+    int print_config = 0;
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--help") == 0){
+            printf("usage: %s [process_binary] [seed] [key_file] [num_processes] [--name=value ...] [--config=path]\n", argv[0]);
+            printf("       [--sweep=\"name=v1,v2 name=v1,v2 ...\"] [--print_config]\n");
+            config_usage(stdout);
+            return 0;
+        }
+        if(strcmp(argv[i], "--print_config") == 0){
+            print_config = 1;
+            continue;
+        }
+        if(strncmp(argv[i], "--sweep=", 8) == 0){
+            sweep = argv[i] + 8;
+            continue;
+        }
+        int applied = config_apply_arg(argv[i]);
+        if(applied < 0){
+            return 1;
+        }
+        if(applied == 0){
+            if(num_positional == 4 || config_set(positional_params[num_positional], argv[i]) != 0){
+                fprintf(stderr, "[ERROR HAPPENED] Manager does not know what to do with %s, see --help\n", argv[i]);
+                return 1;
+            }
+            num_positional++;
+        }
+    }
+    if(print_config){
+        config_print(stdout);
+        return 0;
+    }
+    if(sweep != NULL){
+        return run_sweep(sweep, argc, argv);
+    }
+    num_processes = config.num_processes;
+    keys_per_process = config.keys_per_process;
+    process_binary = config.engine;
+    //A typo in the engine would otherwise have the supervisor re-spawn failing processes forever
+    if(access(process_binary, X_OK) != 0){
+        fprintf(stderr, "[ERROR HAPPENED] Manager cannot run the engine %s\n", process_binary);
+        return 1;
+    }
+    workload_seed = config.seed >= 0 ? (unsigned int)config.seed : (unsigned int)time(NULL);
+    config.seed = workload_seed;
+    key_file = config.key_file[0] != '\0' ? config.key_file : NULL;
+    //key_home has no home for other values, every key would go to process -1
+    if(config.key_placement > KEY_PLACEMENT_JUMP){
+        fprintf(stderr, "[ERROR HAPPENED] Manager: key_placement %d does not exist, see --help\n", config.key_placement);
+        return 1;
+    }
+    place_key = config.key_placement == KEY_PLACEMENT_POSITION ? place_by_position : place_by_hash;
+    if(config.query_hit_ratio > 1 || config.query_remote_share > 1){
+        fprintf(stderr, "[ERROR HAPPENED] Manager: query_hit_ratio and query_remote_share are shares, at most 1\n");
+        return 1;
+    }
+    if(config.key_distribution >= KEY_DIST_COUNT){
+        fprintf(stderr, "[ERROR HAPPENED] Manager: key_distribution %d does not exist, see --help\n", config.key_distribution);
+        return 1;
+    }
+    //New keys of the update check and the misses of the queries live above the key space
+    if((long)config.key_space + config.num_updates >= 2147483647L){
+        fprintf(stderr, "[ERROR HAPPENED] Manager: key_space + num_updates has to stay below 2147483647\n");
+        return 1;
+    }
+    long key_capacity = key_generator_capacity(config.key_distribution, config.key_space, config.key_cluster_size);
+    if(key_file == NULL && key_capacity >= 0 && (long)num_processes * keys_per_process > key_capacity){
+        fprintf(stderr, "[ERROR HAPPENED] Manager: %s keys below %d are only %ld distinct ones, %ld asked\n",
+                key_distribution_name(config.key_distribution), config.key_space, key_capacity, (long)num_processes * keys_per_process);
+        return 1;
+    }
+    ipc_set_receive_buffer(config.socket_rcvbuf);
+
     printf("\n");
     printf("------------------------------------------------------------\n");
     printf("Summary Cache Bloom Test - 10000000 keys\n");
     printf("------------------------------------------------------------\n");
     printf("Process count: %d\n", num_processes);
-    printf("Keys per process : %d\n", keys_per_process);
-    printf("Total keys : %d\n", num_processes * keys_per_process);
+    if(key_file == NULL){
+        printf("Keys per process : %d\n", keys_per_process);
+        printf("Total keys : %d\n", num_processes * keys_per_process);
+    } else {
+        printf("Key file : %s\n", key_file);
+    }
+    printf("Engine : %s, seed %u\n", process_binary, workload_seed);
 
     time_t total_start = time(NULL);
 
-    
+    if(config.address_map[0] != '\0' && ipc_use_address_map(config.address_map) != 0){
+        return 1;
+    }
+    if(config.io_uring){
+        ipc_use_io_uring();
+    }
+    ipc_reserve_endpoints(num_processes + 1); //the manager is endpoint num_processes
     manager_fd = initiate_communication(num_processes);
 
+    if(config.pin_processes && placement_init() > 1){
+        placement_pin_manager();
+    }
+    if(config.snapshots){
+        //Seed, key source, key distribution and key count decide which keys a process holds
+        snapshot_tag = key_hash64((uint64_t)workload_seed ^ ((uint64_t)keys_per_process << 32));
+        for(const char *c = key_file; c != NULL && *c != '\0'; c++){
+            snapshot_tag = key_hash64(snapshot_tag ^ (uint8_t)*c);
+        }
+        if(key_file == NULL){
+            snapshot_tag = key_hash64(snapshot_tag ^ ((uint64_t)config.key_distribution << 32 | (uint32_t)config.key_space));
+            snapshot_tag = key_hash64(snapshot_tag ^ ((uint64_t)config.key_cluster_size << 32) ^ (uint64_t)(config.key_zipf_exponent * 1000000));
+        }
+        snapshot_tag |= 1;
+    }
+    struct sigaction child_action;
+    memset(&child_action, 0, sizeof(child_action));
+    child_action.sa_handler = on_child_exit;
+    child_action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &child_action, NULL);
+
     create_processes();
-    create_random_keys();
-    assign_random_keys_chuncked();
+    wait_for_snapshots();
+    assign_keys_streamed();
 
     printf("\n═══════════════════════════════════════════════════\n");
     printf("  QUERY PHASE - Testing Bloom Filter Routing\n");
-    printf("  Processes: %d, False Positive Rate: 1%%\n", num_processes);
+    printf("  Processes: %d, False Positive Rate: %g%%\n", num_processes, config.false_positive_rate * 100);
     printf("═══════════════════════════════════════════════════\n\n");
 
+    if(config.kill_process_before_queries >= 0 && config.kill_process_before_queries < num_processes){
+        printf("Manager: killing process %d to exercise the supervisor\n", config.kill_process_before_queries);
+        kill(process_pids[config.kill_process_before_queries], SIGKILL);
+        wait_supervised(200, 0);
+    }
+
     char response_buf[MAX_MSG_LEN];
-    int num_queries = 100;
+    int num_queries = config.num_queries < sample_count ? config.num_queries : sample_count;
 
     query_trackers = calloc(num_queries, sizeof(QueryTracker));
     num_queries_total = num_queries;
@@ -216,31 +1046,45 @@ int main(){
     struct timespec *query_start_times = calloc(num_queries, sizeof(struct timespec));
     struct timespec *query_end_times = calloc(num_queries, sizeof(struct timespec));
 
-    // ✅ Send all queries first WITHOUT waiting
-    printf("[Manager] Sending all %d queries...\n", num_queries);
-    for(int i = 0; i < num_queries; i++){
-        char query_msg[MAX_MSG_LEN];
-        
-        int key_index = rand() % total_keys;
-        int query_key = all_keys[key_index];
-        int actual_process = key_index / keys_per_process;
-        
-        int target_process;
-        do {
-            target_process = rand() % num_processes;
-        } while (target_process == actual_process);
-        
-        query_trackers[i].key = query_key;
-        query_trackers[i].answered = 0;
-        
-        clock_gettime(CLOCK_MONOTONIC, &query_start_times[i]);
-        
-        snprintf(query_msg, sizeof(query_msg), "QUERY:%d", query_key);
-        send_msg(num_processes, target_process, query_msg);
-        
-        // ✅ Minimal delay between sends
-        usleep(100);  // 0.1ms
+    // ✅ Pick all queries first, then send them WITHOUT waiting, grouped per target process
+    int *query_targets = malloc(num_queries * sizeof(int));
+    pick_queries(num_queries, query_targets);
+
+    printf("[Manager] Sending all %d queries in batches of up to %d keys...\n", num_queries, config.query_batch_size);
+    int *batch = malloc(config.query_batch_size * sizeof(int));
+    // One batch per (process, receive queue), the queue is picked by key so the reading worker owns it
+    int queues_per_process = config.receive_queues > 0 ? config.receive_queues : 1;
+    for(int target = 0; target < num_processes * queues_per_process; target++){
+        int p = target / queues_per_process;
+        int queue = config.receive_queues > 0 ? target % queues_per_process : -1;
+        int batch_len = 0;
+        for(int i = 0; i <= num_queries; i++){
+            if(i < num_queries && query_targets[i] == p &&
+               pick_receive_queue(query_trackers[i].key, config.receive_queues) == queue){
+                batch[batch_len++] = i;
+            }
+            if(batch_len == 0 || (batch_len < config.query_batch_size && i < num_queries)) continue;
+
+            char query_msg[MAX_MSG_LEN];
+            int msg_pos = sprintf(query_msg, "QUERY:");
+            for(int b = 0; b < batch_len; b++){
+                msg_pos += sprintf(query_msg + msg_pos, b == 0 ? "%d" : ",%d", query_trackers[batch[b]].key);
+            }
+
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            for(int b = 0; b < batch_len; b++){
+                query_start_times[batch[b]] = now;
+            }
+            send_msg_to_queue(num_processes, p, queue, query_msg);
+            batch_len = 0;
+
+            // ✅ Minimal delay between sends
+            usleep(100);  // 0.1ms
+        }
     }
+    free(batch);
+    free(query_targets);
 
     printf("[Manager] All queries sent. Collecting responses...\n\n");
 
@@ -251,36 +1095,55 @@ int main(){
 
     while(responses_collected < num_queries && iterations < max_wait_iterations) {
         int n = receive_msg(manager_fd, response_buf, sizeof(response_buf));
+        if(n > 0 && handle_supervision_message(response_buf)) continue;
         if(n > 0){
-            // Find which query this response is for
-            int response_key = -1;
-            if(strncmp(response_buf, "FOUND:", 6) == 0){
-                response_key = atoi(response_buf + 6);
+            // Replies are lists: "FOUND:key:PROCESS_p,key:PROCESS_p" or "NOTFOUND:key:CHECKED_BY_PROCESS_p[:REASON],..."
+            int response_found = strncmp(response_buf, "FOUND:", 6) == 0;
+            const char *entry = NULL;
+            if(response_found){
+                entry = response_buf + 6;
             } else if(strncmp(response_buf, "NOTFOUND:", 9) == 0){
-                response_key = atoi(response_buf + 9);
+                entry = response_buf + 9;
             }
-            
-            // ✅ Time the response
-            for (int i = 0; i < num_queries; i++) {
-                if (query_trackers[i].key == response_key && !query_trackers[i].answered) {
-                    clock_gettime(CLOCK_MONOTONIC, &query_end_times[i]);
-                    query_trackers[i].answered = 1;
-                    responses_collected++;
-                    
-                    double elapsed_ms = (query_end_times[i].tv_sec - query_start_times[i].tv_sec) * 1000.0 +
-                                    (query_end_times[i].tv_nsec - query_start_times[i].tv_nsec) / 1000000.0;
-                    
-                    if (i < 10) {  // Print first 10 for debugging
-                        printf("  Query %d: %.2f ms\n", i+1, elapsed_ms);
+
+            while(entry != NULL && *entry != '\0'){
+                const char *next = strchr(entry, ',');
+                size_t entry_len = next != NULL ? (size_t)(next - entry) : strlen(entry);
+                char entry_buf[256];
+                if(entry_len >= sizeof(entry_buf)) entry_len = sizeof(entry_buf) - 1;
+                memcpy(entry_buf, entry, entry_len);
+                entry_buf[entry_len] = '\0';
+                int response_key = atoi(entry_buf);
+                int expected = 1;
+
+                // ✅ Time the response
+                for (int i = 0; i < num_queries; i++) {
+                    if (query_trackers[i].key == response_key && !query_trackers[i].answered) {
+                        clock_gettime(CLOCK_MONOTONIC, &query_end_times[i]);
+                        query_trackers[i].answered = 1;
+                        query_trackers[i].found = response_found;
+                        query_trackers[i].timed_out = strstr(entry_buf, ":TIMEOUT") != NULL;
+                        expected = query_trackers[i].expected;
+                        responses_collected++;
+                        
+                        double elapsed_ms = (query_end_times[i].tv_sec - query_start_times[i].tv_sec) * 1000.0 +
+                                        (query_end_times[i].tv_nsec - query_start_times[i].tv_nsec) / 1000000.0;
+                        
+                        if (i < 10) {  // Print first 10 for debugging
+                            printf("  Query %d: %.2f ms\n", i+1, elapsed_ms);
+                        }
+                        
+                        break;
                     }
-                    
-                    break;
                 }
+
+                handle_process_response(entry_buf, response_found, expected);
+                entry = next != NULL ? next + 1 : NULL;
             }
-            
-            handle_process_response(response_buf);
+            continue; // drain everything that is queued before sleeping
         }
         
+        supervise();
         usleep(100);  // 0.1ms between polls
         iterations++;
     }
@@ -292,21 +1155,38 @@ int main(){
     double min_time = 999999.0;
     double max_time = 0.0;
     int queries_with_timing = 0;
+    double *latencies = malloc(num_queries * sizeof(double));
 
     for (int i = 0; i < num_queries; i++) {
         if (query_trackers[i].answered) {
             double elapsed_ms = (query_end_times[i].tv_sec - query_start_times[i].tv_sec) * 1000.0 +
                             (query_end_times[i].tv_nsec - query_start_times[i].tv_nsec) / 1000000.0;
             total_query_time_ms += elapsed_ms;
-            queries_with_timing++;
+            latencies[queries_with_timing++] = elapsed_ms;
             
             if (elapsed_ms < min_time) min_time = elapsed_ms;
             if (elapsed_ms > max_time) max_time = elapsed_ms;
         }
     }
 
-    int found_count = queries_with_timing;
+    int found_count = 0;
     int not_found_count = 0;
+    int timed_out_count = 0;
+    int misses_asked = 0;
+    int misses_not_found = 0;
+    for (int i = 0; i < num_queries; i++) {
+        if (!query_trackers[i].expected){
+            misses_asked++;
+            misses_not_found += query_trackers[i].answered && !query_trackers[i].found;
+        }
+        if (!query_trackers[i].answered) continue;
+        if (query_trackers[i].found) {
+            found_count++;
+        } else {
+            not_found_count++;
+            if (query_trackers[i].timed_out) timed_out_count++;
+        }
+    }
     int unanswered = num_queries - queries_with_timing;
 
     time_t total_end = time(NULL);
@@ -316,13 +1196,20 @@ int main(){
     printf("═══════════════════════════════════════════════════\n");
     printf("  Configuration:\n");
     printf("    Processes: %d\n", num_processes);
-    printf("    Keys per process: %d\n", keys_per_process);
+    int replicas = config.replication_factor < num_processes ? config.replication_factor : num_processes;
+    printf("    Keys per process: %ld\n", (long)total_keys * replicas / num_processes);
+    printf("    Replication factor: %d\n", config.replication_factor);
     printf("    Total keys: %d\n", total_keys);
-    printf("    False positive rate: 1%%\n");
+    printf("    False positive rate: %g%%\n", config.false_positive_rate * 100);
     printf("  \n");
     printf("  Query Results:\n");
     printf("    Queries sent: %d\n", num_queries);
-    printf("    Queries answered: %d\n", found_count);
+    printf("    Queries answered: %d\n", queries_with_timing);
+    printf("    Found: %d\n", found_count);
+    printf("    Not found: %d (%d after peer timeout)\n", not_found_count, timed_out_count);
+    if(misses_asked > 0){
+        printf("    Misses asked: %d, not found: %d\n", misses_asked, misses_not_found);
+    }
     printf("    Queries unanswered: %d\n", unanswered);
     printf("  \n");
     printf("  Performance:\n");
@@ -330,9 +1217,34 @@ int main(){
         queries_with_timing > 0 ? total_query_time_ms / queries_with_timing : 0);
     printf("    Min query time: %.2f ms\n", min_time);
     printf("    Max query time: %.2f ms\n", max_time);
+    if(queries_with_timing > 0){
+        qsort(latencies, queries_with_timing, sizeof(double), compare_doubles);
+        double p50 = latencies[(queries_with_timing - 1) * 50 / 100];
+        double p95 = latencies[(queries_with_timing - 1) * 95 / 100];
+        double p99 = latencies[(queries_with_timing - 1) * 99 / 100];
+        printf("    Query time p50/p95/p99: %.2f / %.2f / %.2f ms\n", p50, p95, p99);
+        printf("[BENCH] latency_ms avg %.3f p50 %.3f p95 %.3f p99 %.3f answered %d found %d\n",
+               total_query_time_ms / queries_with_timing, p50, p95, p99, queries_with_timing, found_count);
+    }
+    free(latencies);
+    report_process_memory();
+    if(respawns > 0){
+        //The checks below expect every replica to answer
+        wait_supervised(config.respawn_wait_ms, 1);
+        printf("    Processes re-spawned: %d\n", respawns);
+    }
+    //Writing a large snapshot can keep a process from answering PINGs
+    if(config.snapshots){
+        supervising = 0;
+        write_snapshots();
+        resume_supervision();
+    }
+    run_update_check();
+    run_value_check();
     printf("    Total runtime: %ld seconds\n", total_end - total_start);
     printf("═══════════════════════════════════════════════════\n\n");
     
+    shutting_down = 1;
    for(int i = 0; i < num_processes; i++){
     kill(process_pids[i], SIGTERM);
     }
@@ -342,7 +1254,7 @@ int main(){
     }
 
     close_communication(num_processes, manager_fd);
-    free(all_keys);
+    free(key_sample);
     free(process_pids);
     free(query_trackers);
 
@@ -350,11 +1262,10 @@ int main(){
     free(query_start_times);
     free(query_end_times);
 
-    for (int p = 0; p < num_processes; p++) {
-        free(process_keys[p]);
-    }
-    free(process_keys);
     free(process_key_counts);
+    free(process_restored);
+    free(process_state);
+    free(last_pong_ms);
 
     printf("Manager shutdown complete\n");
     return 0;
@@ -1,71 +1,312 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sched.h>
 #include "IPC.h"
 #include "bloom.h"
-#include <search.h>
+#include "key_index.h"
+#include "keyhash.h"
+#include "spsc_queue.h"
+#include "affinity.h"
+#include "filter_sync.h"
+#include "value_store.h"
+#include "arena.h"
+#include "snapshot.h"
+#include "process_set.h"
+#include "config.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <stdarg.h>
+#include <limits.h>
 
 
-#define MAX_KEYS 250000       //Need to discuss this with Professor for proper calculation
-#define MAX_PROCESSES 64
+#define MAX_WORKERS 64
 #define BUF_SIZE 256          //Need to discuss this with Professor for proper calculation
-#define BLOOM_MSG_SIZE 262144 //Need to discuss this with Professor for proper calculation
-#define FALSE_POSITIVE_RATE 0.01 //Need to check this on GitHub and ask Professor for proper calculation
 #define BLOOM_FILE_DIR "/tmp"
+#define MAX_PENDING_QUERIES 4096  //Peer lookups in flight at once per worker, the slot of a request is req_id % MAX_PENDING_QUERIES
+#define PQUERY_TIMEOUT_MS 200     //A peer that has not answered by then is treated as PNOTFOUND (lost datagram)
+#define TIMEOUT_WHEEL_SLOTS 256
+#define TIMEOUT_WHEEL_TICK_MS 1   //Wheel covers 256 ms, has to stay above PQUERY_TIMEOUT_MS. Fine enough for hedge delays
+#define HEDGE_SAMPLES 64          //Reply times kept per worker, the hedge delay is their p95
+#define HEDGE_INITIAL_MS 20       //Hedge delay until HEDGE_SAMPLES replies were timed
+#define BATCH_MSG_SIZE 16384      //Grouped PQUERY and reply datagrams are sent early once they reach this size
+#define WORK_QUEUE_SIZE 16384     //Work items buffered between the dispatcher and each worker
+#define VALUE_SLOT_BASE 0x40000000  //Index values from here on are value store slots, below they are positions in keys[]
+#define SNAPSHOT_VERSION 1        //bump when ProcessSnapshot or a section changes
+#define FILTER_SYNC_MS 200        //How often every peer filter is brought up to date
+#define FILTER_BLOCKS_HEADER "FILTER_BLOCKS:"
+#define FILTER_BLOCKS_HEADER_SIZE (14 + sizeof(int32_t) + 3 * sizeof(uint64_t))  //header, sender, generation, from_block, next_block
 
 int process_id;
 int num_processes;
-int *keys = NULL; //Later we may convert this to hash table, ask Professor when project complete (not a priority)
+int *keys = NULL; //Position in this array is the value stored in the key index
 int num_keys = 0;
 int keys_capacity = 0;
 int keys_finalized = 0;
 
+//Keys, key indexes, value slabs and message buffers live here and are released in one go at exit
+Arena process_arena;
+ScratchPool value_scratch;        //copies of inline SET values on their way to a worker
+int use_hugepages = 0;
+
 BloomFilter own_bloom;
-BloomFilter *peer_bloom_filters = NULL;
+BloomFilter **peer_bloom_filters = NULL;  //NULL until imported, a re-import swaps the pointer atomically
 int bloom_initialized = 0;
-int *peer_bloom_received = NULL;
+int *peer_bloom_received = NULL;  //Set once the first filter of the peer is fully imported, workers read it without a lock
+
+//A replaced peer filter is freed once every worker started a drain round after the swap,
+//no worker keeps a filter pointer across rounds
+typedef struct RetiredFilter{
+    BloomFilter *filter;
+    unsigned long epoch;
+    struct RetiredFilter *next;
+} RetiredFilter;
+
+RetiredFilter *retired_filters = NULL;
+unsigned long filter_epoch = 0;
 int bloom_broadcasted = 0;
+unsigned int max_peer_hashes = 0;
 
 int comm_fd = -1;
 
+//Every key that is forwarded to peers gets one entry here until the first PFOUND arrives,
+//every candidate answered PNOTFOUND or the deadline passed. Only then the manager gets its answer.
+typedef enum{
+    PQ_FREE = 0,
+    PQ_WAITING
+} PendingState;
+
+typedef struct{
+    PendingState state;
+    int req_id;
+    int key;
+    int pending;           //candidates that did not reply yet
+    int want_value;        //GET: the owner sends VALUE to the manager itself, PFOUND only closes the request
+    int direct_owner;      //home process asked first without the filters, -1 once the filters were used
+    int hedge_owner;       //replica asked if direct_owner is slower than the hedge delay, -1 if none or already asked
+    long sent_us;          //when the direct PQUERY was queued, for the hedge delay
+    long final_deadline_tick;  //deadline_tick is the hedge deadline until the hedge is sent
+    long deadline_tick;
+    int wheel_prev;        //neighbours in the timeout wheel slot list, -1 if none
+    int wheel_next;
+} PendingQuery;
+
+//Outgoing messages that carry a list of entries, e.g. "PQUERY:FROM_3:key@req,key@req".
+//Entries are appended while messages are handled and the whole list goes out in one datagram.
+typedef struct{
+    int receiver;
+    int queue;             //receive queue of the receiver, -1 for its main socket
+    char header[32];
+    int len;
+    int entries;
+    char *buf;             //allocated on first use, most workers never talk to every peer
+    ProcessSet *pending;   //peer batches mark their receiver here, so a flush skips the idle peers
+} MsgBatch;
+
+typedef enum{
+    WORK_QUERY,            //key asked by the manager
+    WORK_PQUERY,           //key asked by peer
+    WORK_PFOUND,           //peer has the key we asked for
+    WORK_PNOTFOUND,
+    WORK_BUILD_SHARD,      //index the keys of this worker's shard after KEYS_DONE
+    WORK_PUT,              //key added by the manager after the initial load
+    WORK_DELETE,
+    WORK_SET,              //PUT with a value
+    WORK_GET,              //QUERY that wants the value back
+    WORK_PGET
+} WorkType;
+
+//All keys are split by key_shard(key, num_workers). Everything about one key, its index entry,
+//its pending peer query and the replies to it, is handled by the same worker so nothing is shared.
+typedef struct{
+    int id;
+    pthread_t thread;
+    int cpu;               //core the worker is pinned to, -1 if not pinned
+    KeyIndex index;
+    SpscQueue queue;
+    int recv_fd;           //own receive queue proc_N_q<id>.sock, -1 when everything comes through the dispatcher
+    char *recv_buf;
+
+    PendingQuery pending_queries[MAX_PENDING_QUERIES];
+    int timeout_wheel[TIMEOUT_WHEEL_SLOTS];
+    long wheel_tick;
+    int next_req_id;
+    unsigned long routed_queries;  //benchmark counters, summed when the process exits
+    unsigned long routing_probes;  //peer filters checked
+    unsigned long hedged_queries;  //second PQUERY sent to another replica
+    unsigned long seen_epoch;      //filter_epoch at the start of the last drain round
+    long reply_us[HEDGE_SAMPLES];  //ring of direct reply times
+    int reply_samples;
+    long hedge_delay_ticks;
+
+    ValueStore values;            //slot = index value - VALUE_SLOT_BASE
+    char *value_msg;              //VALUE reply being built
+
+    MsgBatch *pquery_batches;     //indexed by peer id
+    MsgBatch *pget_batches;
+    MsgBatch *pfound_batches;
+    MsgBatch *pnotfound_batches;
+    ProcessSet pending_peers;     //peers with something in one of their batches
+    int *candidates;              //filter hits of the query being routed, num_processes entries
+    MsgBatch found_reply;         //lists for the manager
+    MsgBatch notfound_reply;
+    MsgBatch update_reply;        //acks for PUT/DELETE
+} Worker;
+
+Worker *workers = NULL;
+int num_workers = 1;              //1 means everything runs inline on the main thread like before
+int workers_running = 0;
+int num_queues = 0;               //0: one socket per process, otherwise one receive queue per worker
+int *queue_fds = NULL;
+int interleave_peer_filters = 0;  //otherwise peer filters are kept on this process's node
+int key_placement = KEY_PLACEMENT_POSITION;  //with a hash placement a key's home is asked directly and
+                                             //the filters only hold keys that live somewhere else
+int replication_factor = 1;       //every key lives on its home and the next replication_factor-1 processes
+volatile int workers_stop = 0;
+int shards_built = 0;
+
+//own_counts is the real filter of this process, own_bloom is its plain bit copy that peers import.
+//DELETE decrements the counters and clears bits no other key needs.
+//Peers pull changes instead of importing the file again: every 64 byte block of own_bloom keeps the
+//generation it last changed in, and a peer asks for the blocks newer than its copy every FILTER_SYNC_MS.
+//One lock keeps the counters, the bits and the block generations consistent between workers.
+CountingBloomFilter own_counts;
+pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t own_generation = 0;
+uint64_t *own_block_generation = NULL;
+uint64_t *peer_generation = NULL;   //Generation of every peer filter we hold completely
+uint64_t *peer_sync_round = NULL;   //Generation of the sync in progress, set by its first reply
+uint64_t *peer_sync_next = NULL;    //Block the next reply of that sync has to start at, stale replies are dropped
+long last_filter_sync_ms = 0;
+
+struct timespec build_start;      //KEYS_DONE arrived
+double build_ms = -1;             //until every peer filter is imported, -1 while still building
+
+//Checkpoint of the keys, the key indexes and the own filter, written after the build and on SNAPSHOT.
+//A restart with the same tag maps it back instead of waiting for the manager to stream the keys again.
+//Values are not part of it, their slots come back empty.
+typedef struct{
+    uint64_t index_mask;
+    uint64_t index_count;
+    uint64_t index_keys;          //file offsets
+    uint64_t index_values;
+    uint64_t value_slots;         //one VALUE_SLOT_* byte per slot
+    uint64_t num_value_slots;
+} WorkerSnapshot;
+
+typedef struct{
+    SnapshotPrefix prefix;
+    uint64_t tag;
+    int32_t process_id;
+    int32_t num_processes;
+    int32_t num_workers;
+    int32_t key_placement;
+    int32_t replication_factor;
+    int32_t num_keys;
+    uint64_t keys;
+    BloomFilter own_bloom;        //pointers are set again on restore
+    uint64_t bloom_bits;
+    CountingBloomFilter own_counts;
+    uint64_t counters;
+    WorkerSnapshot workers[MAX_WORKERS];
+} ProcessSnapshot;
+
+uint64_t snapshot_tag = 0;        //0 turns snapshots off, otherwise the manager's id of the workload
+char *snapshot_base = NULL;       //mapping the tables were restored from, kept until exit
+uint64_t snapshot_size = 0;
+
+//The manager masks crashed or silent peers with PEER_DOWN until PEER_UP, routing skips them.
+//A re-spawned process (rejoining) reads the filters its running peers already exported and
+//reports READY once it routes again.
+int *peer_down = NULL;            //written by the main thread, read by the workers
+int rejoining = 0;
+int ready_sent = 0;
+
 
 void signal_handler(int signum);
-int check_own_keys(int key);
+int check_own_keys(Worker *w, int key);
 void assign_keys_from_message(const char *msg);
+void announce_keys(const char *msg);
 void create_own_bloom_filter();
 void broadcast_bloom_filter();
 void update_peer_bloom_filter_from_file(int peer_id, const char *bloom_data);
-void handle_query_from_manager(const char *msg);
+void handle_query_from_manager(Worker *direct, const char *msg);
 void handle_bloom_message(const char *msg);
-void handle_query_from_process(const char *msg);
+void handle_query_from_process(Worker *direct, const char *msg);
+void handle_response_from_process(Worker *direct, const char *msg);
+void init_workers();
+void start_workers();
+void stop_workers();
+void expire_pending_queries(Worker *w);
+void flush_batches(Worker *w);
+void handle_update_from_manager(Worker *direct, const char *msg, int put);
+void handle_set_from_manager(const char *msg, int msg_len);
+void request_filter_sync();
+void handle_filter_sync_request(const char *msg);
+void handle_filter_blocks(const char *msg, int len);
+void own_filter_update(int key, int add);
+int write_snapshot();
+int restore_snapshot();
+void import_existing_peer_filters();
+void handle_peer_state(const char *msg, int down);
 
 
 void signal_handler(int signum){
     printf("\n[Process %d] Received signal %d, cleaning up... \n", process_id, signum);
 
-    if(bloom_initialized){
+    stop_workers();
+
+    if(workers != NULL){
+        unsigned long routed = 0, probes = 0, hedged = 0;
+        for(int w = 0; w < num_workers; w++){
+            routed += workers[w].routed_queries;
+            probes += workers[w].routing_probes;
+            hedged += workers[w].hedged_queries;
+        }
+        printf("[BENCH] Process %d build_ms %.1f routed %lu probes %lu hedged %lu\n", process_id, build_ms, routed, probes, hedged);
+    }
+
+    //Restored filters point into the snapshot mapping
+    if(bloom_initialized && snapshot_base == NULL){
         bloom_filter_destroy(&own_bloom);
     }
+    if(own_counts.counters && snapshot_base == NULL) counting_bloom_filter_destroy(&own_counts);
+    free(own_block_generation);
     if(peer_bloom_filters != NULL){
         for(int i = 0; i < num_processes; i++){
-            if(peer_bloom_received && peer_bloom_received[i]){
-                bloom_filter_destroy(&peer_bloom_filters[i]);
+            if(peer_bloom_filters[i] != NULL){
+                bloom_filter_destroy(peer_bloom_filters[i]);
+                free(peer_bloom_filters[i]);
             }
         }
-        free(peer_bloom_filters);
     }
-
-    if(peer_bloom_received != NULL){
-        free(peer_bloom_received);
+    while(retired_filters != NULL){
+        RetiredFilter *r = retired_filters;
+        retired_filters = r->next;
+        bloom_filter_destroy(r->filter);
+        free(r->filter);
+        free(r);
     }
-    if(keys != NULL){
-        free(keys);
+    if(workers != NULL){
+        for(int w = 0; w < num_workers; w++){
+            spsc_destroy(&workers[w].queue);
+            value_store_destroy(&workers[w].values);
+        }
     }
+    if(queue_fds != NULL){
+        close_queue_endpoints(process_id, num_queues, queue_fds);
+        free(queue_fds);
+    }
+    //Keys, indexes, batches and the worker table itself
+    arena_release(&process_arena);
+    snapshot_unmap(snapshot_base, snapshot_size);
 
-    hdestroy();
     if(comm_fd >= 0){
         close_communication(process_id, comm_fd);
     }
@@ -77,86 +318,307 @@ void signal_handler(int signum){
 }
 
 
-//If change to hash table instead, remember to modify below function as well.
-int check_own_keys(int key){
-    if(!keys_finalized) return 0;
-    char key_str[32];
-    snprintf(key_str, sizeof(key_str), "%d", key);
+//Only valid from the worker that owns the key's shard
+int check_own_keys(Worker *w, int key){
+    if(!__atomic_load_n(&keys_finalized, __ATOMIC_ACQUIRE)) return 0;
+    return key_index_find(&w->index, key) >= 0;
+}
 
-    ENTRY e, *ep;
-    e.key = key_str;
-    e.data = NULL;
+//Moves the keys to a bigger arena block, the old one stays behind until exit.
+//With KEYS_EXPECTED this does not happen unless the manager sends more than it announced.
+static void grow_keys(int capacity){
+    int *bigger = arena_alloc(&process_arena, (size_t)capacity * sizeof(int));
+    if(bigger == NULL){
+        fprintf(stderr, "ERROR HAPPENED: process %d failed to allocate memory for keys \n", process_id);
+        exit(1);
+    }
+    if(num_keys > 0) memcpy(bigger, keys, (size_t)num_keys * sizeof(int));
+    keys = bigger;
+    keys_capacity = capacity;
+}
 
-    ep = hsearch(e, FIND);
-    return (ep != NULL);
+//Format: "KEYS_EXPECTED:<count>", sent before the first KEYS chunk when the manager knows the count.
+//The key array and the key indexes get one arena block of the right size up front.
+void announce_keys(const char *msg){
+    long expected = strtol(msg + 14, NULL, 10);
+    if(expected <= 0 || expected <= keys_capacity) return;
 
+    //Every index table is a power of two at least twice its shard, 4 ints per key covers the rounding
+    size_t index_bytes = (size_t)expected * 4 * 2 * sizeof(int);
+    if(arena_reserve(&process_arena, (size_t)expected * sizeof(int) + index_bytes) < 0){
+        fprintf(stderr, "[ERROR HAPPENED] : Process %d could not reserve memory for %ld keys\n", process_id, expected);
+    }
+    grow_keys((int)expected);
+    printf("Process %d expects %ld keys\n", process_id, expected);
 }
 
-//If change to hash table instead, remember to modify below function as well. - DONE 
+//Parsed in place, the message buffer is not touched
 void assign_keys_from_message(const char *msg){
     const char *ptr = msg+5;
-    char *copy = strdup(ptr);
-    char *tok = strtok(copy, ",");
 
-    //int keys_in_msg = 0;
+    while(*ptr != '\0'){
+        char *end;
+        int key = (int)strtol(ptr, &end, 10);
+        if(end == ptr) break;
+        ptr = (*end == ',') ? end + 1 : end;
 
-    while(tok != NULL){
         if(num_keys >= keys_capacity){
-            int new_capacity = keys_capacity == 0 ? 100000 : keys_capacity * 2;
-            int *new_keys = realloc(keys, new_capacity * sizeof(int));
-            if(new_keys == NULL){
-                fprintf(stderr, "ERROR HAPPENED: process %d failed to allocate memory for keys \n", process_id);
-                free(copy);
-                exit(1);
-            }
-            keys = new_keys;
-            keys_capacity = new_capacity;
+            grow_keys(keys_capacity == 0 ? 100000 : keys_capacity * 2);
         }
-        keys[num_keys++] = atoi(tok);
-        //keys_in_msg++;
-        tok = strtok(NULL, ",");
+        keys[num_keys++] = key;
     }
-    free(copy);
 
     if(num_keys % 100000 == 0){
         printf("Process %d received %d keys so far\n", process_id, num_keys);
     }
 }
 
-void finalize_keys(){
-    if(keys_finalized) return;
-    printf("Process %d finalizign %d keys\n", process_id, num_keys);
-
-    time_t start = time(NULL);
+//Runs on the worker itself so the shard's memory is first touched by the core that uses it
+static void build_shard(Worker *w){
+    int shard_keys = 0;
+    for(int i = 0; i < num_keys; i++){
+        if(key_shard(keys[i], num_workers) == w->id) shard_keys++;
+    }
 
-    if(hcreate(num_keys * 2) == 0){
-        fprintf(stderr, "[ERROR HAPPENED] Process %d failed to create hash table \n", process_id);
+    if(key_index_init_in(&w->index, shard_keys, &process_arena) < 0){
+        fprintf(stderr, "[ERROR HAPPENED] Process %d worker %d failed to create key index \n", process_id, w->id);
         exit(1);
     }
 
     for(int i = 0; i < num_keys; i++){
-        char *key_str = malloc(32);
-        snprintf(key_str, 32, "%d", keys[i]);
-
-        ENTRY e;
-        e.key = key_str;
-        e.data = (void*)(long)1;
-        if(hsearch(e, ENTER) == NULL){
+        if(key_shard(keys[i], num_workers) != w->id) continue;
+        if(key_index_insert(&w->index, keys[i], i) < 0){
             fprintf(stderr, "Process %d failed to insert key %d\n", process_id, keys[i]);
         }
+    }
 
-        if((i+1) % 500000 == 0){
-            printf("Process %d indexed %d/%d keys (%.1f%%)\n", i+1, process_id, num_keys, (i+1) * 100.0/num_keys);
+    printf("Process %d worker %d indexed %d/%d keys\n", process_id, w->id, shard_keys, num_keys);
+    __atomic_add_fetch(&shards_built, 1, __ATOMIC_RELEASE);
+}
+
+//Routing is ready once the own keys are in and every peer filter is imported, whichever comes last.
+//Peers that finished first may have sent their filters before our KEYS_DONE started the clock.
+static void note_routing_ready(){
+    if(build_ms >= 0 || !keys_finalized || peer_bloom_received == NULL) return;
+    int received = 0;
+    for(int p = 0; p < num_processes; p++){
+        received += peer_bloom_received[p];
+    }
+    if(received < num_processes - 1) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    build_ms = (now.tv_sec - build_start.tv_sec) * 1000.0 + (now.tv_nsec - build_start.tv_nsec) / 1000000.0;
+    printf("[Process %d] Routing ready %.1f ms after KEYS_DONE\n", process_id, build_ms);
+}
+
+void finalize_keys(){
+    if(keys_finalized) return;
+    printf("Process %d finalizign %d keys\n", process_id, num_keys);
+    clock_gettime(CLOCK_MONOTONIC, &build_start);
+
+    time_t start = time(NULL);
+
+    if(!workers_running){
+        build_shard(&workers[0]);
+    } else {
+        for(int w = 0; w < num_workers; w++){
+            WorkItem item = {WORK_BUILD_SHARD, 0, 0, 0, NULL, 0};
+            while(!spsc_push(&workers[w].queue, &item)){
+                usleep(100);
+            }
+        }
+        while(__atomic_load_n(&shards_built, __ATOMIC_ACQUIRE) < num_workers){
+            usleep(1000);
         }
     }
 
     time_t end = time(NULL);
     printf("Process %d hash table created in %ld seconds \n", process_id, end-start);
-    keys_finalized = 1;
+    __atomic_store_n(&keys_finalized, 1, __ATOMIC_RELEASE);
     create_own_bloom_filter();
+    write_snapshot();
+    if(rejoining){
+        import_existing_peer_filters();
+    }
+    note_routing_ready();
+}
+
+static void snapshot_path(char *path, size_t size){
+    snprintf(path, size, "%s/snapshot_process_%d.snap", BLOOM_FILE_DIR, process_id);
+}
+
+static int add_section(SnapshotWriter *sw, const void *data, uint64_t len, uint64_t *offset){
+    int64_t at = snapshot_write_section(sw, data, len);
+    if(at < 0) return -1;
+    *offset = (uint64_t)at;
+    return 0;
+}
+
+//Workers are paused while the tables are written, so the indexes, the filter and the value slots agree.
+//Returns 1 once the snapshot is on disk.
+int write_snapshot(){
+    if(snapshot_tag == 0 || !bloom_initialized) return 0;
+    int resume = workers_running;
+    stop_workers();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char path[256];
+    snapshot_path(path, sizeof(path));
+
+    ProcessSnapshot *hdr = calloc(1, sizeof(ProcessSnapshot));
+    SnapshotWriter sw;
+    int ok = hdr != NULL && snapshot_writer_open(&sw, path, sizeof(ProcessSnapshot)) == 0;
+    if(ok){
+        hdr->tag = snapshot_tag;
+        hdr->process_id = process_id;
+        hdr->num_processes = num_processes;
+        hdr->num_workers = num_workers;
+        hdr->key_placement = key_placement;
+        hdr->replication_factor = replication_factor;
+        hdr->num_keys = num_keys;
+        hdr->own_bloom = own_bloom;
+        hdr->own_counts = own_counts;
+        ok = add_section(&sw, keys, (uint64_t)num_keys * sizeof(int), &hdr->keys) == 0 &&
+             add_section(&sw, own_bloom.bloom, own_bloom.bloom_length, &hdr->bloom_bits) == 0 &&
+             add_section(&sw, own_counts.counters, own_counts.counters_length, &hdr->counters) == 0;
+    }
+    for(int w = 0; ok && w < num_workers; w++){
+        KeyIndex *ki = &workers[w].index;
+        WorkerSnapshot *ws = &hdr->workers[w];
+        ws->index_mask = ki->mask;
+        ws->index_count = ki->count;
+        ws->num_value_slots = workers[w].values.num_entries;
+        uint8_t *states = malloc(ws->num_value_slots + 1);
+        if(states == NULL){
+            ok = 0;
+            break;
+        }
+        value_store_slot_states(&workers[w].values, states);
+        ok = add_section(&sw, ki->keys, (ki->mask + 1) * sizeof(int), &ws->index_keys) == 0 &&
+             add_section(&sw, ki->values, (ki->mask + 1) * sizeof(int), &ws->index_values) == 0 &&
+             add_section(&sw, states, ws->num_value_slots, &ws->value_slots) == 0;
+        free(states);
+    }
+    if(ok){
+        ok = snapshot_writer_commit(&sw, hdr, sizeof(ProcessSnapshot), SNAPSHOT_VERSION) == 0;
+    } else if(hdr != NULL){
+        snapshot_writer_abort(&sw);
+    }
+    free(hdr);
+
+    if(resume){
+        workers_stop = 0;
+        start_workers();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(ok){
+        printf("Process %d wrote snapshot of %d keys to %s in %.1f ms\n", process_id, num_keys, path,
+               (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+    } else {
+        fprintf(stderr, "[ERROR HAPPENED] : Process %d could not write its snapshot\n", process_id);
+    }
+    return ok;
+}
+
+//Called before the workers start. The tables are pointed into the mapping, nothing is copied,
+//so the restore costs the page faults of whatever is touched first. Returns 1 if a snapshot was used.
+int restore_snapshot(){
+    if(snapshot_tag == 0) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &build_start);
+    char path[256];
+    snapshot_path(path, sizeof(path));
+
+    uint64_t size;
+    char *base = snapshot_map(path, sizeof(ProcessSnapshot), SNAPSHOT_VERSION, &size);
+    if(base == NULL) return 0;
+    const ProcessSnapshot *hdr = (const ProcessSnapshot*)base;
+    if(hdr->tag != snapshot_tag || hdr->process_id != process_id || hdr->num_processes != num_processes ||
+       hdr->num_workers != num_workers || hdr->key_placement != key_placement ||
+       hdr->replication_factor != replication_factor){
+        printf("Process %d ignores snapshot %s, it is from another configuration\n", process_id, path);
+        snapshot_unmap(base, size);
+        return 0;
+    }
+
+    keys = (int*)(base + hdr->keys);
+    num_keys = hdr->num_keys;
+    keys_capacity = hdr->num_keys;
+    for(int w = 0; w < num_workers; w++){
+        const WorkerSnapshot *ws = &hdr->workers[w];
+        KeyIndex *ki = &workers[w].index;
+        ki->keys = (int*)(base + ws->index_keys);
+        ki->values = (int*)(base + ws->index_values);
+        ki->mask = ws->index_mask;
+        ki->count = ws->index_count;
+        ki->arena = &process_arena;   //a grown table goes to the arena, the mapping is never freed
+        value_store_restore_slots(&workers[w].values, (const uint8_t*)(base + ws->value_slots), (int)ws->num_value_slots);
+    }
+    shards_built = num_workers;
+
+    own_bloom = hdr->own_bloom;
+    own_bloom.bloom = (unsigned char*)(base + hdr->bloom_bits);
+    own_bloom.filepointer = NULL;
+    own_bloom.__is_on_disk = 0;
+    bloom_filter_set_hash_function(&own_bloom, NULL);
+    own_counts = hdr->own_counts;
+    own_counts.counters = (unsigned char*)(base + hdr->counters);
+    own_counts.hash_function = own_bloom.hash_function;
+
+    //Peers import the filter file again, so the block generations start over like after a build
+    own_block_generation = calloc(filter_sync_num_blocks(own_bloom.bloom_length), sizeof(uint64_t));
+    if(own_block_generation == NULL){
+        fprintf(stderr, "ERROR HAPPENED: process %d failed to allocate filter block generations\n", process_id);
+        exit(1);
+    }
+    own_generation = 0;
+    snapshot_base = base;
+    snapshot_size = size;
+    __atomic_store_n(&keys_finalized, 1, __ATOMIC_RELEASE);
+    bloom_initialized = 1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("Process %d restored %d keys from %s in %.1f ms\n", process_id, num_keys, path,
+           (now.tv_sec - build_start.tv_sec) * 1000.0 + (now.tv_nsec - build_start.tv_nsec) / 1000000.0);
+    return 1;
+}
+
+//Peers that are still running do not send their filters again, the files they exported are read instead.
+//A stale file is replaced as soon as that peer's BLOOM_FILE arrives, FILTER_SYNC brings the rest.
+void import_existing_peer_filters(){
+    char filepath[256];
+    for(int p = 0; p < num_processes; p++){
+        if(p == process_id) continue;
+        snprintf(filepath, sizeof(filepath), "%s/bloom_process_%d.dat", BLOOM_FILE_DIR, p);
+        if(access(filepath, R_OK) == 0){
+            update_peer_bloom_filter_from_file(p, filepath);
+        }
+    }
+}
+
+//Replica r of a key sits on (home + r) % num_processes. Keys placed here are found without the filter.
+static int is_replica_of(int p, int home){
+    return home >= 0 && (p - home + num_processes) % num_processes < replication_factor;
+}
+
+static int placed_here(int key){
+    return is_replica_of(process_id, key_home(key, key_placement, num_processes));
+}
+
+static int peer_is_down(int p){
+    return peer_down != NULL && __atomic_load_n(&peer_down[p], __ATOMIC_ACQUIRE);
+}
+
+//"PEER_DOWN:<p>" / "PEER_UP:<p>" from the manager
+void handle_peer_state(const char *msg, int down){
+    int p = atoi(strchr(msg, ':') + 1);
+    if(p < 0 || p >= num_processes || p == process_id) return;
+    printf("Process %d marks process %d %s\n", process_id, p, down ? "down" : "up");
+    __atomic_store_n(&peer_down[p], down, __ATOMIC_RELEASE);
 }
 
-//Remember to modify the array part here as well if move to hash table
 void create_own_bloom_filter(){
     if(bloom_initialized){
         bloom_filter_destroy(&own_bloom);
@@ -164,23 +626,59 @@ void create_own_bloom_filter(){
 
     printf("Process %d creating bloom filer for %d keys \n", process_id, num_keys);
     time_t start = time(NULL);
-    
-    bloom_filter_init(&own_bloom, num_keys > 0 ? num_keys:10, FALSE_POSITIVE_RATE);
 
+    //With a hash placement only keys away from their home go in, plus room for keys PUT here later
+    int filter_capacity = num_keys;
+    if(key_placement != KEY_PLACEMENT_POSITION){
+        filter_capacity = num_keys / 8;
+        for(int i = 0; i < num_keys; i++){
+            if(!placed_here(keys[i])) filter_capacity++;
+        }
+    }
+    if(filter_capacity < 10) filter_capacity = 10;
+
+    bloom_filter_init(&own_bloom, filter_capacity, config.false_positive_rate);
+    placement_bind_local(own_bloom.bloom, own_bloom.bloom_length);
+    if(own_counts.counters) counting_bloom_filter_destroy(&own_counts);
+    if(counting_bloom_filter_init(&own_counts, filter_capacity, config.false_positive_rate) != BLOOM_SUCCESS){
+        fprintf(stderr, "ERROR HAPPENED: process %d failed to allocate bloom counters\n", process_id);
+        exit(1);
+    }
+    placement_bind_local(own_counts.counters, own_counts.counters_length);
+
+    int filtered_keys = 0;
     for(int i = 0; i < num_keys; i++){
+        if(placed_here(keys[i])) continue;
+        filtered_keys++;
         char key_str[32];
         snprintf(key_str, sizeof(key_str), "%d", keys[i]);
-        bloom_filter_add_string(&own_bloom, key_str);
+        uint64_t *hashes = counting_bloom_filter_calculate_hashes(&own_counts, key_str, own_counts.number_hashes);
+        counting_bloom_filter_add_string_alt(&own_counts, hashes, own_counts.number_hashes);
+        free(hashes);
 
         if((i+1) % 500000 == 0){
             printf("Process %d added %d/%d keys to bloom (%.1f%%)\n", process_id, i+1, num_keys, (i+1) * 100.0 / num_keys);
         }
     }
 
+    counting_bloom_filter_export_bloom(&own_counts, &own_bloom);
+
+    //A rebuilt filter is sent whole on the next sync, the first one already is in the exported file
+    uint64_t num_blocks = filter_sync_num_blocks(own_bloom.bloom_length);
+    free(own_block_generation);
+    own_block_generation = malloc(num_blocks * sizeof(uint64_t));
+    if(own_block_generation == NULL){
+        fprintf(stderr, "ERROR HAPPENED: process %d failed to allocate filter block generations\n", process_id);
+        exit(1);
+    }
+    uint64_t generation = bloom_broadcasted ? ++own_generation : 0;
+    for(uint64_t b = 0; b < num_blocks; b++){
+        own_block_generation[b] = generation;
+    }
     time_t end = time(NULL);
 
     bloom_initialized = 1;
-    printf("[Process %d] Created bloom filter in %ld seconds\n", process_id, end-start);
+    printf("[Process %d] Created bloom filter in %ld seconds, %d of %d keys are away from their home\n", process_id, end-start, filtered_keys, num_keys);
 
     bloom_filter_stats(&own_bloom);
 }
@@ -188,6 +686,8 @@ void create_own_bloom_filter(){
 void broadcast_bloom_filter(){
     if(bloom_broadcasted) return;
     printf("PROCESS %d exporting bloom filter to file\n", process_id);
+    //Workers may PUT/DELETE already, the lock keeps the exported file consistent
+    pthread_mutex_lock(&filter_lock);
 
     char filepath[256];
     snprintf(filepath, sizeof(filepath), "%s/bloom_process_%d.dat", BLOOM_FILE_DIR, process_id);
@@ -196,6 +696,7 @@ void broadcast_bloom_filter(){
 
     if(result != BLOOM_SUCCESS){
         fprintf(stderr, "ERROR HAPPENED: process %d failed to export bloom filter", process_id);
+        pthread_mutex_unlock(&filter_lock);
         return;
     }
 
@@ -216,6 +717,7 @@ void broadcast_bloom_filter(){
     }
 
     bloom_broadcasted = 1;
+    pthread_mutex_unlock(&filter_lock);
     printf("Process %d bloom filter location broadcasted\n", process_id);
 }
 
@@ -234,144 +736,1053 @@ void handle_bloom_message(const char *msg){
 }
 
 
+static void retire_peer_filter(BloomFilter *old){
+    //Inline mode: the main thread is the only reader and it is here
+    if(!workers_running){
+        bloom_filter_destroy(old);
+        free(old);
+        return;
+    }
+    RetiredFilter *r = malloc(sizeof(RetiredFilter));
+    if(r == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : Process %d keeps a replaced peer filter, no memory to retire it\n", process_id);
+        return;
+    }
+    r->filter = old;
+    r->epoch = __atomic_add_fetch(&filter_epoch, 1, __ATOMIC_SEQ_CST);
+    r->next = retired_filters;
+    retired_filters = r;
+}
+
+//Called from the main loop, frees the replaced filters no worker can still be reading
+void free_retired_filters(){
+    if(retired_filters == NULL) return;
+    unsigned long oldest = __atomic_load_n(&filter_epoch, __ATOMIC_SEQ_CST);
+    for(int w = 0; workers_running && w < num_workers; w++){
+        unsigned long seen = __atomic_load_n(&workers[w].seen_epoch, __ATOMIC_ACQUIRE);
+        if(seen < oldest) oldest = seen;
+    }
+    RetiredFilter **link = &retired_filters;
+    while(*link != NULL){
+        RetiredFilter *r = *link;
+        if(r->epoch > oldest){
+            link = &r->next;
+            continue;
+        }
+        *link = r->next;
+        bloom_filter_destroy(r->filter);
+        free(r->filter);
+        free(r);
+    }
+}
+
+//Peer filters are imported here on the main thread and only read by the workers. A peer that is
+//re-spawned or read again on rejoin gets a fresh filter, published by swapping the pointer while
+//queries run; the old one is retired until the workers are past it.
 void update_peer_bloom_filter_from_file(int peer_id, const char *filepath){
     printf("SUCCESS : Process %d received bloom filter from process %d\n", process_id, peer_id);
 
     if(peer_bloom_filters == NULL){
-        peer_bloom_filters = calloc(num_processes, sizeof(BloomFilter));
-        peer_bloom_received = calloc(num_processes, sizeof(int));
+        peer_bloom_filters = arena_alloc(&process_arena, num_processes * sizeof(BloomFilter*));
+        peer_bloom_received = arena_alloc(&process_arena, num_processes * sizeof(int));
+        peer_generation = arena_alloc(&process_arena, num_processes * sizeof(uint64_t));
+        peer_sync_round = arena_alloc(&process_arena, num_processes * sizeof(uint64_t));
+        peer_sync_next = arena_alloc(&process_arena, num_processes * sizeof(uint64_t));
     }
 
-    if(peer_bloom_received[peer_id]){
-        bloom_filter_destroy(&peer_bloom_filters[peer_id]);
+    //A failed import keeps the filter we have
+    BloomFilter *bf = calloc(1, sizeof(BloomFilter));
+    if(bf == NULL || bloom_filter_import(bf, (char*)filepath) != BLOOM_SUCCESS){
+        free(bf);
+        fprintf(stderr, "[ERROR HAPPENED] : Process %d failed to import bloom filter from %d\n", process_id, peer_id);
+        return;
     }
+    if(interleave_peer_filters){
+        placement_interleave(bf->bloom, bf->bloom_length);
+    } else {
+        placement_bind_local(bf->bloom, bf->bloom_length);
+    }
+    if(bf->number_hashes > max_peer_hashes){
+        __atomic_store_n(&max_peer_hashes, bf->number_hashes, __ATOMIC_RELEASE);
+    }
+    peer_generation[peer_id] = 0;
+    BloomFilter *old = __atomic_exchange_n(&peer_bloom_filters[peer_id], bf, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&peer_bloom_received[peer_id], 1, __ATOMIC_RELEASE);
+    if(old != NULL){
+        retire_peer_filter(old);
+    }
+    printf("SUCCESS : Process %d imported bloom filter from process %d\n", process_id, peer_id);
 
-    int result = bloom_filter_import(&peer_bloom_filters[peer_id], (char*)filepath);
+    note_routing_ready();
+}
 
-    if(result == BLOOM_SUCCESS){
-        peer_bloom_received[peer_id] = 1;
-        printf("SUCCESS : Process %d imported bloom filter from process %d\n", process_id, peer_id);
+static long current_tick(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000L + ts.tv_nsec / 1000000L) / TIMEOUT_WHEEL_TICK_MS;
+}
+
+static long current_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+static void wheel_link(Worker *w, int slot, long tick){
+    PendingQuery *pq = &w->pending_queries[slot];
+    pq->deadline_tick = tick;
+    int head = w->timeout_wheel[tick % TIMEOUT_WHEEL_SLOTS];
+    pq->wheel_prev = -1;
+    pq->wheel_next = head;
+    if(head >= 0){
+        w->pending_queries[head].wheel_prev = slot;
+    }
+    w->timeout_wheel[tick % TIMEOUT_WHEEL_SLOTS] = slot;
+}
+
+static void wheel_unlink(Worker *w, int slot){
+    PendingQuery *pq = &w->pending_queries[slot];
+    if(pq->wheel_prev >= 0){
+        w->pending_queries[pq->wheel_prev].wheel_next = pq->wheel_next;
     } else {
-        fprintf(stderr, "[ERROR HAPPENED] : Process %d failed to import bloom filter from %d\n", process_id, peer_id);
+        w->timeout_wheel[pq->deadline_tick % TIMEOUT_WHEEL_SLOTS] = pq->wheel_next;
+    }
+    if(pq->wheel_next >= 0){
+        w->pending_queries[pq->wheel_next].wheel_prev = pq->wheel_prev;
     }
+    pq->wheel_prev = -1;
+    pq->wheel_next = -1;
 }
 
-//User query is below, it will come from manager (manager.c simulates users)
-void handle_query_from_manager(const char *msg){
-    int key = atoi(msg + 6);
+static void batch_init(MsgBatch *b, int receiver, int queue, const char *header){
+    b->receiver = receiver;
+    b->queue = queue;
+    snprintf(b->header, sizeof(b->header), "%s", header);
+    b->len = 0;
+    b->entries = 0;
+    b->buf = NULL;
+    b->pending = NULL;
+}
 
+static void batch_flush(MsgBatch *b){
+    if(b->entries == 0) return;
+    send_msg_to_queue(process_id, b->receiver, b->queue, b->buf);
+    b->len = 0;
+    b->entries = 0;
+}
 
-    if(check_own_keys(key)){
-        printf("[QUERY LOOKUP] : Process %d found key %d locally\n", process_id, key);
-        
-        char response[BUF_SIZE];
-        snprintf(response, sizeof(response), "FOUND:%d:PROCESS_%d", key, process_id);
-        send_msg(process_id, num_processes, response);
+static void batch_add(MsgBatch *b, const char *fmt, ...){
+    char entry[BUF_SIZE];
+    va_list args;
+    va_start(args, fmt);
+    int entry_len = vsnprintf(entry, sizeof(entry), fmt, args);
+    va_end(args);
+
+    if(b->buf == NULL){
+        b->buf = arena_alloc(&process_arena, BATCH_MSG_SIZE);
+        if(b->buf == NULL){
+            fprintf(stderr, "Process %d failed to allocate message batch\n", process_id);
+            exit(1);
+        }
+    }
+    if(b->entries > 0 && b->len + 1 + entry_len >= BATCH_MSG_SIZE){
+        batch_flush(b);
+    }
+    if(b->entries == 0){
+        b->len = snprintf(b->buf, BATCH_MSG_SIZE, "%s", b->header);
+    } else {
+        b->buf[b->len++] = ',';
+    }
+    memcpy(b->buf + b->len, entry, entry_len + 1);
+    b->len += entry_len;
+    b->entries++;
+    if(b->pending != NULL){
+        process_set_add(b->pending, b->receiver);
+    }
+}
+
+//Called after every handled message (inline mode) or every drained queue round (threaded mode),
+//so a batch of N keys costs one datagram per peer plus one reply
+void flush_batches(Worker *w){
+    for(int p = process_set_next(&w->pending_peers, 0); p >= 0; p = process_set_next(&w->pending_peers, p + 1)){
+        batch_flush(&w->pquery_batches[p]);
+        batch_flush(&w->pget_batches[p]);
+        batch_flush(&w->pfound_batches[p]);
+        batch_flush(&w->pnotfound_batches[p]);
+    }
+    process_set_clear(&w->pending_peers);
+    batch_flush(&w->found_reply);
+    batch_flush(&w->notfound_reply);
+    batch_flush(&w->update_reply);
+}
+
+//Adds or removes the key in own_counts and copies the bits it touched to own_bloom.
+//Has to hold filter_lock once workers run. Blocks with a flipped bit get the next generation.
+void own_filter_update(int key, int add){
+    char key_str[32];
+    snprintf(key_str, sizeof(key_str), "%d", key);
+    uint64_t *hashes = counting_bloom_filter_calculate_hashes(&own_counts, key_str, own_counts.number_hashes);
+
+    if(add){
+        counting_bloom_filter_add_string_alt(&own_counts, hashes, own_counts.number_hashes);
+    } else {
+        counting_bloom_filter_remove_string_alt(&own_counts, hashes, own_counts.number_hashes);
+    }
+
+    int flipped = 0;
+    for(unsigned int i = 0; i < own_counts.number_hashes; i++){
+        uint64_t bit = hashes[i] % own_counts.number_bits;
+        unsigned char mask = 1 << (bit % 8);
+        int was_set = (own_bloom.bloom[bit / 8] & mask) != 0;
+        int is_set = counting_bloom_filter_get_count(&own_counts, bit) != 0;
+        if(was_set == is_set) continue;
+        if(is_set){
+            own_bloom.bloom[bit / 8] |= mask;
+        } else {
+            own_bloom.bloom[bit / 8] &= ~mask;
+        }
+        own_block_generation[bit / 8 / FILTER_SYNC_BLOCK_SIZE] = own_generation + 1;
+        flipped = 1;
+    }
+    if(flipped) own_generation++;
+    own_bloom.elements_added = own_counts.elements_added;
+    free(hashes);
+}
+
+static void finish_pending_query(Worker *w, int slot, int found_in_process, const char *reason){
+    PendingQuery *pq = &w->pending_queries[slot];
+
+    if(found_in_process >= 0){
+        if(!pq->want_value) batch_add(&w->found_reply, "%d:PROCESS_%d", pq->key, found_in_process);
+    } else {
+        batch_add(&w->notfound_reply, "%d:CHECKED_BY_PROCESS_%d:%s", pq->key, process_id, reason);
+    }
+
+    wheel_unlink(w, slot);
+    pq->state = PQ_FREE;
+}
+
+//Returns the request id the PQUERYs have to carry so that the replies find this entry again.
+//Ids are per worker, replies for a key always come back to the worker that owns the key.
+static int start_pending_query(Worker *w, int key, int want_value, int candidates, int direct_owner, int hedge_owner){
+    int req_id = w->next_req_id;
+    w->next_req_id = (w->next_req_id + 1) & 0x7fffffff;
+    int slot = req_id % MAX_PENDING_QUERIES;
+
+    if(w->pending_queries[slot].state == PQ_WAITING){
+        //More than MAX_PENDING_QUERIES lookups in flight, the oldest one gives up early
+        fprintf(stderr, "[ERROR HAPPENED] : Process %d pending query table is full, expiring key %d\n", process_id, w->pending_queries[slot].key);
+        finish_pending_query(w, slot, -1, "TIMEOUT");
+    }
+
+    PendingQuery *pq = &w->pending_queries[slot];
+    pq->state = PQ_WAITING;
+    pq->req_id = req_id;
+    pq->key = key;
+    pq->pending = candidates;
+    pq->want_value = want_value;
+    pq->direct_owner = direct_owner;
+    pq->hedge_owner = hedge_owner;
+    pq->sent_us = current_us();
+    long now = current_tick();
+    pq->final_deadline_tick = now + (PQUERY_TIMEOUT_MS + TIMEOUT_WHEEL_TICK_MS - 1) / TIMEOUT_WHEEL_TICK_MS;
+    wheel_link(w, slot, hedge_owner >= 0 ? now + w->hedge_delay_ticks : pq->final_deadline_tick);
+
+    return req_id;
+}
+
+static int find_pending_query(Worker *w, int req_id, int key){
+    if(req_id < 0) return -1;
+    int slot = req_id % MAX_PENDING_QUERIES;
+    PendingQuery *pq = &w->pending_queries[slot];
+    if(pq->state != PQ_WAITING || pq->req_id != req_id || pq->key != key){
+        return -1;
+    }
+    return slot;
+}
+
+static MsgBatch *peer_request_batch(Worker *w, int want_value, int p){
+    return want_value ? &w->pget_batches[p] : &w->pquery_batches[p];
+}
+
+//Small values go inline as "VALUE:<key>:PROCESS_<p>:<len>:" + bytes, large ones as
+//"VALUE_SHM:<key>:PROCESS_<p>:<len>:<path>:<offset>" for the manager to read from the chunk file.
+//Keys without a value answer with length 0.
+static void send_value(Worker *w, int key){
+    int v = key_index_find(&w->index, key);
+    const ValueEntry *e = v >= VALUE_SLOT_BASE ? value_store_get(&w->values, v - VALUE_SLOT_BASE) : NULL;
+    uint32_t len = e != NULL ? e->len : 0;
+    const char *shm_path = e != NULL ? value_store_shm_path(&w->values, e) : NULL;
+
+    if(shm_path != NULL){
+        char msg[256];
+        snprintf(msg, sizeof(msg), "VALUE_SHM:%d:PROCESS_%d:%u:%s:%lu", key, process_id, len, shm_path, (unsigned long)e->shm_offset);
+        send_msg(process_id, num_processes, msg);
         return;
     }
+    int header = snprintf(w->value_msg, 64, "VALUE:%d:PROCESS_%d:%u:", key, process_id, len);
+    if(len > 0) memcpy(w->value_msg + header, e->data, len);
+    send_bytes(process_id, num_processes, w->value_msg, header + len);
+}
+
+//Walks every wheel slot between the last call and now, so it costs nothing when no deadline passed
+void expire_pending_queries(Worker *w){
+    long now = current_tick();
+    if(now - w->wheel_tick > TIMEOUT_WHEEL_SLOTS){
+        w->wheel_tick = now - TIMEOUT_WHEEL_SLOTS;
+    }
+
+    while(w->wheel_tick < now){
+        w->wheel_tick++;
+        int slot = w->timeout_wheel[w->wheel_tick % TIMEOUT_WHEEL_SLOTS];
+        while(slot >= 0){
+            int next = w->pending_queries[slot].wheel_next;
+            PendingQuery *pq = &w->pending_queries[slot];
+            if(pq->deadline_tick <= now && pq->hedge_owner >= 0){
+                //The replica asked first is slow, ask the next one too and keep the original deadline
+                printf("Process %d hedging key %d to process %d\n", process_id, pq->key, pq->hedge_owner);
+                batch_add(peer_request_batch(w, pq->want_value, pq->hedge_owner), "%d@%d", pq->key, pq->req_id);
+                pq->pending++;
+                pq->hedge_owner = -1;
+                w->hedged_queries++;
+                wheel_unlink(w, slot);
+                wheel_link(w, slot, pq->final_deadline_tick);
+            } else if(pq->deadline_tick <= now){
+                printf("Process %d timed out waiting for %d peer(s) on key %d\n", process_id, w->pending_queries[slot].pending, w->pending_queries[slot].key);
+                finish_pending_query(w, slot, -1, "TIMEOUT");
+            }
+            slot = next;
+        }
+    }
+}
+
+//Hashes the key once and checks it against every peer filter except skip, all peers use the default hash function
+static int probe_peer_filters(Worker *w, int key, int *candidates, int skip){
+    unsigned int num_hashes = __atomic_load_n(&max_peer_hashes, __ATOMIC_ACQUIRE);
+    if(peer_bloom_filters == NULL || num_hashes == 0) return 0;
 
     char key_str[32];
     snprintf(key_str, sizeof(key_str), "%d", key);
 
-    int queries_sent = 0;
+    int num_candidates = 0;
+    uint64_t *hashes = NULL;
     for (int p = 0; p < num_processes; p++){
-        if(p == process_id) continue;
-        if(peer_bloom_received != NULL && peer_bloom_received[p] && bloom_filter_check_string(&peer_bloom_filters[p], key_str) != BLOOM_FAILURE){
-            printf("[PROCESS %d detected that] key %d might be in process %d, querying it...\n", process_id, key, p);
-            char buf[BUF_SIZE];
-            snprintf(buf, sizeof(buf), "PQUERY:%d:FROM_%d", key, process_id);
-            send_msg(process_id, p, buf);
-            queries_sent++;
+        if(p == process_id || p == skip || peer_is_down(p)) continue;
+        //Loaded once, the main thread may swap in a new filter meanwhile and frees this one after our round
+        BloomFilter *bf = __atomic_load_n(&peer_bloom_filters[p], __ATOMIC_ACQUIRE);
+        if(bf == NULL) continue;
+        if(hashes == NULL){
+            hashes = bloom_filter_calculate_hashes(bf, key_str, num_hashes);
+        }
+        w->routing_probes++;
+        if(bloom_filter_check_string_alt(bf, hashes, num_hashes) != BLOOM_FAILURE){
+            candidates[num_candidates++] = p;
+        }
+    }
+    free(hashes);
+    return num_candidates;
+}
+
+static void route_query(Worker *w, int key, int want_value){
+    if(check_own_keys(w, key)){
+        printf("[QUERY LOOKUP] : Process %d found key %d locally\n", process_id, key);
+        if(want_value){
+            send_value(w, key);
+        } else {
+            batch_add(&w->found_reply, "%d:PROCESS_%d", key, process_id);
+        }
+        return;
+    }
+
+    w->routed_queries++;
+    int home = key_home(key, key_placement, num_processes);
+    if(home >= 0 && !is_replica_of(process_id, home)){
+        //Common case, one hop and no filter probe. The filters are only asked if the replicas do not have it.
+        //Senders start at different replicas to spread the load, the next live one is the hedge.
+        int first = -1, hedge = -1;
+        for(int r = 0; r < replication_factor && hedge < 0; r++){
+            int p = (home + (process_id + r) % replication_factor) % num_processes;
+            if(peer_is_down(p)) continue;
+            if(first < 0) first = p;
+            else hedge = p;
         }
+        if(first >= 0){
+            int req_id = start_pending_query(w, key, want_value, 1, first, hedge);
+            batch_add(peer_request_batch(w, want_value, first), "%d@%d", key, req_id);
+            return;
+        }
+        //Every replica is down, a filter may still point at a process that got the key by PUT
     }
 
-    if(queries_sent == 0){
+    int *candidates = w->candidates;
+    int num_candidates = probe_peer_filters(w, key, candidates, -1);
+
+    if(num_candidates == 0){
         printf("Process %d could not find Key %d neither locally nor in blooms\n", process_id, key);
-        char response[BUF_SIZE];
-        snprintf(response, sizeof(response), "NOTFOUND:%d:CHECKED_BY_PROCESS_%d", key, process_id);
-        send_msg(process_id, num_processes, response);
+        batch_add(&w->notfound_reply, "%d:CHECKED_BY_PROCESS_%d", key, process_id);
+        return;
+    }
+
+    //A peer batch that never arrives is handled by the timeout wheel like any lost datagram
+    int req_id = start_pending_query(w, key, want_value, num_candidates, -1, -1);
+    for(int i = 0; i < num_candidates; i++){
+        printf("[PROCESS %d detected that] key %d might be in process %d, querying it...\n", process_id, key, candidates[i]);
+        batch_add(peer_request_batch(w, want_value, candidates[i]), "%d@%d", key, req_id);
     }
-    
 }
 
+//For a PGET the value goes straight to the manager, the sender only learns that it was found
+static void answer_peer_query(Worker *w, int key, int req_id, int sender_process, int want_value){
+    printf("Process %d Received peer query for key %d from process %d\n", process_id, key, sender_process);
 
-void handle_query_from_process(const char *msg){
-    if(strncmp(msg, "PQUERY:", 7) != 0){
+    if(check_own_keys(w, key)){
+        printf("Process %d found key %d which is a peer query\n", process_id, key);
+        if(want_value) send_value(w, key);
+        batch_add(&w->pfound_batches[sender_process], "%d@%d", key, req_id);
+    } else{
+        printf("Process %d could not find key %d\n", process_id, key);
+        batch_add(&w->pnotfound_batches[sender_process], "%d@%d", key, req_id);
+    }
+}
+
+//Keeps the last HEDGE_SAMPLES direct reply times and sets the hedge delay to their p95
+static void record_reply_time(Worker *w, long elapsed_us){
+    w->reply_us[w->reply_samples % HEDGE_SAMPLES] = elapsed_us;
+    w->reply_samples++;
+    if(w->reply_samples % HEDGE_SAMPLES != 0) return;
+
+    long sorted[HEDGE_SAMPLES];
+    memcpy(sorted, w->reply_us, sizeof(sorted));
+    for(int i = 1; i < HEDGE_SAMPLES; i++){
+        long v = sorted[i];
+        int j = i - 1;
+        while(j >= 0 && sorted[j] > v){
+            sorted[j + 1] = sorted[j];
+            j--;
+        }
+        sorted[j + 1] = v;
+    }
+    long p95_ticks = (sorted[HEDGE_SAMPLES * 95 / 100] / 1000 + TIMEOUT_WHEEL_TICK_MS) / TIMEOUT_WHEEL_TICK_MS;
+    long max_ticks = PQUERY_TIMEOUT_MS / 2 / TIMEOUT_WHEEL_TICK_MS;
+    w->hedge_delay_ticks = p95_ticks > max_ticks ? max_ticks : p95_ticks;
+}
+
+//First PFOUND answers the manager right away, later replies for the same request are dropped.
+//NOTFOUND is only sent once every candidate said PNOTFOUND (or the timeout wheel gave up on them).
+static void apply_peer_reply(Worker *w, int found, int key, int req_id, int replied_process){
+    int slot = find_pending_query(w, req_id, key);
+    if(slot < 0){
+        printf("Process %d dropped late reply for key %d from process %d\n", process_id, key, replied_process);
         return;
     }
+    PendingQuery *pq = &w->pending_queries[slot];
+    if(replied_process == pq->direct_owner){
+        record_reply_time(w, current_us() - pq->sent_us);
+    }
 
-    int key = atoi(msg+7);
+    if(found){
+        printf("Process %d Confirmed the existence of Key %d in process %d\n", process_id, key, replied_process);
+        finish_pending_query(w, slot, replied_process, NULL);
+        return;
+    }
 
-    const char *from_marker = strstr(msg, ":FROM_");
-    int sender_process = -1;
-    if(from_marker != NULL){
-        sender_process = atoi(from_marker + 6);
+    printf("Process %d could not find key %d in process %d\n", process_id, key, replied_process);
+    if(pq->direct_owner >= 0){
+        //Replicas hold the same keys, so one of them is enough to say it is not at home. It may have been
+        //PUT elsewhere: the same request continues with the filter candidates, a hedge in flight still counts.
+        int *candidates = w->candidates;
+        int num_candidates = probe_peer_filters(w, key, candidates, replied_process);
+        pq->direct_owner = -1;
+        if(pq->hedge_owner >= 0){
+            pq->hedge_owner = -1;
+            wheel_unlink(w, slot);
+            wheel_link(w, slot, pq->final_deadline_tick);
+        }
+        pq->pending += num_candidates - 1;
+        for(int i = 0; i < num_candidates; i++){
+            batch_add(peer_request_batch(w, pq->want_value, candidates[i]), "%d@%d", key, req_id);
+        }
+        if(pq->pending == 0){
+            finish_pending_query(w, slot, -1, "ALL_CHECKED");
+        }
+        return;
+    }
+    if(--pq->pending == 0){
+        finish_pending_query(w, slot, -1, "ALL_CHECKED");
     }
+}
 
-    printf("Process %d Received peer query for key %d from process %d\n", process_id, key, sender_process);
+//The owning worker decides whether the key is really new or really gone, only then the filter changes.
+//data is the value of a SET, NULL for PUT and DELETE.
+static void apply_update(Worker *w, int key, int put, const char *data, int len){
+    int present = check_own_keys(w, key);
+    int v = present ? key_index_find(&w->index, key) : -1;
+    int slot = v >= VALUE_SLOT_BASE ? v - VALUE_SLOT_BASE : -1;
+    //Keys placed here are found without the filter. A PUT may reach only one replica though,
+    //so with replicas runtime keys always go in and their value entry tells on DELETE.
+    int runtime = slot >= 0 && value_store_get(&w->values, slot)->runtime;
+    int filtered = !placed_here(key) || (replication_factor > 1 && (put || runtime));
+
+    if(put && (!present || (data != NULL && slot < 0))){
+        slot = value_store_new(&w->values, !present);
+        if(slot < 0 || key_index_insert(&w->index, key, VALUE_SLOT_BASE + slot) < 0){
+            if(slot >= 0) value_store_free(&w->values, slot);
+            fprintf(stderr, "[ERROR HAPPENED] : Process %d has no room for key %d\n", process_id, key);
+            batch_add(&w->update_reply, "%d:FAILED:PROCESS_%d", key, process_id);
+            return;
+        }
+    } else if(!put && present){
+        key_index_remove(&w->index, key);
+        if(slot >= 0) value_store_free(&w->values, slot);
+    }
+    if(put && data != NULL && value_store_set(&w->values, slot, data, len) < 0){
+        fprintf(stderr, "[ERROR HAPPENED] : Process %d has no room for the value of key %d\n", process_id, key);
+    }
+    if(put != present && filtered){
+        pthread_mutex_lock(&filter_lock);
+        own_filter_update(key, put);
+        pthread_mutex_unlock(&filter_lock);
+    }
+    printf("Process %d %s key %d\n", process_id, put ? "stored" : (present ? "deleted" : "had no"), key);
+    batch_add(&w->update_reply, "%d:%s:PROCESS_%d", key, put ? (data != NULL ? "SET" : "PUT") : (present ? "DELETE" : "MISSING"), process_id);
+}
 
-    if(check_own_keys(key)){
-        printf("Process %d found key %d which is a peer query", process_id, key);
+static void handle_work_item(Worker *w, const WorkItem *item){
+    switch(item->type){
+        case WORK_QUERY:
+        case WORK_GET:
+            route_query(w, item->key, item->type == WORK_GET);
+            break;
+        case WORK_PQUERY:
+        case WORK_PGET:
+            answer_peer_query(w, item->key, item->req_id, item->peer, item->type == WORK_PGET);
+            break;
+        case WORK_PFOUND:
+        case WORK_PNOTFOUND:
+            apply_peer_reply(w, item->type == WORK_PFOUND, item->key, item->req_id, item->peer);
+            break;
+        case WORK_BUILD_SHARD:
+            build_shard(w);
+            break;
+        case WORK_PUT:
+        case WORK_DELETE:
+            apply_update(w, item->key, item->type == WORK_PUT, NULL, 0);
+            break;
+        case WORK_SET:
+            apply_update(w, item->key, 1, item->data, item->len);
+            if(item->len <= VALUE_INLINE_MAX){
+                scratch_put(&value_scratch, item->data);
+            } else {
+                free(item->data);
+            }
+            break;
+    }
+}
 
-        if(sender_process >= 0){
-            char response[BUF_SIZE];
-            snprintf(response, sizeof(response), "PFOUND:%d:IN_PROCESS_%d", key, process_id);
-            send_msg(process_id, sender_process, response);
+//Hands the item to the worker that owns the key. Inline mode handles it right here, and so does
+//a worker that read the message from its own receive queue (senders already picked it by key hash).
+static void dispatch_work(Worker *direct, int type, int key, int req_id, int peer){
+    WorkItem item = {type, key, req_id, peer, NULL, 0};
+    if(direct != NULL){
+        if(key_shard(key, num_workers) != direct->id){
+            fprintf(stderr, "[ERROR HAPPENED] : Process %d worker %d got key %d of another shard, senders disagree on the queue count\n", process_id, direct->id, key);
         }
-    } else{
-        printf("Process %d could not find key %d", process_id, key);
+        handle_work_item(direct, &item);
+        return;
+    }
+    if(!workers_running){
+        handle_work_item(&workers[0], &item);
+        return;
+    }
+
+    SpscQueue *q = &workers[key_shard(key, num_workers)].queue;
+    while(!spsc_push(q, &item)){
+        usleep(10); //worker is behind, wait for it instead of dropping the key
+    }
+}
+
+//The value is copied for a worker thread, inline it is used straight from the message
+static void dispatch_set(Worker *direct, int key, const char *data, int len){
+    if(direct != NULL || !workers_running){
+        apply_update(direct != NULL ? direct : &workers[0], key, 1, data, len);
+        return;
+    }
+    WorkItem item = {WORK_SET, key, 0, -1, len <= VALUE_INLINE_MAX ? scratch_get(&value_scratch) : malloc(len), len};
+    if(item.data == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : Process %d could not copy the value of key %d\n", process_id, key);
+        return;
+    }
+    memcpy(item.data, data, len);
+    SpscQueue *q = &workers[key_shard(key, num_workers)].queue;
+    while(!spsc_push(q, &item)){
+        usleep(10);
+    }
+}
+
+//User query is below, it will come from manager (manager.c simulates users)
+//Format: "QUERY:key1,key2,..." or "GET:key1,key2,...", a single key is just a batch of one
+void handle_query_from_manager(Worker *direct, const char *msg){
+    int get = strncmp(msg, "GET:", 4) == 0;
+    const char *ptr = strchr(msg, ':') + 1;
+    while(*ptr != '\0'){
+        char *end;
+        int key = (int)strtol(ptr, &end, 10);
+        if(end == ptr) break;
+        ptr = (*end == ',') ? end + 1 : end;
+
+        dispatch_work(direct, get ? WORK_GET : WORK_QUERY, key, 0, -1);
+    }
+}
+
+//"SET:<key>:<len>:" + len raw bytes, or "SET_SHM:<key>:<len>:<path>" for values above VALUE_INLINE_MAX
+void handle_set_from_manager(const char *msg, int msg_len){
+    int shm = strncmp(msg, "SET_SHM:", 8) == 0;
+    char *end;
+    int key = (int)strtol(msg + (shm ? 8 : 4), &end, 10);
+    if(*end != ':') return;
+    long len = strtol(end + 1, &end, 10);
+    if(*end != ':' || len < 0) return;
+    const char *value = end + 1;
+
+    if(!shm){
+        if(value + len > msg + msg_len){
+            fprintf(stderr, "Process %d received a cut off SET for key %d\n", process_id, key);
+            return;
+        }
+        dispatch_set(NULL, key, value, (int)len);
+        return;
+    }
+
+    int fd = open(value, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || st.st_size < len){
+        fprintf(stderr, "[ERROR HAPPENED] : Process %d could not read the value of key %d from %s\n", process_id, key, value);
+        if(fd >= 0) close(fd);
+        return;
+    }
+    char *data = len > 0 ? mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    close(fd);
+    if(data == MAP_FAILED) return;
+    dispatch_set(NULL, key, data, (int)len);
+    if(data != NULL) munmap(data, len);
+}
+
+//"PUT:k1,k2,..." / "DELETE:k1,k2,...", acked with one UPDATED list
+void handle_update_from_manager(Worker *direct, const char *msg, int put){
+    const char *ptr = strchr(msg, ':') + 1;
+    while(*ptr != '\0'){
+        char *end;
+        int key = (int)strtol(ptr, &end, 10);
+        if(end == ptr) break;
+        ptr = (*end == ',') ? end + 1 : end;
+
+        dispatch_work(direct, put ? WORK_PUT : WORK_DELETE, key, 0, -1);
+    }
+}
+
+//Asks every peer for the blocks of its filter that changed after the generation we hold.
+//A peer with nothing new does not answer. Called from the main loop every FILTER_SYNC_MS.
+void request_filter_sync(){
+    if(peer_bloom_received == NULL) return;
+    char msg[96];
+    for(int p = 0; p < num_processes; p++){
+        if(p == process_id || !peer_bloom_received[p] || peer_is_down(p)) continue;
+        //An unfinished sync from the last round is dropped, its blocks are asked for again
+        peer_sync_round[p] = 0;
+        peer_sync_next[p] = 0;
+        snprintf(msg, sizeof(msg), "FILTER_SYNC:FROM_%d:GEN_%lu:BLOCK_0", process_id, (unsigned long)peer_generation[p]);
+        send_msg(process_id, p, msg);
+    }
+}
+
+//"FILTER_SYNC:FROM_<p>:GEN_<g>:BLOCK_<b>", answered with the changed blocks from b on in one FILTER_BLOCKS datagram
+void handle_filter_sync_request(const char *msg){
+    unsigned long since, from_block;
+    int peer;
+    if(sscanf(msg, "FILTER_SYNC:FROM_%d:GEN_%lu:BLOCK_%lu", &peer, &since, &from_block) != 3 ||
+       peer < 0 || peer >= num_processes || peer == process_id){
+        fprintf(stderr, "Process %d received malformed filter sync request\n", process_id);
+        return;
+    }
+    if(!bloom_broadcasted) return;
+
+    static uint8_t reply[MAX_DATAGRAM_SIZE];
+    size_t payload_len;
+    uint64_t next_block;
+    pthread_mutex_lock(&filter_lock);
+    uint64_t generation = own_generation;
+    int blocks = filter_sync_encode(own_bloom.bloom, own_bloom.bloom_length, own_block_generation, since, from_block,
+                                    reply + FILTER_BLOCKS_HEADER_SIZE, sizeof(reply) - FILTER_BLOCKS_HEADER_SIZE,
+                                    &payload_len, &next_block);
+    pthread_mutex_unlock(&filter_lock);
+    if(blocks == 0 && from_block == 0) return;
+
+    int32_t sender = process_id;
+    uint64_t first = from_block;
+    size_t pos = 14;
+    memcpy(reply, FILTER_BLOCKS_HEADER, 14);
+    memcpy(reply + pos, &sender, sizeof(sender));
+    pos += sizeof(sender);
+    memcpy(reply + pos, &generation, sizeof(generation));
+    pos += sizeof(generation);
+    memcpy(reply + pos, &first, sizeof(first));
+    pos += sizeof(first);
+    memcpy(reply + pos, &next_block, sizeof(next_block));
+    send_bytes(process_id, peer, reply, FILTER_BLOCKS_HEADER_SIZE + payload_len);
+}
+
+//Binary reply: "FILTER_BLOCKS:" + int32 sender + uint64 generation + uint64 from_block + uint64 next_block + runs.
+//Workers probe the peer filter while blocks are copied in, a probe sees every byte either old or new.
+void handle_filter_blocks(const char *msg, int len){
+    if(len < (int)FILTER_BLOCKS_HEADER_SIZE) return;
+    int32_t peer;
+    uint64_t generation, from_block, next_block;
+    size_t pos = 14;
+    memcpy(&peer, msg + pos, sizeof(peer));
+    pos += sizeof(peer);
+    memcpy(&generation, msg + pos, sizeof(generation));
+    pos += sizeof(generation);
+    memcpy(&from_block, msg + pos, sizeof(from_block));
+    pos += sizeof(from_block);
+    memcpy(&next_block, msg + pos, sizeof(next_block));
+
+    if(peer < 0 || peer >= num_processes || peer_bloom_received == NULL || !peer_bloom_received[peer]){
+        fprintf(stderr, "[ERROR HAPPENED] : Process %d got filter blocks from %d before its filter\n", process_id, peer);
+        return;
+    }
+    if(from_block != peer_sync_next[peer]) return;
+
+    BloomFilter *bf = peer_bloom_filters[peer];
+    int applied = filter_sync_apply((const uint8_t*)msg + FILTER_BLOCKS_HEADER_SIZE, len - FILTER_BLOCKS_HEADER_SIZE,
+                                    from_block, bf->bloom, bf->bloom_length);
+    if(applied < 0){
+        fprintf(stderr, "[ERROR HAPPENED] : Process %d got a corrupt filter sync from %d\n", process_id, peer);
+        return;
+    }
+
+    //Blocks that change while a sync needs several messages are newer than its first reply, so that generation is kept
+    if(from_block == 0) peer_sync_round[peer] = generation;
+    if(next_block >= filter_sync_num_blocks(bf->bloom_length)){
+        peer_generation[peer] = peer_sync_round[peer];
+        peer_sync_round[peer] = 0;
+        peer_sync_next[peer] = 0;
+        return;
+    }
+    peer_sync_next[peer] = next_block;
+    char request[96];
+    snprintf(request, sizeof(request), "FILTER_SYNC:FROM_%d:GEN_%lu:BLOCK_%lu", process_id,
+             (unsigned long)peer_generation[peer], (unsigned long)next_block);
+    send_msg(process_id, peer, request);
+}
+
+//Format: "PQUERY:FROM_<sender>:key@req,key@req,..." , answered with one PFOUND and/or one PNOTFOUND list.
+//"PGET:FROM_<sender>:..." is the same but a found key also sends its value to the manager.
+void handle_query_from_process(Worker *direct, const char *msg){
+    int get = strncmp(msg, "PGET:FROM_", 10) == 0;
+    if(!get && strncmp(msg, "PQUERY:FROM_", 12) != 0){
+        return;
+    }
+
+    char *end;
+    int sender_process = (int)strtol(msg + (get ? 10 : 12), &end, 10);
+    if(*end != ':' || sender_process < 0 || sender_process >= num_processes){
+        fprintf(stderr, "Process %d received malformed PQUERY message\n", process_id);
+        return;
+    }
+
+    const char *ptr = end + 1;
+    while(*ptr != '\0'){
+        int key = (int)strtol(ptr, &end, 10);
+        if(end == ptr || *end != '@') break;
+        int req_id = (int)strtol(end + 1, &end, 10);
+        ptr = (*end == ',') ? end + 1 : end;
+
+        dispatch_work(direct, get ? WORK_PGET : WORK_PQUERY, key, req_id, sender_process);
+    }
+}
+
+//Format: "PFOUND:IN_PROCESS_<peer>:key@req,..." or the same with PNOTFOUND
+void handle_response_from_process(Worker *direct, const char *msg){
+    int found = strncmp(msg, "PFOUND:", 7) == 0;
+    const char *process_marker = strstr(msg, "IN_PROCESS_");
+    if(process_marker == NULL){
+        fprintf(stderr, "Process %d received malformed peer reply\n", process_id);
+        return;
+    }
+
+    char *end;
+    int replied_process = (int)strtol(process_marker + 11, &end, 10);
+    if(*end != ':') return;
 
-        if(sender_process >= 0){
-            char response[BUF_SIZE];
-            snprintf(response, sizeof(response), "PNOTFOUND:%d:IN_PROCESS_%d", key, process_id);
-            send_msg(process_id, sender_process, response);
+    const char *ptr = end + 1;
+    while(*ptr != '\0'){
+        int key = (int)strtol(ptr, &end, 10);
+        if(end == ptr || *end != '@') break;
+        int req_id = (int)strtol(end + 1, &end, 10);
+        ptr = (*end == ',') ? end + 1 : end;
+
+        dispatch_work(direct, found ? WORK_PFOUND : WORK_PNOTFOUND, key, req_id, replied_process);
+    }
+}
+
+void init_workers(){
+    workers = arena_alloc(&process_arena, num_workers * sizeof(Worker));
+    if(workers == NULL){
+        fprintf(stderr, "Process %d failed to allocate %d workers\n", process_id, num_workers);
+        exit(1);
+    }
+
+    char header[32];
+    char values_path[64];
+    for(int w = 0; w < num_workers; w++){
+        Worker *wk = &workers[w];
+        wk->id = w;
+        wk->cpu = -1;
+        wk->recv_fd = -1;
+        //Keys of this shard hash to the same queue number on every peer, so all its traffic uses queue w
+        int send_queue = num_queues > 0 ? w : -1;
+
+        if(spsc_init(&wk->queue, WORK_QUEUE_SIZE) < 0){
+            fprintf(stderr, "Process %d failed to allocate work queue for worker %d\n", process_id, w);
+            exit(1);
+        }
+
+        for(int i = 0; i < MAX_PENDING_QUERIES; i++){
+            wk->pending_queries[i].state = PQ_FREE;
+            wk->pending_queries[i].wheel_prev = -1;
+            wk->pending_queries[i].wheel_next = -1;
+        }
+        for(int i = 0; i < TIMEOUT_WHEEL_SLOTS; i++){
+            wk->timeout_wheel[i] = -1;
+        }
+        wk->wheel_tick = current_tick();
+        wk->hedge_delay_ticks = HEDGE_INITIAL_MS / TIMEOUT_WHEEL_TICK_MS;
+
+        snprintf(values_path, sizeof(values_path), "/dev/shm/values_p%d_w%d", process_id, w);
+        value_store_init(&wk->values, values_path, &process_arena);
+        wk->value_msg = arena_alloc(&process_arena, VALUE_INLINE_MAX + 128);
+
+        wk->pquery_batches = arena_alloc(&process_arena, num_processes * sizeof(MsgBatch));
+        wk->pget_batches = arena_alloc(&process_arena, num_processes * sizeof(MsgBatch));
+        wk->pfound_batches = arena_alloc(&process_arena, num_processes * sizeof(MsgBatch));
+        wk->pnotfound_batches = arena_alloc(&process_arena, num_processes * sizeof(MsgBatch));
+        uint64_t *pending_words = arena_alloc(&process_arena, PROCESS_SET_WORDS(num_processes) * sizeof(uint64_t));
+        wk->candidates = arena_alloc(&process_arena, num_processes * sizeof(int));
+        if(wk->value_msg == NULL || wk->pquery_batches == NULL || wk->pget_batches == NULL ||
+           wk->pfound_batches == NULL || wk->pnotfound_batches == NULL || pending_words == NULL || wk->candidates == NULL){
+            fprintf(stderr, "Process %d failed to allocate message batches\n", process_id);
+            exit(1);
         }
+        process_set_init(&wk->pending_peers, pending_words, num_processes);
+        for(int p = 0; p < num_processes; p++){
+            snprintf(header, sizeof(header), "PQUERY:FROM_%d:", process_id);
+            batch_init(&wk->pquery_batches[p], p, send_queue, header);
+            snprintf(header, sizeof(header), "PGET:FROM_%d:", process_id);
+            batch_init(&wk->pget_batches[p], p, send_queue, header);
+            snprintf(header, sizeof(header), "PFOUND:IN_PROCESS_%d:", process_id);
+            batch_init(&wk->pfound_batches[p], p, send_queue, header);
+            snprintf(header, sizeof(header), "PNOTFOUND:IN_PROCESS_%d:", process_id);
+            batch_init(&wk->pnotfound_batches[p], p, send_queue, header);
+            wk->pquery_batches[p].pending = &wk->pending_peers;
+            wk->pget_batches[p].pending = &wk->pending_peers;
+            wk->pfound_batches[p].pending = &wk->pending_peers;
+            wk->pnotfound_batches[p].pending = &wk->pending_peers;
+        }
+        batch_init(&wk->found_reply, num_processes, -1, "FOUND:");
+        batch_init(&wk->notfound_reply, num_processes, -1, "NOTFOUND:");
+        batch_init(&wk->update_reply, num_processes, -1, "UPDATED:");
+
+        if(num_queues > 0){
+            wk->recv_fd = queue_fds[w];
+            wk->recv_buf = arena_alloc(&process_arena, config.bloom_msg_size);
+            if(wk->recv_buf == NULL){
+                fprintf(stderr, "Process %d failed to allocate receive buffer for worker %d\n", process_id, w);
+                exit(1);
+            }
+        }
+    }
+}
+
+//Only query traffic is sent to the receive queues, control messages stay on the main socket
+static int handle_queue_message(Worker *w, const char *buf){
+    if (strncmp(buf, "QUERY:", 6) == 0 || strncmp(buf, "GET:", 4) == 0) {
+        handle_query_from_manager(w, buf);
+    } else if (strncmp(buf, "PQUERY:", 7) == 0 || strncmp(buf, "PGET:", 5) == 0) {
+        handle_query_from_process(w, buf);
+    } else if (strncmp(buf, "PFOUND:", 7) == 0 || strncmp(buf, "PNOTFOUND:", 10) == 0) {
+        handle_response_from_process(w, buf);
+    } else {
+        fprintf(stderr, "[Process %d] Unknown message on queue %d: %s\n", process_id, w->id, buf);
+        return 0;
     }
+    return 1;
 }
 
-void handle_response_from_process(const char *msg){
-    if(strncmp(msg, "PFOUND:", 7) == 0){
-        int key = atoi(msg + 7);
-        const char *process_marker = strstr(msg, ":IN_PROCESS_");
-        int found_in_process = -1;
-        if(process_marker != NULL){
-            found_in_process = atoi(process_marker + 12);
+static void *worker_main(void *arg){
+    Worker *w = (Worker*)arg;
+
+    if(w->cpu >= 0){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+            fprintf(stderr, "[ERROR HAPPENED] : Process %d could not pin worker %d to cpu %d\n", process_id, w->id, w->cpu);
         }
+    }
 
-        printf("Process %d Confirmed the existence of Key %d in process %d\n", process_id, key, found_in_process);
+    WorkItem item;
+    while(!workers_stop){
+        int handled = 0;
+        //Filters retired before this point are not touched in this round any more
+        __atomic_store_n(&w->seen_epoch, __atomic_load_n(&filter_epoch, __ATOMIC_SEQ_CST), __ATOMIC_RELEASE);
+        ipc_cork();
+        if(w->recv_fd >= 0){
+            while(receive_msg(w->recv_fd, w->recv_buf, config.bloom_msg_size) > 0){
+                handle_queue_message(w, w->recv_buf);
+                handled++;
+            }
+        }
+        while(spsc_pop(&w->queue, &item)){
+            handle_work_item(w, &item);
+            handled++;
+        }
+        if(handled > 0){
+            flush_batches(w);
+        }
+        expire_pending_queries(w);
+        flush_batches(w);
+        ipc_uncork();
 
-        char response[BUF_SIZE];
-        snprintf(response, sizeof(response), "FOUND:%d:PROCESS_%d", key, found_in_process);
-        send_msg(process_id, num_processes, response);
-    } else if (strncmp(msg, "PNOTFOUND:", 10) == 0){
-        int key = atoi(msg + 10);
-        const char *process_marker = strstr(msg, ":IN_PROCESS_");
-        int checked_process = -1;
-        if(process_marker != NULL){
-            checked_process = atoi(process_marker + 12);
+        if(handled == 0){
+            usleep(100);
         }
+    }
+    return NULL;
+}
 
-        printf("Process %d could not find key %d in process %d\n", process_id, key, checked_process);
+//Workers are pinned round robin over the cores this process is allowed to run on
+void start_workers(){
+    if(num_workers <= 1) return;
+
+    cpu_set_t allowed;
+    int allowed_cpus[CPU_SETSIZE];
+    int num_allowed = 0;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0){
+        for(int c = 0; c < CPU_SETSIZE; c++){
+            if(CPU_ISSET(c, &allowed)) allowed_cpus[num_allowed++] = c;
+        }
+    }
+
+    //Workers must not take SIGTERM, the handler joins them
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    for(int w = 0; w < num_workers; w++){
+        workers[w].cpu = num_allowed > 0 ? allowed_cpus[w % num_allowed] : -1;
+        if(pthread_create(&workers[w].thread, NULL, worker_main, &workers[w]) != 0){
+            fprintf(stderr, "[ERROR HAPPENED] : Process %d failed to start worker %d\n", process_id, w);
+            exit(1);
+        }
     }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    workers_running = 1;
+    printf("Process %d started %d worker threads\n", process_id, num_workers);
+}
+
+void stop_workers(){
+    if(!workers_running) return;
+    workers_stop = 1;
+    for(int w = 0; w < num_workers; w++){
+        pthread_join(workers[w].thread, NULL);
+    }
+    workers_running = 0;
 }
 
 
 int main(int argc, char *argv[]){
-    if(argc < 3){
-        fprintf(stderr, "Usage: %s <process_id> <num_processes> \n", argv[0]);
+    if(argc < 2){
+        fprintf(stderr, "Usage: %s <process_id> [--snapshot_tag=tag] [--rejoin=1] [--name=value ...] (./manager --help lists the parameters)\n", argv[0]);
         return 1;
     }
 
     process_id = atoi(argv[1]);
-    num_processes = atoi(argv[2]);
+    //The manager passes its whole configuration, the two flags below are only for this process
+    for(int i = 2; i < argc; i++){
+        if(strncmp(argv[i], "--snapshot_tag=", 15) == 0){
+            snapshot_tag = strtoull(argv[i] + 15, NULL, 10);
+        } else if(strncmp(argv[i], "--rejoin=", 9) == 0){
+            rejoining = atoi(argv[i] + 9);
+        } else if(config_apply_arg(argv[i]) != 1){
+            fprintf(stderr, "[ERROR HAPPENED] : Process %d does not understand %s\n", process_id, argv[i]);
+            return 1;
+        }
+    }
+    num_processes = config.num_processes;
+    num_workers = config.workers_per_process;
+    if(num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
+    num_queues = config.receive_queues;
+    //Each queue belongs to exactly one worker, the shard function decides both
+    if(num_queues != 0 && (num_queues != num_workers || num_workers < 2)){
+        fprintf(stderr, "[ERROR HAPPENED] : Process %d needs one receive queue per worker (%d workers, %d queues)\n", process_id, num_workers, num_queues);
+        return 1;
+    }
+    interleave_peer_filters = config.interleave_peer_filters;
+    key_placement = config.key_placement;
+    if(key_placement > KEY_PLACEMENT_JUMP){
+        fprintf(stderr, "[ERROR HAPPENED] : Process %d does not know key_placement %d\n", process_id, key_placement);
+        return 1;
+    }
+    replication_factor = config.replication_factor;
+    if(replication_factor > num_processes) replication_factor = num_processes;
+    use_hugepages = config.hugepages;
+    arena_init(&process_arena, ARENA_DEFAULT_BLOCK, use_hugepages);
+    scratch_pool_init(&value_scratch, &process_arena, VALUE_INLINE_MAX);
+    peer_down = arena_alloc(&process_arena, num_processes * sizeof(int));
+    if(peer_down == NULL){
+        fprintf(stderr, "Process %d failed to allocate peer table\n", process_id);
+        return 1;
+    }
+    //The manager already pinned us, this only learns the node layout for the filter placement
+    placement_init();
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
+    //An address map puts this process on TCP like the rest of the cluster
+    if(config.address_map[0] != '\0' && ipc_use_address_map(config.address_map) != 0){
+        return 1;
+    }
+    if(config.io_uring){
+        ipc_use_io_uring();
+    }
+    ipc_set_receive_buffer(config.socket_rcvbuf);
+    ipc_reserve_endpoints(num_processes + 1); //the manager is endpoint num_processes
     comm_fd = initiate_communication(process_id);
+    if(num_queues > 0){
+        queue_fds = malloc(num_queues * sizeof(int));
+        initiate_queue_endpoints(process_id, num_queues, queue_fds);
+    }
+    init_workers();
+    //The manager skips the key stream for every process that reports a snapshot.
+    //A re-spawned process always reports, the manager streams its keys again on SNAPSHOT_MISSING.
+    if(snapshot_tag != 0 || rejoining){
+        char msg[64];
+        if(restore_snapshot()){
+            snprintf(msg, sizeof(msg), "SNAPSHOT_LOADED:%d:%d", process_id, num_keys);
+            import_existing_peer_filters();
+        } else {
+            snprintf(msg, sizeof(msg), "SNAPSHOT_MISSING:%d", process_id);
+        }
+        send_msg(process_id, num_processes, msg);
+    }
+    start_workers();
     printf("Process %d started, waiting for key assignment\n", process_id);
 
-    char *buf = malloc(BLOOM_MSG_SIZE);
+    char *buf = arena_alloc(&process_arena, config.bloom_msg_size);
     if(buf == NULL){
         fprintf(stderr, "Process %d failed to allocate receive buffer\n", process_id);
         return 1;
@@ -384,39 +1795,86 @@ int main(int argc, char *argv[]){
         }
         int messages_processed = 0;
 
+        //Replies of one drain round leave together when the transport can coalesce them
+        ipc_cork();
         while(1){
-            int n = receive_msg(comm_fd, buf, BLOOM_MSG_SIZE);
+            int n = receive_msg(comm_fd, buf, config.bloom_msg_size);
             if(n <= 0) break;
 
             messages_processed++;
 
             if (strncmp(buf, "KEYS:", 5) == 0) {
                 assign_keys_from_message(buf);
+            } else if(strncmp(buf, "KEYS_EXPECTED:", 14) == 0){
+                announce_keys(buf);
             } else if(strncmp(buf, "KEYS_DONE", 9) == 0){
                 finalize_keys();
-            } else if (strncmp(buf, "QUERY:", 6) == 0) {
-                handle_query_from_manager(buf);
+            } else if(strncmp(buf, "PING:", 5) == 0){
+                char pong[64];
+                snprintf(pong, sizeof(pong), "PONG:%d:%s", process_id, buf + 5);
+                send_msg(process_id, num_processes, pong);
+            } else if(strncmp(buf, "PEER_DOWN:", 10) == 0){
+                handle_peer_state(buf, 1);
+            } else if(strncmp(buf, "PEER_UP:", 8) == 0){
+                handle_peer_state(buf, 0);
+            } else if(strncmp(buf, "SNAPSHOT", 8) == 0 && buf[8] == '\0'){
+                char done[64];
+                snprintf(done, sizeof(done), "%s:%d", write_snapshot() ? "SNAPSHOT_DONE" : "SNAPSHOT_FAILED", process_id);
+                send_msg(process_id, num_processes, done);
+            } else if (strncmp(buf, "QUERY:", 6) == 0 || strncmp(buf, "GET:", 4) == 0) {
+                handle_query_from_manager(NULL, buf);
+            } else if (strncmp(buf, "SET:", 4) == 0 || strncmp(buf, "SET_SHM:", 8) == 0) {
+                handle_set_from_manager(buf, n);
+            } else if (strncmp(buf, "PUT:", 4) == 0) {
+                handle_update_from_manager(NULL, buf, 1);
+            } else if (strncmp(buf, "DELETE:", 7) == 0) {
+                handle_update_from_manager(NULL, buf, 0);
             } else if (strncmp(buf, "BLOOM_FILE:", 11) == 0) {
                 handle_bloom_message(buf);
-            } else if (strncmp(buf, "PQUERY:", 7) == 0) {
-                handle_query_from_process(buf);
+            } else if (strncmp(buf, "FILTER_SYNC:", 12) == 0) {
+                handle_filter_sync_request(buf);
+            } else if (strncmp(buf, FILTER_BLOCKS_HEADER, 14) == 0) {
+                handle_filter_blocks(buf, n);
+            } else if (strncmp(buf, "PQUERY:", 7) == 0 || strncmp(buf, "PGET:", 5) == 0) {
+                handle_query_from_process(NULL, buf);
             } else if (strncmp(buf, "PFOUND:", 7) == 0 || strncmp(buf, "PNOTFOUND:", 10) == 0) {
-                handle_response_from_process(buf);
+                handle_response_from_process(NULL, buf);
             } else {
                 fprintf(stderr, "[Process %d] Unknown message: %s\n", process_id, buf);
             }
+            if(!workers_running){
+                flush_batches(&workers[0]);
+            }
+        }
+        if(!workers_running){
+            expire_pending_queries(&workers[0]);
+            flush_batches(&workers[0]);
+        }
+        ipc_uncork();
+        free_retired_filters();
+
+        if(rejoining && !ready_sent && bloom_broadcasted && build_ms >= 0){
+            char ready[32];
+            snprintf(ready, sizeof(ready), "READY:%d", process_id);
+            send_msg(process_id, num_processes, ready);
+            ready_sent = 1;
         }
+
+        if(build_ms >= 0){
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long now_ms = now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+            if(now_ms - last_filter_sync_ms >= FILTER_SYNC_MS){
+                request_filter_sync();
+                last_filter_sync_ms = now_ms;
+            }
+        }
+
         if (messages_processed == 0) {
             usleep(1000);
         }
     }
-    free(buf);
     signal_handler(0);
-    
+
     return 0;
 }
-
-
-
-
-
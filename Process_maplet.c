@@ -1,500 +1,967 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <signal.h>
-#include "IPC.h"
-// MODIFIED: Changed from bloom.h to gqf headers
-#include "gqf.h"           // MODIFIED
-#include "gqf_file.h"      // MODIFIED
-#include <search.h>
-#include <time.h>
-
-
-#define MAX_KEYS 250000       
-#define MAX_PROCESSES 64
-#define BUF_SIZE 256          
-#define BLOOM_MSG_SIZE 262144 
-#define FALSE_POSITIVE_RATE 0.01 
-// COMMENTED OUT: No longer need file directory for QF
-// #define QF_FILE_DIR "/tmp"    // MODIFIED: Renamed from BLOOM_FILE_DIR
-
-int process_id;
-int num_processes;
-int *keys = NULL;
-int num_keys = 0;
-int keys_capacity = 0;
-int keys_finalized = 0;
-
-// MODIFIED: Single QF for all processes instead of own_bloom and peer_bloom_filters array
-QF all_processes_qf;                   // MODIFIED: Single QF containing keys from all processes with value=process_id
-int qf_initialized = 0;                // MODIFIED: Renamed from bloom_initialized
-int *peer_qf_received = NULL;          // MODIFIED: Renamed from peer_bloom_received - tracks which peers' keys we've received
-int qf_broadcasted = 0;                // MODIFIED: Renamed from bloom_broadcasted - tracks if we've sent our keys
-
-int comm_fd = -1;
-
-
-void signal_handler(int signum);
-int check_own_keys(int key);
-void assign_keys_from_message(const char *msg);
-void create_own_qf();                  // MODIFIED: Renamed from create_own_bloom_filter
-void broadcast_qf();                   // MODIFIED: Renamed from broadcast_bloom_filter - now sends keys instead of files
-void handle_qf_update(const char *msg);  // MODIFIED: New function to handle QF_UPDATE messages
-void handle_query_from_manager(const char *msg);
-void handle_query_from_process(const char *msg);
-
-
-void signal_handler(int signum){
-    printf("\n[Process %d] Received signal %d, cleaning up... \n", process_id, signum);
-
-    // MODIFIED: Clean up single QF instead of own_bloom and peer_bloom_filters array
-    if(qf_initialized){                                    // MODIFIED
-        qf_free(&all_processes_qf);                        // MODIFIED: Free single QF
-    }
-
-    if(peer_qf_received != NULL){                          // MODIFIED
-        free(peer_qf_received);                            // MODIFIED
-    }
-    if(keys != NULL){
-        free(keys);
-    }
-
-    hdestroy();
-    if(comm_fd >= 0){
-        close_communication(process_id, comm_fd);
-    }
-
-    // COMMENTED OUT: No longer using files
-    // char filepath[256];
-    // snprintf(filepath, sizeof(filepath), "%s/qf_process_%d.dat", QF_FILE_DIR, process_id);  // MODIFIED
-    // unlink(filepath);
-    exit(0);
-}
-
-
-int check_own_keys(int key){
-    if(!keys_finalized) return 0;
-    char key_str[32];
-    snprintf(key_str, sizeof(key_str), "%d", key);
-
-    ENTRY e, *ep;
-    e.key = key_str;
-    e.data = NULL;
-
-    ep = hsearch(e, FIND);
-    return (ep != NULL);
-
-}
-
-void assign_keys_from_message(const char *msg){
-    const char *ptr = msg+5;
-    char *copy = strdup(ptr);
-    char *tok = strtok(copy, ",");
-
-    while(tok != NULL){
-        if(num_keys >= keys_capacity){
-            int new_capacity = keys_capacity == 0 ? 100000 : keys_capacity * 2;
-            int *new_keys = realloc(keys, new_capacity * sizeof(int));
-            if(new_keys == NULL){
-                fprintf(stderr, "ERROR HAPPENED: process %d failed to allocate memory for keys \n", process_id);
-                free(copy);
-                exit(1);
-            }
-            keys = new_keys;
-            keys_capacity = new_capacity;
-        }
-        keys[num_keys++] = atoi(tok);
-        tok = strtok(NULL, ",");
-    }
-    free(copy);
-
-    if(num_keys % 100000 == 0){
-        printf("Process %d received %d keys so far\n", process_id, num_keys);
-    }
-}
-
-void finalize_keys(){
-    if(keys_finalized) return;
-    printf("Process %d finalizign %d keys\n", process_id, num_keys);
-
-    time_t start = time(NULL);
-
-    if(hcreate(num_keys * 2) == 0){
-        fprintf(stderr, "[ERROR HAPPENED] Process %d failed to create hash table \n", process_id);
-        exit(1);
-    }
-
-    for(int i = 0; i < num_keys; i++){
-        char *key_str = malloc(32);
-        snprintf(key_str, 32, "%d", keys[i]);
-
-        ENTRY e;
-        e.key = key_str;
-        e.data = (void*)(long)1;
-        if(hsearch(e, ENTER) == NULL){
-            fprintf(stderr, "Process %d failed to insert key %d\n", process_id, keys[i]);
-        }
-
-        if((i+1) % 500000 == 0){
-            printf("Process %d indexed %d/%d keys (%.1f%%)\n", i+1, process_id, num_keys, (i+1) * 100.0/num_keys);
-        }
-    }
-
-    time_t end = time(NULL);
-    printf("Process %d hash table created in %ld seconds \n", process_id, end-start);
-    keys_finalized = 1;
-    create_own_qf();                                       // MODIFIED: Renamed function call
-}
-
-// MODIFIED: Renamed function and creates single QF with own keys (value = process_id)
-void create_own_qf(){                                      // MODIFIED: Renamed from create_own_bloom_filter
-    // MODIFIED: Initialize single QF for all processes
-    if(qf_initialized){                                    // MODIFIED
-        qf_free(&all_processes_qf);                        // MODIFIED
-    }
-
-    printf("Process %d creating QF for %d keys \n", process_id, num_keys);  // MODIFIED
-    time_t start = time(NULL);
-    
-    // MODIFIED: Initialize single QF with capacity for own keys (will grow as we add peer keys)
-    uint64_t nslots = num_keys > 0 ? num_keys : 10;                                    // MODIFIED
-    if(!qf_malloc(&all_processes_qf, nslots, 64, 8, QF_HASH_DEFAULT, 0)){            // MODIFIED: value_bits=8 to store process_id (up to 256 processes)
-        fprintf(stderr, "ERROR: Process %d failed to allocate QF\n", process_id);     // MODIFIED
-        exit(1);                                                                       // MODIFIED
-    }                                                                                  // MODIFIED
-    
-    // MODIFIED: Enable auto-resize for when we add peer keys
-    qf_set_auto_resize(&all_processes_qf, true);                                      // MODIFIED
-
-    // MODIFIED: Initialize peer tracking array
-    if(peer_qf_received == NULL){                                                     // MODIFIED
-        peer_qf_received = calloc(num_processes, sizeof(int));                        // MODIFIED
-    }                                                                                  // MODIFIED
-
-    // MODIFIED: Insert own keys with value = process_id
-    for(int i = 0; i < num_keys; i++){
-        uint64_t key_val = (uint64_t)keys[i];                                        // MODIFIED
-        qf_insert(&all_processes_qf, key_val, process_id, 1, QF_NO_LOCK);           // MODIFIED: value = process_id
-        
-        if((i+1) % 500000 == 0){
-            printf("Process %d added %d/%d keys to QF (%.1f%%)\n", process_id, i+1, num_keys, (i+1) * 100.0 / num_keys);  // MODIFIED
-        }
-    }
-
-    time_t end = time(NULL);
-
-    qf_initialized = 1;                                                               // MODIFIED
-    printf("[Process %d] Created QF in %ld seconds\n", process_id, end-start);      // MODIFIED
-
-    // MODIFIED: Print QF stats
-    printf("[QF Stats] nslots: %lu, occupied: %lu, distinct elements: %lu\n",        // MODIFIED
-           qf_get_nslots(&all_processes_qf),                                         // MODIFIED
-           qf_get_num_occupied_slots(&all_processes_qf),                             // MODIFIED
-           qf_get_num_distinct_key_value_pairs(&all_processes_qf));                 // MODIFIED
-}
-
-// MODIFIED: Now sends keys in batches using new QF_UPDATE protocol
-void broadcast_qf(){                                                                  // MODIFIED: Renamed from broadcast_bloom_filter
-    if(qf_broadcasted) return;                                                        // MODIFIED
-    printf("PROCESS %d broadcasting keys to all processes\n", process_id);           // MODIFIED
-
-    // MODIFIED: Send keys in batches to all other processes using QF_UPDATE protocol
-    int batch_size = 10000;  // Send 10000 keys per message                          // MODIFIED
-    char *msg_buf = malloc(BLOOM_MSG_SIZE);                                          // MODIFIED
-    if(msg_buf == NULL){                                                             // MODIFIED
-        fprintf(stderr, "Process %d failed to allocate message buffer\n", process_id);  // MODIFIED
-        return;                                                                       // MODIFIED
-    }                                                                                 // MODIFIED
-
-    for (int p = 0; p < num_processes; p++){                                         // MODIFIED
-        if(p == process_id) continue;                                                 // MODIFIED
-        
-        // MODIFIED: Send keys in batches using QF_UPDATE protocol
-        for(int i = 0; i < num_keys; ){                                              // MODIFIED
-            // MODIFIED: Format: "QF_UPDATE:sender_id:key1,key2,key3,..."
-            int msg_len = snprintf(msg_buf, BLOOM_MSG_SIZE, "QF_UPDATE:%d:", process_id);  // MODIFIED: New protocol with sender_id
-            int keys_in_batch = 0;                                                    // MODIFIED
-            
-            // MODIFIED: Pack as many keys as fit in the message buffer
-            while(i < num_keys && keys_in_batch < batch_size){                       // MODIFIED
-                char key_str[32];                                                     // MODIFIED
-                snprintf(key_str, sizeof(key_str), "%d", keys[i]);                   // MODIFIED
-                
-                // MODIFIED: Check if adding this key would overflow the buffer
-                if(msg_len + strlen(key_str) + 2 >= BLOOM_MSG_SIZE){                // MODIFIED
-                    break;                                                            // MODIFIED
-                }                                                                     // MODIFIED
-                
-                if(keys_in_batch > 0){                                               // MODIFIED
-                    msg_len += snprintf(msg_buf + msg_len, BLOOM_MSG_SIZE - msg_len, ",");  // MODIFIED
-                }                                                                     // MODIFIED
-                msg_len += snprintf(msg_buf + msg_len, BLOOM_MSG_SIZE - msg_len, "%d", keys[i]);  // MODIFIED
-                
-                i++;                                                                  // MODIFIED
-                keys_in_batch++;                                                      // MODIFIED
-            }                                                                         // MODIFIED
-            
-            // MODIFIED: Send this batch
-            send_msg(process_id, p, msg_buf);                                        // MODIFIED
-            
-            if((i % 100000) == 0 || i == num_keys){                                  // MODIFIED
-                printf("Process %d sent %d/%d keys to process %d\n", process_id, i, num_keys, p);  // MODIFIED
-            }                                                                         // MODIFIED
-        }                                                                             // MODIFIED
-        
-        // MODIFIED: Send QF_UPDATE_DONE to signal completion to this peer
-        snprintf(msg_buf, BLOOM_MSG_SIZE, "QF_UPDATE_DONE:%d:%d", process_id, num_keys);  // MODIFIED: Include total count for verification
-        send_msg(process_id, p, msg_buf);                                            // MODIFIED
-        printf("Process %d finished sending %d keys to process %d\n", process_id, num_keys, p);  // MODIFIED
-    }                                                                                 // MODIFIED
-
-    free(msg_buf);                                                                    // MODIFIED
-    qf_broadcasted = 1;                                                               // MODIFIED
-    printf("Process %d completed broadcasting all keys\n", process_id);              // MODIFIED
-
-    // COMMENTED OUT: Old file-based broadcast code
-    // char filepath[256];
-    // snprintf(filepath, sizeof(filepath), "%s/qf_process_%d.dat", QF_FILE_DIR, process_id);
-    // uint64_t result = qf_serialize(&all_processes_qf, filepath);
-    // if(result < sizeof(qfmetadata) + all_processes_qf.metadata->total_size_in_bytes){
-    //     fprintf(stderr, "ERROR HAPPENED: process %d failed to export QF\n", process_id);
-    //     return;
-    // }
-    // FILE *fp = fopen(filepath, "rb");
-    // if(fp){
-    //     fseek(fp, 0, SEEK_END);
-    //     long size = ftell(fp);
-    //     fclose(fp);
-    //     printf("Process %d exported QF %ld bytes\n", process_id, size);
-    // }
-    // char msg[256];
-    // snprintf(msg, sizeof(msg), "QF_FILE:%d:%s", process_id, filepath);
-    // for (int p = 0; p < num_processes; p++){
-    //     if(p == process_id) continue;
-    //     send_msg(process_id, p, msg);
-    // }
-    // qf_broadcasted = 1;
-    // printf("Process %d QF location broadcasted\n", process_id);
-}
-
-// MODIFIED: New function to handle QF_UPDATE protocol messages
-void handle_qf_update(const char *msg){                                              // MODIFIED
-    // MODIFIED: Check for QF_UPDATE message: "QF_UPDATE:sender_id:key1,key2,..."
-    if(strncmp(msg, "QF_UPDATE:", 10) == 0){                                        // MODIFIED
-        // MODIFIED: Extract sender process_id
-        int sender_id = atoi(msg + 10);                                              // MODIFIED
-        const char *colon = strchr(msg + 10, ':');                                   // MODIFIED
-        if(colon == NULL){                                                            // MODIFIED
-            fprintf(stderr, "Process %d received malformed QF_UPDATE message\n", process_id);  // MODIFIED
-            return;                                                                   // MODIFIED
-        }                                                                             // MODIFIED
-        
-        // MODIFIED: Parse comma-separated keys and insert into our all_processes_qf
-        const char *keys_data = colon + 1;                                           // MODIFIED
-        char *copy = strdup(keys_data);                                              // MODIFIED
-        char *tok = strtok(copy, ",");                                               // MODIFIED
-        
-        int keys_inserted = 0;                                                        // MODIFIED
-        while(tok != NULL){                                                           // MODIFIED
-            int key = atoi(tok);                                                      // MODIFIED
-            uint64_t key_val = (uint64_t)key;                                        // MODIFIED
-            
-            // MODIFIED: Insert key with value = sender_id (the process that owns this key)
-            qf_insert(&all_processes_qf, key_val, sender_id, 1, QF_NO_LOCK);        // MODIFIED
-            keys_inserted++;                                                          // MODIFIED
-            
-            if(keys_inserted % 100000 == 0){                                          // MODIFIED
-                printf("Process %d inserted %d keys from process %d\n", process_id, keys_inserted, sender_id);  // MODIFIED
-            }                                                                         // MODIFIED
-            
-            tok = strtok(NULL, ",");                                                  // MODIFIED
-        }                                                                             // MODIFIED
-        
-        free(copy);                                                                   // MODIFIED
-        
-        if(keys_inserted > 0){                                                        // MODIFIED
-            printf("Process %d inserted batch of %d keys from process %d\n", process_id, keys_inserted, sender_id);  // MODIFIED
-        }                                                                             // MODIFIED
-        return;                                                                       // MODIFIED
-    }                                                                                 // MODIFIED
-    
-    // MODIFIED: Check for QF_UPDATE_DONE message: "QF_UPDATE_DONE:sender_id:total_count"
-    if(strncmp(msg, "QF_UPDATE_DONE:", 15) == 0){                                   // MODIFIED
-        int sender_id = atoi(msg + 15);                                              // MODIFIED
-        const char *colon = strchr(msg + 15, ':');                                   // MODIFIED
-        int expected_count = 0;                                                       // MODIFIED
-        if(colon != NULL){                                                            // MODIFIED
-            expected_count = atoi(colon + 1);                                        // MODIFIED
-        }                                                                             // MODIFIED
-        
-        peer_qf_received[sender_id] = 1;                                             // MODIFIED
-        printf("Process %d received all keys from process %d (expected: %d)\n", process_id, sender_id, expected_count);  // MODIFIED
-        return;                                                                       // MODIFIED
-    }                                                                                 // MODIFIED
-    
-    fprintf(stderr, "Process %d received unknown QF protocol message\n", process_id);  // MODIFIED
-}
-
-void handle_query_from_manager(const char *msg){
-    int key = atoi(msg + 6);
-
-
-    if(check_own_keys(key)){
-        printf("[QUERY LOOKUP] : Process %d found key %d locally\n", process_id, key);
-        
-        char response[BUF_SIZE];
-        snprintf(response, sizeof(response), "FOUND:%d:PROCESS_%d", key, process_id);
-        send_msg(process_id, num_processes, response);
-        return;
-    }
-
-    // MODIFIED: Convert to uint64_t for QF lookup
-    uint64_t key_val = (uint64_t)key;                                               // MODIFIED
-
-    int queries_sent = 0;
-    for (int p = 0; p < num_processes; p++){
-        if(p == process_id) continue;
-        // MODIFIED: Check single QF with specific peer's process_id value
-        if(peer_qf_received != NULL && peer_qf_received[p] &&                       // MODIFIED
-           qf_count_key_value(&all_processes_qf, key_val, p, 0) > 0){              // MODIFIED: Check for key with value=p (peer's process_id)
-            printf("[PROCESS %d detected that] key %d might be in process %d, querying it...\n", process_id, key, p);
-            char buf[BUF_SIZE];
-            snprintf(buf, sizeof(buf), "PQUERY:%d:FROM_%d", key, process_id);
-            send_msg(process_id, p, buf);
-            queries_sent++;
-        }
-    }
-
-    if(queries_sent == 0){
-        printf("Process %d could not find Key %d neither locally nor in QF\n", process_id, key);  // MODIFIED
-        char response[BUF_SIZE];
-        snprintf(response, sizeof(response), "NOTFOUND:%d:CHECKED_BY_PROCESS_%d", key, process_id);
-        send_msg(process_id, num_processes, response);
-    }
-    
-}
-
-
-void handle_query_from_process(const char *msg){
-    if(strncmp(msg, "PQUERY:", 7) != 0){
-        return;
-    }
-
-    int key = atoi(msg+7);
-
-    const char *from_marker = strstr(msg, ":FROM_");
-    int sender_process = -1;
-    if(from_marker != NULL){
-        sender_process = atoi(from_marker + 6);
-    }
-
-    printf("Process %d Received peer query for key %d from process %d\n", process_id, key, sender_process);
-
-    if(check_own_keys(key)){
-        printf("Process %d found key %d which is a peer query", process_id, key);
-
-        if(sender_process >= 0){
-            char response[BUF_SIZE];
-            snprintf(response, sizeof(response), "PFOUND:%d:IN_PROCESS_%d", key, process_id);
-            send_msg(process_id, sender_process, response);
-        }
-    } else{
-        printf("Process %d could not find key %d", process_id, key);
-
-        if(sender_process >= 0){
-            char response[BUF_SIZE];
-            snprintf(response, sizeof(response), "PNOTFOUND:%d:IN_PROCESS_%d", key, process_id);
-            send_msg(process_id, sender_process, response);
-        }
-    }
-}
-
-void handle_response_from_process(const char *msg){
-    if(strncmp(msg, "PFOUND:", 7) == 0){
-        int key = atoi(msg + 7);
-        const char *process_marker = strstr(msg, ":IN_PROCESS_");
-        int found_in_process = -1;
-        if(process_marker != NULL){
-            found_in_process = atoi(process_marker + 12);
-        }
-
-        printf("Process %d Confirmed the existence of Key %d in process %d\n", process_id, key, found_in_process);
-
-        char response[BUF_SIZE];
-        snprintf(response, sizeof(response), "FOUND:%d:PROCESS_%d", key, found_in_process);
-        send_msg(process_id, num_processes, response);
-    } else if (strncmp(msg, "PNOTFOUND:", 10) == 0){
-        int key = atoi(msg + 10);
-        const char *process_marker = strstr(msg, ":IN_PROCESS_");
-        int checked_process = -1;
-        if(process_marker != NULL){
-            checked_process = atoi(process_marker + 12);
-        }
-
-        printf("Process %d could not find key %d in process %d\n", process_id, key, checked_process);
-    }
-}
-
-
-int main(int argc, char *argv[]){
-    if(argc < 3){
-        fprintf(stderr, "Usage: %s <process_id> <num_processes> \n", argv[0]);
-        return 1;
-    }
-
-    process_id = atoi(argv[1]);
-    num_processes = atoi(argv[2]);
-
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-
-    comm_fd = initiate_communication(process_id);
-    printf("Process %d started, waiting for key assignment\n", process_id);
-
-    char *buf = malloc(BLOOM_MSG_SIZE);
-    if(buf == NULL){
-        fprintf(stderr, "Process %d failed to allocate receive buffer\n", process_id);
-        return 1;
-    }
-
-    while(1){
-
-        // MODIFIED: Renamed variables
-        if(qf_initialized && !qf_broadcasted){                                       // MODIFIED
-            broadcast_qf();                                                          // MODIFIED: Renamed function call
-        }
-        int messages_processed = 0;
-
-        while(1){
-            int n = receive_msg(comm_fd, buf, BLOOM_MSG_SIZE);
-            if(n <= 0) break;
-
-            messages_processed++;
-
-            // MODIFIED: Keep original KEYS: handling for manager's initial key assignment
-            if (strncmp(buf, "KEYS:", 5) == 0) {
-                assign_keys_from_message(buf);
-            } else if(strncmp(buf, "KEYS_DONE", 9) == 0){
-                finalize_keys();
-            } else if (strncmp(buf, "QUERY:", 6) == 0) {
-                handle_query_from_manager(buf);
-            } else if (strncmp(buf, "QF_UPDATE:", 10) == 0 || strncmp(buf, "QF_UPDATE_DONE:", 15) == 0) {  // MODIFIED: Handle new QF_UPDATE protocol
-                handle_qf_update(buf);                                               // MODIFIED
-            } else if (strncmp(buf, "PQUERY:", 7) == 0) {
-                handle_query_from_process(buf);
-            } else if (strncmp(buf, "PFOUND:", 7) == 0 || strncmp(buf, "PNOTFOUND:", 10) == 0) {
-                handle_response_from_process(buf);
-            } else {
-                fprintf(stderr, "[Process %d] Unknown message: %s\n", process_id, buf);
-            }
-        }
-        if (messages_processed == 0) {
-            usleep(1000);
-        }
-    }
-    free(buf);
-    signal_handler(0);
-    
-    return 0;
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "IPC.h"
+// MODIFIED: Changed from bloom.h to gqf headers
+#include "gqf.h"           // MODIFIED
+#include "gqf_file.h"      // MODIFIED
+#include "key_codec.h"
+#include "keyhash.h"
+#include "maplet_lookup.h"
+#include "arena.h"
+#include "config.h"
+#include <search.h>
+#include <time.h>
+#include <stdint.h>
+
+
+#define BUF_SIZE 256          
+#define KEY_STR_SIZE 12                //"-2147483648" and its terminator
+#define QF_KEYS_HEADER_SIZE (8 + 2 * sizeof(int32_t))  //"QF_KEYS:" + sender id + key count
+#define SHARED_QF 1                    //1: only QF_BUILDER builds the QF and every process maps the same file read only
+#define QF_BUILDER 0
+#define SHARED_QF_PATH "/dev/shm/maplet_all_processes.qf"
+#define SHARED_QF_SEQ_PATH "/dev/shm/maplet_all_processes.seq"
+// COMMENTED OUT: No longer need file directory for QF
+// #define QF_FILE_DIR "/tmp"    // MODIFIED: Renamed from BLOOM_FILE_DIR
+
+int process_id;
+int num_processes;
+int *keys = NULL;
+int num_keys = 0;
+int keys_capacity = 0;
+int keys_finalized = 0;
+
+//Keys, their hsearch strings and receive buffers live here, hdestroy does not free the strings
+Arena process_arena;
+ScratchPool decode_scratch;            //decoded QF_KEYS blocks, one datagram worth of keys each
+int use_hugepages = 0;
+
+// MODIFIED: Single QF for all processes instead of own_bloom and peer_bloom_filters array
+QF all_processes_qf;                   // MODIFIED: Single QF containing keys from all processes with value=process_id
+int qf_initialized = 0;                // MODIFIED: Renamed from bloom_initialized
+int *peer_qf_received = NULL;          // MODIFIED: Renamed from peer_bloom_received - tracks which peers' keys we've received
+int qf_broadcasted = 0;                // MODIFIED: Renamed from bloom_broadcasted - tracks if we've sent our keys
+ProcessSet key_owners;                 //owners of the key being routed, one bit per process
+
+//Key hashes of one owner, kept until every owner is complete and the QF is built in one pass
+typedef struct{
+    uint64_t *hashes;
+    int count;
+    int capacity;
+    int sealed;
+} StagedKeys;
+
+StagedKeys *staged_keys = NULL;        //indexed by owner process id, NULL once the QF is built
+int qf_mapped = 0;                     //all_processes_qf is the shared file, not our own copy
+uint64_t *qf_seq = NULL;               //shared with the builder, odd while it changes the mapped QF
+
+struct timespec build_start;           //KEYS_DONE arrived
+double build_ms = -1;                  //until the QF can route, -1 while still building
+unsigned long routed_queries = 0;      //benchmark counters
+unsigned long routing_probes = 0;
+
+int comm_fd = -1;
+
+
+void signal_handler(int signum);
+int check_own_keys(int key);
+void assign_keys_from_message(const char *msg);
+void announce_keys(const char *msg);
+void create_own_qf();                  // MODIFIED: Renamed from create_own_bloom_filter
+void build_qf();
+void publish_shared_qf();
+void map_shared_qf(const char *msg);
+void broadcast_qf();                   // MODIFIED: Renamed from broadcast_bloom_filter - now sends keys instead of files
+void handle_qf_update(const char *msg, int len);  // MODIFIED: New function to handle QF_KEYS/QF_UPDATE_DONE messages
+void handle_query_from_manager(const char *msg);
+void handle_query_from_process(const char *msg);
+void handle_update_from_manager(const char *msg, int put);
+void handle_qf_delta(const char *msg);
+
+
+static void routing_ready(){
+    if(build_ms >= 0) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    build_ms = (now.tv_sec - build_start.tv_sec) * 1000.0 + (now.tv_nsec - build_start.tv_nsec) / 1000000.0;
+    printf("[Process %d] Routing ready %.1f ms after KEYS_DONE\n", process_id, build_ms);
+}
+
+void signal_handler(int signum){
+    printf("\n[Process %d] Received signal %d, cleaning up... \n", process_id, signum);
+    printf("[BENCH] Process %d build_ms %.1f routed %lu probes %lu\n", process_id, build_ms, routed_queries, routing_probes);
+
+    // MODIFIED: Clean up single QF instead of own_bloom and peer_bloom_filters array
+    if(qf_initialized){                                    // MODIFIED
+        if(qf_mapped){
+            qf_closefile(&all_processes_qf);
+        } else {
+            qf_free(&all_processes_qf);                    // MODIFIED: Free single QF
+        }
+    }
+    if(qf_seq != NULL){
+        munmap(qf_seq, sizeof(uint64_t));
+    }
+    if(SHARED_QF && process_id == QF_BUILDER){
+        unlink(SHARED_QF_PATH);
+        unlink(SHARED_QF_SEQ_PATH);
+    }
+
+    if(peer_qf_received != NULL){                          // MODIFIED
+        free(peer_qf_received);                            // MODIFIED
+    }
+    if(staged_keys != NULL){
+        for(int p = 0; p < num_processes; p++){
+            free(staged_keys[p].hashes);
+        }
+        free(staged_keys);
+    }
+    hdestroy();
+    arena_release(&process_arena);
+    if(comm_fd >= 0){
+        close_communication(process_id, comm_fd);
+    }
+
+    // COMMENTED OUT: No longer using files
+    // char filepath[256];
+    // snprintf(filepath, sizeof(filepath), "%s/qf_process_%d.dat", QF_FILE_DIR, process_id);  // MODIFIED
+    // unlink(filepath);
+    exit(0);
+}
+
+
+int check_own_keys(int key){
+    if(!keys_finalized) return 0;
+    char key_str[32];
+    snprintf(key_str, sizeof(key_str), "%d", key);
+
+    ENTRY e, *ep;
+    e.key = key_str;
+    e.data = NULL;
+
+    ep = hsearch(e, FIND);
+    //hsearch cannot delete, a DELETE clears data instead
+    return (ep != NULL && ep->data != NULL);
+
+}
+
+//The old block stays in the arena, KEYS_EXPECTED normally makes this a single allocation
+static void grow_keys(int capacity){
+    int *bigger = arena_alloc(&process_arena, (size_t)capacity * sizeof(int));
+    if(bigger == NULL){
+        fprintf(stderr, "ERROR HAPPENED: process %d failed to allocate memory for keys \n", process_id);
+        exit(1);
+    }
+    if(num_keys > 0) memcpy(bigger, keys, (size_t)num_keys * sizeof(int));
+    keys = bigger;
+    keys_capacity = capacity;
+}
+
+//Format: "KEYS_EXPECTED:<count>", reserves the key array and the hsearch strings in one block
+void announce_keys(const char *msg){
+    long expected = strtol(msg + 14, NULL, 10);
+    if(expected <= 0 || expected <= keys_capacity) return;
+    arena_reserve(&process_arena, (size_t)expected * (sizeof(int) + KEY_STR_SIZE));
+    grow_keys((int)expected);
+    printf("Process %d expects %ld keys\n", process_id, expected);
+}
+
+void assign_keys_from_message(const char *msg){
+    const char *ptr = msg+5;
+
+    while(*ptr != '\0'){
+        char *end;
+        int key = (int)strtol(ptr, &end, 10);
+        if(end == ptr) break;
+        ptr = (*end == ',') ? end + 1 : end;
+
+        if(num_keys >= keys_capacity){
+            grow_keys(keys_capacity == 0 ? 100000 : keys_capacity * 2);
+        }
+        keys[num_keys++] = key;
+    }
+
+    if(num_keys % 100000 == 0){
+        printf("Process %d received %d keys so far\n", process_id, num_keys);
+    }
+}
+
+void finalize_keys(){
+    if(keys_finalized) return;
+    printf("Process %d finalizign %d keys\n", process_id, num_keys);
+    clock_gettime(CLOCK_MONOTONIC, &build_start);
+
+    time_t start = time(NULL);
+
+    if(hcreate(num_keys * 2) == 0){
+        fprintf(stderr, "[ERROR HAPPENED] Process %d failed to create hash table \n", process_id);
+        exit(1);
+    }
+
+    //All key strings are packed into one arena block, released with the arena at exit
+    char *key_strings = arena_alloc(&process_arena, (size_t)num_keys * KEY_STR_SIZE + 1);
+    if(key_strings == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] Process %d failed to allocate key strings \n", process_id);
+        exit(1);
+    }
+    for(int i = 0; i < num_keys; i++){
+        char *key_str = key_strings;
+        key_strings += snprintf(key_str, KEY_STR_SIZE, "%d", keys[i]) + 1;
+
+        ENTRY e;
+        e.key = key_str;
+        e.data = (void*)(long)1;
+        if(hsearch(e, ENTER) == NULL){
+            fprintf(stderr, "Process %d failed to insert key %d\n", process_id, keys[i]);
+        }
+
+        if((i+1) % 500000 == 0){
+            printf("Process %d indexed %d/%d keys (%.1f%%)\n", i+1, process_id, num_keys, (i+1) * 100.0/num_keys);
+        }
+    }
+
+    time_t end = time(NULL);
+    printf("Process %d hash table created in %ld seconds \n", process_id, end-start);
+    keys_finalized = 1;
+    create_own_qf();                                       // MODIFIED: Renamed function call
+}
+
+static int compare_hashes(const void *a, const void *b){
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void stage_keys(int owner, const uint32_t *owner_keys, int count){
+    StagedKeys *sk = &staged_keys[owner];
+    if(sk->count + count > sk->capacity){
+        int new_capacity = sk->capacity == 0 ? count : sk->capacity;
+        while(new_capacity < sk->count + count) new_capacity *= 2;
+        uint64_t *new_hashes = realloc(sk->hashes, new_capacity * sizeof(uint64_t));
+        if(new_hashes == NULL){
+            fprintf(stderr, "ERROR HAPPENED: process %d failed to stage keys of process %d\n", process_id, owner);
+            exit(1);
+        }
+        sk->hashes = new_hashes;
+        sk->capacity = new_capacity;
+    }
+    for(int i = 0; i < count; i++){
+        sk->hashes[sk->count++] = maplet_key_hash((int)owner_keys[i]);
+    }
+}
+
+//Sorted once per owner when its keys are complete, the build only has to merge the runs
+static void seal_staged_keys(int owner){
+    StagedKeys *sk = &staged_keys[owner];
+    qsort(sk->hashes, sk->count, sizeof(uint64_t), compare_hashes);
+    sk->sealed = 1;
+}
+
+// MODIFIED: Own keys are only staged here, the QF is built once every peer's keys are in
+void create_own_qf(){                                      // MODIFIED: Renamed from create_own_bloom_filter
+    if(staged_keys == NULL){
+        staged_keys = calloc(num_processes, sizeof(StagedKeys));
+    }
+    // MODIFIED: Initialize peer tracking array
+    if(peer_qf_received == NULL){                                                     // MODIFIED
+        peer_qf_received = calloc(num_processes, sizeof(int));                        // MODIFIED
+    }                                                                                  // MODIFIED
+    //Only the builder needs the keys in hash form, the others just ship them to it
+    if(SHARED_QF && process_id != QF_BUILDER) return;
+
+    uint32_t *own = malloc((num_keys > 0 ? num_keys : 1) * sizeof(uint32_t));
+    for(int i = 0; i < num_keys; i++){
+        own[i] = (uint32_t)keys[i];
+    }
+    stage_keys(process_id, own, num_keys);
+    free(own);
+    seal_staged_keys(process_id);
+    printf("Process %d staged %d own keys for the QF\n", process_id, num_keys);
+}
+
+// MODIFIED: Bulk build. The filter is sized for the announced total up front so it never resizes,
+//then the sorted runs of all owners are merged and inserted in ascending hash order. Each insert
+//lands at the end of the filled region, so nothing has to be shifted.
+void build_qf(){
+    if(qf_initialized) return;
+
+    time_t start = time(NULL);
+    uint64_t total = 0;
+    for(int p = 0; p < num_processes; p++){
+        total += staged_keys[p].count;
+    }
+
+    //Stay below 90% load with room for the keys PUT after the build, the shared QF is a mapped
+    //file and cannot grow. nslots has to be a power of two
+    uint64_t room = total + total / 8 + (config.num_updates > 0 ? (uint64_t)config.num_updates : 0);
+    uint64_t nslots = 64;
+    while(nslots * 9 / 10 < room){
+        nslots <<= 1;
+    }
+    printf("Process %d building QF for %lu keys in %lu slots\n", process_id, (unsigned long)total, (unsigned long)nslots);
+
+    if(!qf_malloc(&all_processes_qf, nslots, 64, maplet_value_bits(num_processes), QF_HASH_NONE, 0)){  //values are owner ids
+        fprintf(stderr, "ERROR: Process %d failed to allocate QF\n", process_id);     // MODIFIED
+        exit(1);                                                                       // MODIFIED
+    }                                                                                  // MODIFIED
+    //Only a safety net for a private QF, the setting does not survive qf_usefile
+    qf_set_auto_resize(&all_processes_qf, true);
+
+    //Binary min heap over the owners, ordered by (hash, owner) so equal hashes come out sorted by value
+    int *heap = malloc(num_processes * sizeof(int));
+    int *pos = calloc(num_processes, sizeof(int));
+    int heap_size = 0;
+    for(int p = 0; p < num_processes; p++){
+        if(staged_keys[p].count == 0) continue;
+        int child = heap_size++;
+        while(child > 0){
+            int parent = (child - 1) / 2;
+            if(staged_keys[heap[parent]].hashes[0] <= staged_keys[p].hashes[0]) break;
+            heap[child] = heap[parent];
+            child = parent;
+        }
+        heap[child] = p;
+    }
+
+    uint64_t inserted = 0;
+    while(heap_size > 0){
+        int p = heap[0];
+        StagedKeys *sk = &staged_keys[p];
+        qf_insert(&all_processes_qf, sk->hashes[pos[p]], p, 1, QF_NO_LOCK | QF_KEY_IS_HASH);
+        pos[p]++;
+        inserted++;
+
+        if(pos[p] == sk->count){
+            //The last owner ran out, there is nothing left to sift
+            if(--heap_size == 0) break;
+            p = heap[heap_size];
+        }
+        //Sift the owner at the top down to its new place
+        uint64_t h = staged_keys[p].hashes[pos[p]];
+        int i = 0;
+        while(heap_size > 0){
+            int child = 2 * i + 1;
+            if(child >= heap_size) break;
+            if(child + 1 < heap_size){
+                int r = heap[child + 1], l = heap[child];
+                uint64_t hr = staged_keys[r].hashes[pos[r]], hl = staged_keys[l].hashes[pos[l]];
+                if(hr < hl || (hr == hl && r < l)) child++;
+            }
+            int c = heap[child];
+            uint64_t hc = staged_keys[c].hashes[pos[c]];
+            if(hc > h || (hc == h && c > p)) break;
+            heap[i] = c;
+            i = child;
+        }
+        if(heap_size > 0) heap[i] = p;
+
+        if(inserted % 1000000 == 0){
+            printf("Process %d added %lu/%lu keys to QF (%.1f%%)\n", process_id, (unsigned long)inserted, (unsigned long)total, inserted * 100.0 / total);  // MODIFIED
+        }
+    }
+    free(heap);
+    free(pos);
+
+    for(int p = 0; p < num_processes; p++){
+        free(staged_keys[p].hashes);
+    }
+    free(staged_keys);
+    staged_keys = NULL;
+
+    time_t end = time(NULL);
+    qf_initialized = 1;                                                               // MODIFIED
+    if(!SHARED_QF) routing_ready();
+    printf("[Process %d] Created QF in %ld seconds\n", process_id, end-start);      // MODIFIED
+
+    // MODIFIED: Print QF stats
+    printf("[QF Stats] nslots: %lu, occupied: %lu, distinct elements: %lu\n",        // MODIFIED
+           qf_get_nslots(&all_processes_qf),                                         // MODIFIED
+           qf_get_num_occupied_slots(&all_processes_qf),                             // MODIFIED
+           qf_get_num_distinct_key_value_pairs(&all_processes_qf));                 // MODIFIED
+}
+
+//Builder only. Writes the finished QF next to the other shared memory files and swaps our private
+//copy for a read only mapping of it, so all processes on the box share one set of pages.
+void publish_shared_qf(){
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", SHARED_QF_PATH);
+
+    uint64_t result = qf_serialize(&all_processes_qf, tmp_path);
+    if(result < sizeof(qfmetadata) + all_processes_qf.metadata->total_size_in_bytes){
+        fprintf(stderr, "ERROR HAPPENED: process %d failed to export QF\n", process_id);
+        unlink(tmp_path);
+        return;
+    }
+    //Readers never see a half written file
+    if(rename(tmp_path, SHARED_QF_PATH) != 0){
+        perror("ERROR HAPPENED: publishing the shared QF failed");
+        unlink(tmp_path);
+        return;
+    }
+    printf("Process %d exported QF %lu bytes to %s\n", process_id, (unsigned long)result, SHARED_QF_PATH);
+
+    qf_free(&all_processes_qf);
+    qf_initialized = 0;
+    char msg[BUF_SIZE];
+    snprintf(msg, sizeof(msg), "QF_SHARED:%s", SHARED_QF_PATH);
+    map_shared_qf(msg);
+
+    for (int p = 0; p < num_processes; p++){
+        if(p == process_id) continue;
+        send_msg(process_id, p, msg);
+    }
+    printf("Process %d QF location broadcasted\n", process_id);
+}
+
+//The builder changes the shared QF in place while every process walks it. A sequence number next
+//to the file tells readers that a walk overlapped a change and has to be repeated.
+static int map_qf_seq(){
+    int writable = process_id == QF_BUILDER;
+    int fd = open(SHARED_QF_SEQ_PATH, writable ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+    if(fd < 0 || (writable && ftruncate(fd, sizeof(uint64_t)) != 0)){
+        fprintf(stderr, "ERROR HAPPENED: process %d failed to open %s\n", process_id, SHARED_QF_SEQ_PATH);
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    void *seq = mmap(NULL, sizeof(uint64_t), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(seq == MAP_FAILED){
+        fprintf(stderr, "ERROR HAPPENED: process %d failed to map %s\n", process_id, SHARED_QF_SEQ_PATH);
+        return -1;
+    }
+    qf_seq = seq;
+    return 0;
+}
+
+static void qf_write_begin(){
+    if(qf_seq == NULL) return;
+    __atomic_store_n(qf_seq, *qf_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void qf_write_end(){
+    if(qf_seq == NULL) return;
+    __atomic_store_n(qf_seq, *qf_seq + 1, __ATOMIC_RELEASE);
+}
+
+//Fills key_owners, walks the run again if the builder changed the QF meanwhile
+static void lookup_owners(uint64_t hash){
+    for(;;){
+        uint64_t seq = qf_seq != NULL ? __atomic_load_n(qf_seq, __ATOMIC_ACQUIRE) : 0;
+        if(seq & 1) continue;
+        process_set_clear(&key_owners);
+        maplet_owners(&all_processes_qf, hash, &key_owners);
+        routing_probes++;
+        if(qf_seq == NULL) return;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(qf_seq, __ATOMIC_RELAXED) == seq) return;
+    }
+}
+
+//"QF_SHARED:path", the QF holds every owner's keys so all peers become routable at once
+void map_shared_qf(const char *msg){
+    const char *path = msg + 10;
+    if(qf_initialized) return;
+    if(qf_seq == NULL && map_qf_seq() != 0) return;
+
+    //The builder keeps write access to apply QF_DELTA updates, everyone sees them through the shared pages
+    int mode = process_id == QF_BUILDER ? QF_USEFILE_READ_WRITE : QF_USEFILE_READ_ONLY;
+    if(qf_usefile(&all_processes_qf, path, mode) == 0){
+        fprintf(stderr, "ERROR HAPPENED: process %d failed to map shared QF %s\n", process_id, path);
+        return;
+    }
+    if(peer_qf_received == NULL){
+        peer_qf_received = calloc(num_processes, sizeof(int));
+    }
+    for(int p = 0; p < num_processes; p++){
+        peer_qf_received[p] = 1;
+    }
+    qf_mapped = 1;
+    qf_initialized = 1;
+    routing_ready();
+    printf("Process %d mapped shared QF %s (%lu distinct elements)\n", process_id, path,
+           qf_get_num_distinct_key_value_pairs(&all_processes_qf));
+}
+
+// MODIFIED: Keys go out as binary QF_KEYS datagrams instead of comma separated QF_UPDATE text.
+//Layout: "QF_KEYS:" | int32 sender_id | int32 key count | key_codec block (sorted, delta+varint).
+//The blocks are encoded once and the same datagrams are sent to every peer.
+void broadcast_qf(){                                                                  // MODIFIED: Renamed from broadcast_bloom_filter
+    if(qf_broadcasted) return;                                                        // MODIFIED
+    printf("PROCESS %d broadcasting keys to all processes\n", process_id);           // MODIFIED
+
+    uint32_t *sorted = malloc((num_keys > 0 ? num_keys : 1) * sizeof(uint32_t));
+    //Every datagram holds at least one key, so num_keys blocks is the worst case
+    size_t max_msgs = num_keys > 0 ? num_keys : 1;
+    size_t *msg_offsets = malloc((max_msgs + 1) * sizeof(size_t));
+    uint8_t *msgs = malloc(num_keys * (size_t)KEY_CODEC_MAX_VARINT + max_msgs * QF_KEYS_HEADER_SIZE + 1);
+    if(sorted == NULL || msg_offsets == NULL || msgs == NULL){
+        fprintf(stderr, "Process %d failed to allocate key broadcast buffers\n", process_id);
+        free(sorted);
+        free(msg_offsets);
+        free(msgs);
+        return;
+    }
+    for(int i = 0; i < num_keys; i++){
+        sorted[i] = (uint32_t)keys[i];
+    }
+    key_codec_sort(sorted, num_keys);
+
+    time_t start = time(NULL);
+    size_t total = 0;
+    int num_msgs = 0;
+    for(int i = 0; i < num_keys; ){
+        uint8_t *msg = msgs + total;
+        size_t block_len;
+        int taken = key_codec_encode(sorted + i, num_keys - i, msg + QF_KEYS_HEADER_SIZE,
+                                     MAX_DATAGRAM_SIZE - QF_KEYS_HEADER_SIZE, &block_len);
+        int32_t header[2] = {process_id, taken};
+        memcpy(msg, "QF_KEYS:", 8);
+        memcpy(msg + 8, header, sizeof(header));
+
+        msg_offsets[num_msgs++] = total;
+        total += QF_KEYS_HEADER_SIZE + block_len;
+        i += taken;
+    }
+    msg_offsets[num_msgs] = total;
+    printf("Process %d encoded %d keys into %d messages, %zu bytes\n", process_id, num_keys, num_msgs, total);
+
+    char done_msg[BUF_SIZE];
+    snprintf(done_msg, sizeof(done_msg), "QF_UPDATE_DONE:%d:%d", process_id, num_keys);  // MODIFIED: Include total count for verification
+    for (int p = 0; p < num_processes; p++){                                         // MODIFIED
+        if(p == process_id) continue;                                                 // MODIFIED
+        if(SHARED_QF && p != QF_BUILDER) continue;
+        for(int m = 0; m < num_msgs; m++){
+            send_bytes(process_id, p, msgs + msg_offsets[m], msg_offsets[m + 1] - msg_offsets[m]);
+        }
+        send_msg(process_id, p, done_msg);
+        printf("Process %d finished sending %d keys to process %d\n", process_id, num_keys, p);  // MODIFIED
+    }                                                                                 // MODIFIED
+
+    free(sorted);
+    free(msg_offsets);
+    free(msgs);
+    qf_broadcasted = 1;                                                               // MODIFIED
+    printf("Process %d completed broadcasting all keys in %ld seconds\n", process_id, time(NULL) - start);
+}
+
+// MODIFIED: Handles the binary QF_KEYS blocks and the QF_UPDATE_DONE marker
+void handle_qf_update(const char *msg, int len){                                     // MODIFIED
+    if(len >= (int)QF_KEYS_HEADER_SIZE && memcmp(msg, "QF_KEYS:", 8) == 0){
+        int32_t header[2];
+        memcpy(header, msg + 8, sizeof(header));
+        int sender_id = header[0];
+        int expected = header[1];
+        if(sender_id < 0 || sender_id >= num_processes || expected <= 0){
+            fprintf(stderr, "Process %d received malformed QF_KEYS message\n", process_id);
+            return;
+        }
+
+        //Every key takes at least one byte of the datagram
+        uint32_t *decoded = expected <= MAX_DATAGRAM_SIZE ? scratch_get(&decode_scratch) : NULL;
+        if(decoded == NULL){
+            fprintf(stderr, "Process %d failed to allocate %d keys from process %d\n", process_id, expected, sender_id);
+            return;
+        }
+        int count = key_codec_decode((const uint8_t*)msg + QF_KEYS_HEADER_SIZE, len - QF_KEYS_HEADER_SIZE, decoded, expected);
+        if(count != expected){
+            fprintf(stderr, "Process %d received corrupt QF_KEYS block from process %d (%d of %d keys)\n", process_id, sender_id, count, expected);
+            scratch_put(&decode_scratch, decoded);
+            return;
+        }
+
+        // MODIFIED: Keys are staged with owner = sender_id, a block after the build goes straight in
+        if(qf_mapped){
+            fprintf(stderr, "Process %d dropped %d late keys from process %d, the shared QF is read only\n", process_id, count, sender_id);
+        } else if(qf_initialized){
+            int failed = 0;
+            for(int i = 0; i < count; i++){
+                failed += qf_insert(&all_processes_qf, maplet_key_hash((int)decoded[i]), sender_id, 1, QF_NO_LOCK | QF_KEY_IS_HASH) < 0;
+            }
+            if(failed > 0){
+                fprintf(stderr, "ERROR HAPPENED: process %d had no room in the QF for %d late keys of process %d\n", process_id, failed, sender_id);
+            }
+        } else {
+            if(staged_keys == NULL){
+                staged_keys = calloc(num_processes, sizeof(StagedKeys));
+            }
+            stage_keys(sender_id, decoded, count);
+        }
+        scratch_put(&decode_scratch, decoded);
+        printf("Process %d received batch of %d keys from process %d\n", process_id, count, sender_id);
+        return;
+    }
+
+    // MODIFIED: Check for QF_UPDATE_DONE message: "QF_UPDATE_DONE:sender_id:total_count"
+    if(strncmp(msg, "QF_UPDATE_DONE:", 15) == 0){                                   // MODIFIED
+        int sender_id = atoi(msg + 15);                                              // MODIFIED
+        const char *colon = strchr(msg + 15, ':');                                   // MODIFIED
+        int expected_count = 0;                                                       // MODIFIED
+        if(colon != NULL){                                                            // MODIFIED
+            expected_count = atoi(colon + 1);                                        // MODIFIED
+        }                                                                             // MODIFIED
+
+        if(peer_qf_received == NULL){
+            peer_qf_received = calloc(num_processes, sizeof(int));
+        }
+        if(sender_id < 0 || sender_id >= num_processes || peer_qf_received[sender_id]) return;
+        if(staged_keys == NULL){
+            staged_keys = calloc(num_processes, sizeof(StagedKeys));
+        }
+        if(!qf_initialized){
+            if(staged_keys[sender_id].count != expected_count){
+                fprintf(stderr, "Process %d got %d of %d keys from process %d\n", process_id, staged_keys[sender_id].count, expected_count, sender_id);
+            }
+            seal_staged_keys(sender_id);
+        }
+        peer_qf_received[sender_id] = 1;                                             // MODIFIED
+        printf("Process %d received all keys from process %d (expected: %d)\n", process_id, sender_id, expected_count);  // MODIFIED
+        return;                                                                       // MODIFIED
+    }                                                                                 // MODIFIED
+
+    fprintf(stderr, "Process %d received unknown QF protocol message\n", process_id);  // MODIFIED
+}
+
+static void route_query(int key){
+    if(check_own_keys(key)){
+        printf("[QUERY LOOKUP] : Process %d found key %d locally\n", process_id, key);
+        
+        char response[BUF_SIZE];
+        snprintf(response, sizeof(response), "FOUND:%d:PROCESS_%d", key, process_id);
+        send_msg(process_id, num_processes, response);
+        return;
+    }
+
+    // MODIFIED: One walk of the key's run gives every owner, instead of one probe per peer
+    process_set_clear(&key_owners);
+    if(qf_initialized){
+        lookup_owners(maplet_key_hash(key));
+    }
+    routed_queries++;
+
+    int queries_sent = 0;
+    for (int p = process_set_next(&key_owners, 0); p >= 0; p = process_set_next(&key_owners, p + 1)){
+        if(p == process_id || !peer_qf_received[p]) continue;
+        printf("[PROCESS %d detected that] key %d might be in process %d, querying it...\n", process_id, key, p);
+        char buf[BUF_SIZE];
+        snprintf(buf, sizeof(buf), "PQUERY:%d:FROM_%d", key, process_id);
+        send_msg(process_id, p, buf);
+        queries_sent++;
+    }
+
+    if(queries_sent == 0){
+        printf("Process %d could not find Key %d neither locally nor in QF\n", process_id, key);  // MODIFIED
+        char response[BUF_SIZE];
+        snprintf(response, sizeof(response), "NOTFOUND:%d:CHECKED_BY_PROCESS_%d", key, process_id);
+        send_msg(process_id, num_processes, response);
+    }
+}
+
+//The manager sends "QUERY:k1,k2,..."
+void handle_query_from_manager(const char *msg){
+    const char *ptr = msg + 6;
+    while(*ptr != '\0'){
+        route_query(atoi(ptr));
+        const char *next = strchr(ptr, ',');
+        if(next == NULL) break;
+        ptr = next + 1;
+    }
+}
+
+
+//Adds or removes one (key, owner) pair, returns -1 if the QF had no room for it. Updates before
+//the build are rejected, the manager only sends PUT/DELETE after the initial load.
+static int apply_qf_change(int key, int owner, int add){
+    if(!qf_initialized){
+        fprintf(stderr, "Process %d got a QF update for key %d before the QF was built\n", process_id, key);
+        return -1;
+    }
+    int result = 0;
+    qf_write_begin();
+    if(add){
+        result = qf_insert(&all_processes_qf, maplet_key_hash(key), owner, 1, QF_NO_LOCK | QF_KEY_IS_HASH) < 0 ? -1 : 0;
+    } else {
+        qf_delete_key_value(&all_processes_qf, maplet_key_hash(key), owner, QF_NO_LOCK | QF_KEY_IS_HASH);
+    }
+    qf_write_end();
+    if(result < 0){
+        fprintf(stderr, "ERROR HAPPENED: process %d has no room in the QF for key %d of process %d\n", process_id, key, owner);
+    }
+    return result;
+}
+
+//QF_DELTA goes to whoever holds a copy of the QF: every peer, or only the builder when the QF is shared
+static void send_qf_delta(const char *delta){
+    for(int p = 0; p < num_processes; p++){
+        if(p == process_id) continue;
+        if(SHARED_QF && p != QF_BUILDER) continue;
+        send_msg(process_id, p, delta);
+    }
+}
+
+//"PUT:k1,k2,..." / "DELETE:k1,k2,...". Only keys that really changed go into the QF_DELTA, which is
+//sent whenever the next key might not fit a datagram. Whoever changes the QF for a key acks it, so a
+//PUT the QF has no room for is reported as FAILED: we do, or the builder when the QF is shared.
+void handle_update_from_manager(const char *msg, int put){
+    char delta[MAX_DATAGRAM_SIZE];
+    int header_len = snprintf(delta, sizeof(delta), "QF_DELTA:FROM_%d:", process_id);
+    int delta_len = header_len;
+    int qf_here = !SHARED_QF || process_id == QF_BUILDER;
+
+    const char *ptr = strchr(msg, ':') + 1;
+    while(*ptr != '\0'){
+        char *end;
+        int key = (int)strtol(ptr, &end, 10);
+        if(end == ptr) break;
+        ptr = (*end == ',') ? end + 1 : end;
+
+        int present = check_own_keys(key);
+        int failed = 0;
+        char key_str[32];
+        snprintf(key_str, sizeof(key_str), "%d", key);
+        ENTRY e, *ep;
+        e.key = key_str;
+        e.data = NULL;
+        ep = hsearch(e, FIND);
+        if(put && !present){
+            if(ep == NULL){
+                e.key = arena_alloc(&process_arena, strlen(key_str) + 1);
+                if(e.key != NULL){
+                    strcpy(e.key, key_str);
+                    ep = hsearch(e, ENTER);
+                }
+            }
+            if(ep != NULL){
+                ep->data = (void*)(long)1;
+            } else {
+                fprintf(stderr, "Process %d failed to insert key %d, hash table is full\n", process_id, key);
+                failed = 1;
+            }
+        } else if(!put && present){
+            ep->data = NULL;
+        }
+
+        if(put != present && !failed){
+            if(qf_here && apply_qf_change(key, process_id, put) != 0){
+                if(put) ep->data = NULL;
+                failed = 1;
+            } else {
+                if(delta_len + KEY_STR_SIZE + 2 > (int)sizeof(delta)){
+                    send_qf_delta(delta);
+                    delta_len = header_len;
+                }
+                delta_len += snprintf(delta + delta_len, sizeof(delta) - delta_len, "%s%c%d",
+                                      delta_len > header_len ? "," : "", put ? '+' : '-', key);
+                //The builder acks it once the shared QF has it
+                if(!qf_here) continue;
+            }
+        }
+
+        char response[BUF_SIZE];
+        snprintf(response, sizeof(response), "UPDATED:%d:%s:PROCESS_%d", key,
+                 failed ? "FAILED" : (put ? "PUT" : (present ? "DELETE" : "MISSING")), process_id);
+        send_msg(process_id, num_processes, response);
+    }
+
+    if(delta_len > header_len) send_qf_delta(delta);
+}
+
+//"QF_DELTA:FROM_<owner>:+key,-key,...". The owner leaves the acks of a shared QF's changes to the builder.
+void handle_qf_delta(const char *msg){
+    int owner = atoi(msg + 14);
+    const char *ptr = strchr(msg + 14, ':');
+    if(owner < 0 || owner >= num_processes || ptr == NULL) return;
+
+    ptr++;
+    while(*ptr == '+' || *ptr == '-'){
+        int add = *ptr == '+';
+        char *end;
+        int key = (int)strtol(ptr + 1, &end, 10);
+        if(end == ptr + 1) break;
+        int failed = apply_qf_change(key, owner, add) != 0;
+        if(SHARED_QF){
+            char response[BUF_SIZE];
+            snprintf(response, sizeof(response), "UPDATED:%d:%s:PROCESS_%d", key, failed ? "FAILED" : (add ? "PUT" : "DELETE"), owner);
+            send_msg(process_id, num_processes, response);
+        }
+        ptr = (*end == ',') ? end + 1 : end;
+    }
+}
+
+void handle_query_from_process(const char *msg){
+    if(strncmp(msg, "PQUERY:", 7) != 0){
+        return;
+    }
+
+    int key = atoi(msg+7);
+
+    const char *from_marker = strstr(msg, ":FROM_");
+    int sender_process = -1;
+    if(from_marker != NULL){
+        sender_process = atoi(from_marker + 6);
+    }
+
+    printf("Process %d Received peer query for key %d from process %d\n", process_id, key, sender_process);
+
+    if(check_own_keys(key)){
+        printf("Process %d found key %d which is a peer query", process_id, key);
+
+        if(sender_process >= 0){
+            char response[BUF_SIZE];
+            snprintf(response, sizeof(response), "PFOUND:%d:IN_PROCESS_%d", key, process_id);
+            send_msg(process_id, sender_process, response);
+        }
+    } else{
+        printf("Process %d could not find key %d", process_id, key);
+
+        if(sender_process >= 0){
+            char response[BUF_SIZE];
+            snprintf(response, sizeof(response), "PNOTFOUND:%d:IN_PROCESS_%d", key, process_id);
+            send_msg(process_id, sender_process, response);
+        }
+    }
+}
+
+void handle_response_from_process(const char *msg){
+    if(strncmp(msg, "PFOUND:", 7) == 0){
+        int key = atoi(msg + 7);
+        const char *process_marker = strstr(msg, ":IN_PROCESS_");
+        int found_in_process = -1;
+        if(process_marker != NULL){
+            found_in_process = atoi(process_marker + 12);
+        }
+
+        printf("Process %d Confirmed the existence of Key %d in process %d\n", process_id, key, found_in_process);
+
+        char response[BUF_SIZE];
+        snprintf(response, sizeof(response), "FOUND:%d:PROCESS_%d", key, found_in_process);
+        send_msg(process_id, num_processes, response);
+    } else if (strncmp(msg, "PNOTFOUND:", 10) == 0){
+        int key = atoi(msg + 10);
+        const char *process_marker = strstr(msg, ":IN_PROCESS_");
+        int checked_process = -1;
+        if(process_marker != NULL){
+            checked_process = atoi(process_marker + 12);
+        }
+
+        printf("Process %d could not find key %d in process %d\n", process_id, key, checked_process);
+    }
+}
+
+
+int main(int argc, char *argv[]){
+    if(argc < 2){
+        fprintf(stderr, "Usage: %s <process_id> [--name=value ...] (./manager --help lists the parameters)\n", argv[0]);
+        return 1;
+    }
+
+    process_id = atoi(argv[1]);
+    //Same arguments as ./process, snapshots and rejoining are not supported by this engine
+    for(int i = 2; i < argc; i++){
+        if(strncmp(argv[i], "--snapshot_tag=", 15) == 0 || strncmp(argv[i], "--rejoin=", 9) == 0) continue;
+        if(config_apply_arg(argv[i]) != 1){
+            fprintf(stderr, "[ERROR HAPPENED] : Process %d does not understand %s\n", process_id, argv[i]);
+            return 1;
+        }
+    }
+    num_processes = config.num_processes;
+    use_hugepages = config.hugepages;
+    arena_init(&process_arena, ARENA_DEFAULT_BLOCK, use_hugepages);
+    scratch_pool_init(&decode_scratch, &process_arena, MAX_DATAGRAM_SIZE * sizeof(uint32_t));
+    uint64_t *owner_words = arena_alloc(&process_arena, PROCESS_SET_WORDS(num_processes) * sizeof(uint64_t));
+    if(owner_words == NULL){
+        fprintf(stderr, "Process %d failed to allocate owner set\n", process_id);
+        return 1;
+    }
+    process_set_init(&key_owners, owner_words, num_processes);
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    if(config.address_map[0] != '\0' && ipc_use_address_map(config.address_map) != 0){
+        return 1;
+    }
+    if(config.io_uring){
+        ipc_use_io_uring();
+    }
+    ipc_set_receive_buffer(config.socket_rcvbuf);
+    ipc_reserve_endpoints(num_processes + 1); //the manager is endpoint num_processes
+    comm_fd = initiate_communication(process_id);
+    printf("Process %d started, waiting for key assignment\n", process_id);
+
+    char *buf = arena_alloc(&process_arena, config.bloom_msg_size);
+    if(buf == NULL){
+        fprintf(stderr, "Process %d failed to allocate receive buffer\n", process_id);
+        return 1;
+    }
+
+    while(1){
+
+        // MODIFIED: Renamed variables
+        if(keys_finalized && !qf_broadcasted){                                       // MODIFIED
+            broadcast_qf();                                                          // MODIFIED: Renamed function call
+        }
+        if(!qf_initialized && staged_keys != NULL && staged_keys[process_id].sealed){
+            int complete = 1;
+            for(int p = 0; p < num_processes; p++){
+                if(p != process_id && !peer_qf_received[p]) complete = 0;
+            }
+            if(complete){
+                build_qf();
+                if(SHARED_QF) publish_shared_qf();
+            }
+        }
+        int messages_processed = 0;
+
+        while(1){
+            int n = receive_msg(comm_fd, buf, config.bloom_msg_size);
+            if(n <= 0) break;
+
+            messages_processed++;
+
+            // MODIFIED: Keep original KEYS: handling for manager's initial key assignment
+            if (strncmp(buf, "KEYS:", 5) == 0) {
+                assign_keys_from_message(buf);
+            } else if(strncmp(buf, "KEYS_EXPECTED:", 14) == 0){
+                announce_keys(buf);
+            } else if(strncmp(buf, "KEYS_DONE", 9) == 0){
+                finalize_keys();
+            } else if (strncmp(buf, "PUT:", 4) == 0) {
+                handle_update_from_manager(buf, 1);
+            } else if (strncmp(buf, "DELETE:", 7) == 0) {
+                handle_update_from_manager(buf, 0);
+            } else if (strncmp(buf, "QF_DELTA:", 9) == 0) {
+                handle_qf_delta(buf);
+            } else if (strncmp(buf, "QUERY:", 6) == 0) {
+                handle_query_from_manager(buf);
+            } else if (strncmp(buf, "QF_SHARED:", 10) == 0) {
+                map_shared_qf(buf);
+            } else if (strncmp(buf, "QF_KEYS:", 8) == 0 || strncmp(buf, "QF_UPDATE_DONE:", 15) == 0) {  // MODIFIED: Handle binary key blocks
+                handle_qf_update(buf, n);                                            // MODIFIED
+            } else if (strncmp(buf, "PQUERY:", 7) == 0) {
+                handle_query_from_process(buf);
+            } else if (strncmp(buf, "PFOUND:", 7) == 0 || strncmp(buf, "PNOTFOUND:", 10) == 0) {
+                handle_response_from_process(buf);
+            } else if (strncmp(buf, "PING:", 5) == 0) {
+                //Only the heartbeat, the merged maplet has no way to mask or re-admit a peer
+                char pong[64];
+                snprintf(pong, sizeof(pong), "PONG:%d:%s", process_id, buf + 5);
+                send_msg(process_id, num_processes, pong);
+            } else if (strncmp(buf, "PEER_DOWN:", 10) == 0 || strncmp(buf, "PEER_UP:", 8) == 0) {
+            } else {
+                fprintf(stderr, "[Process %d] Unknown message: %s\n", process_id, buf);
+            }
+        }
+        if (messages_processed == 0) {
+            usleep(1000);
+        }
+    }
+    signal_handler(0);
+    
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include "affinity.h"
+
+#define NODE_DIR "/sys/devices/system/node"
+#define MAX_NODES 64
+
+//Same values as numaif.h, we call mbind directly so nothing has to link libnuma
+#define PLACEMENT_MPOL_PREFERRED 1
+#define PLACEMENT_MPOL_INTERLEAVE 3
+#define PLACEMENT_MPOL_MF_MOVE (1 << 1)
+
+static int cpu_order[CPU_SETSIZE];   //allowed cpus, node by node
+static int cpu_node[CPU_SETSIZE];    //node of every cpu id, 0 when unknown
+static int num_cpus = 0;
+static int reserved_cpus = 0;        //slots taken by the manager, children skip them
+static unsigned long memory_nodes = 0;
+
+//Parses the kernel list format "0-3,8,10-11" into the numbers it contains
+static int parse_list_file(const char *path, int *out, int max){
+    FILE *f = fopen(path, "r");
+    if(f == NULL) return -1;
+
+    char line[4096];
+    int count = 0;
+    if(fgets(line, sizeof(line), f) != NULL){
+        char *tok = strtok(line, ",\n");
+        while(tok != NULL){
+            int lo, hi;
+            if(sscanf(tok, "%d-%d", &lo, &hi) != 2){
+                lo = hi = atoi(tok);
+            }
+            for(int v = lo; v <= hi && count < max; v++){
+                out[count++] = v;
+            }
+            tok = strtok(NULL, ",\n");
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+int placement_init(){
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0){
+        perror("[ERROR HAPPENED] : placement could not read the cpu affinity");
+        return 0;
+    }
+
+    num_cpus = 0;
+    memory_nodes = 0;
+    int list[CPU_SETSIZE];
+    for(int node = 0; node < MAX_NODES; node++){
+        char path[128];
+        snprintf(path, sizeof(path), "%s/node%d/cpulist", NODE_DIR, node);
+        int n = parse_list_file(path, list, CPU_SETSIZE);
+        if(n < 0) continue;
+        for(int i = 0; i < n; i++){
+            if(list[i] < 0 || list[i] >= CPU_SETSIZE) continue;
+            cpu_node[list[i]] = node;
+            if(CPU_ISSET(list[i], &allowed)){
+                cpu_order[num_cpus++] = list[i];
+                CPU_CLR(list[i], &allowed);
+            }
+        }
+    }
+    //No sysfs node info (or cpus missing from it), keep them in plain order on node 0
+    for(int c = 0; c < CPU_SETSIZE; c++){
+        if(CPU_ISSET(c, &allowed)) cpu_order[num_cpus++] = c;
+    }
+
+    int nodes[MAX_NODES];
+    int n = parse_list_file(NODE_DIR "/has_memory", nodes, MAX_NODES);
+    for(int i = 0; i < n; i++){
+        if(nodes[i] >= 0 && nodes[i] < MAX_NODES) memory_nodes |= 1UL << nodes[i];
+    }
+    if(memory_nodes == 0) memory_nodes = 1;
+
+    printf("[Placement] %d cpus available, memory nodes mask 0x%lx\n", num_cpus, memory_nodes);
+    return num_cpus;
+}
+
+int placement_num_cpus(){
+    return num_cpus;
+}
+
+static int pin_to_slots(int first_slot, int num_slots){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int usable = num_cpus - reserved_cpus;
+    for(int s = 0; s < num_slots; s++){
+        CPU_SET(cpu_order[reserved_cpus + (first_slot + s) % usable], &set);
+    }
+    if(sched_setaffinity(0, sizeof(set), &set) != 0){
+        perror("[ERROR HAPPENED] : placement could not set the cpu affinity");
+        return -1;
+    }
+    return 0;
+}
+
+//The manager gets the first cpu for itself, unless that would leave nothing for the processes
+int placement_pin_manager(){
+    if(num_cpus < 2) return -1;
+    reserved_cpus = 0;
+    if(pin_to_slots(0, 1) != 0) return -1;
+    reserved_cpus = 1;
+    printf("[Placement] Manager pinned to cpu %d\n", cpu_order[0]);
+    return 0;
+}
+
+//Called in the child between fork and execl, the mask survives the exec.
+//Consecutive ids get consecutive cpus so a process and its workers stay on one node.
+int placement_pin_process(int process_id, int cpus_per_process){
+    if(num_cpus - reserved_cpus < 1) return -1;
+    if(cpus_per_process < 1) cpus_per_process = 1;
+    if(cpus_per_process > num_cpus - reserved_cpus) cpus_per_process = num_cpus - reserved_cpus;
+    return pin_to_slots(process_id * cpus_per_process, cpus_per_process);
+}
+
+int placement_current_node(){
+    int cpu = sched_getcpu();
+    if(cpu < 0 || cpu >= CPU_SETSIZE) return 0;
+    return cpu_node[cpu];
+}
+
+//mbind works on whole pages, the allocation may start in the middle of one
+static int apply_policy(void *addr, size_t len, int mode, unsigned long nodemask){
+    if(addr == NULL || len == 0) return -1;
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(uintptr_t)(page - 1);
+    uintptr_t end = ((uintptr_t)addr + len + page - 1) & ~(uintptr_t)(page - 1);
+
+    if(syscall(SYS_mbind, (void*)start, end - start, mode, &nodemask, MAX_NODES + 1, PLACEMENT_MPOL_MF_MOVE) != 0){
+        perror("[ERROR HAPPENED] : placement mbind failed");
+        return -1;
+    }
+    return 0;
+}
+
+//Keeps a filter on the node of the cpu we are pinned to, moving pages that were touched elsewhere
+int placement_bind_local(void *addr, size_t len){
+    if(__builtin_popcountl(memory_nodes) < 2) return 0;
+    return apply_policy(addr, len, PLACEMENT_MPOL_PREFERRED, 1UL << placement_current_node());
+}
+
+//Read only data probed from every node, spread it so no single socket serves all the misses
+int placement_interleave(void *addr, size_t len){
+    if(__builtin_popcountl(memory_nodes) < 2) return 0;
+    return apply_policy(addr, len, PLACEMENT_MPOL_INTERLEAVE, memory_nodes);
+}
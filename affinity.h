@@ -0,0 +1,17 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+#include <stddef.h>
+
+//CPU and memory placement for the manager and the processes.
+//CPUs are ordered node by node, so neighbouring slots share a socket and its memory.
+//All calls are best effort, on a single core or single node box they just do nothing.
+
+int placement_init();
+int placement_num_cpus();
+int placement_pin_manager();
+int placement_pin_process(int process_id, int cpus_per_process);
+int placement_current_node();
+int placement_bind_local(void *addr, size_t len);
+int placement_interleave(void *addr, size_t len);
+
+#endif
@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+#define ARENA_ALIGN 64
+#define ARENA_PAGE 4096
+#define ARENA_PAGE_ALIGN_FROM (64UL << 10)  //allocations this big start on their own page
+
+static size_t round_up(size_t n, size_t to){
+    return (n + to - 1) / to * to;
+}
+
+//MAP_HUGETLB needs reserved hugepages, without them the block falls back to normal pages
+//and only asks for transparent hugepages
+static ArenaBlock *map_block(Arena *a, size_t size){
+    void *mem = MAP_FAILED;
+    if(a->use_hugepages){
+        size = round_up(size, ARENA_HUGEPAGE_SIZE);
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if(mem == MAP_FAILED){
+        size = round_up(size, ARENA_PAGE);
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mem == MAP_FAILED){
+            perror("[ERROR HAPPENED] : Arena could not map a block");
+            return NULL;
+        }
+        if(a->use_hugepages){
+            madvise(mem, size, MADV_HUGEPAGE);
+        }
+    }
+
+    ArenaBlock *block = mem;
+    block->size = size;
+    block->used = round_up(sizeof(ArenaBlock), ARENA_ALIGN);
+    block->next = a->blocks;
+    a->blocks = block;
+    a->mapped += size;
+    return block;
+}
+
+int arena_init(Arena *a, size_t block_size, int use_hugepages){
+    a->blocks = NULL;
+    a->block_size = block_size > 0 ? block_size : ARENA_DEFAULT_BLOCK;
+    a->use_hugepages = use_hugepages;
+    a->mapped = 0;
+    pthread_mutex_init(&a->lock, NULL);
+    return 0;
+}
+
+//Maps one block big enough for the next bytes of allocations, e.g. once the key count is known,
+//so the key array and the indexes end up next to each other instead of spread over small blocks
+int arena_reserve(Arena *a, size_t bytes){
+    pthread_mutex_lock(&a->lock);
+    ArenaBlock *head = a->blocks;
+    int ok = 1;
+    if(head == NULL || head->size - head->used < bytes){
+        ok = map_block(a, bytes + ARENA_PAGE) != NULL;
+    }
+    pthread_mutex_unlock(&a->lock);
+    return ok ? 0 : -1;
+}
+
+//Memory is zeroed the first time, the arena never reuses it
+void *arena_alloc(Arena *a, size_t size){
+    size_t align = size >= ARENA_PAGE_ALIGN_FROM ? ARENA_PAGE : ARENA_ALIGN;
+    pthread_mutex_lock(&a->lock);
+    ArenaBlock *block = a->blocks;
+    size_t start = block != NULL ? round_up((uintptr_t)block + block->used, align) - (uintptr_t)block : 0;
+    if(block == NULL || start + size > block->size){
+        size_t need = size + align + sizeof(ArenaBlock);
+        block = map_block(a, need > a->block_size ? need : a->block_size);
+        if(block == NULL){
+            pthread_mutex_unlock(&a->lock);
+            return NULL;
+        }
+        start = round_up((uintptr_t)block + block->used, align) - (uintptr_t)block;
+    }
+    block->used = start + size;
+    pthread_mutex_unlock(&a->lock);
+    return (char*)block + start;
+}
+
+void arena_release(Arena *a){
+    pthread_mutex_lock(&a->lock);
+    ArenaBlock *block = a->blocks;
+    while(block != NULL){
+        ArenaBlock *next = block->next;
+        munmap(block, block->size);
+        block = next;
+    }
+    a->blocks = NULL;
+    a->mapped = 0;
+    pthread_mutex_unlock(&a->lock);
+}
+
+void scratch_pool_init(ScratchPool *sp, Arena *a, size_t buf_size){
+    sp->arena = a;
+    sp->buf_size = buf_size >= sizeof(void*) ? buf_size : sizeof(void*);
+    sp->free_list = NULL;
+    pthread_mutex_init(&sp->lock, NULL);
+}
+
+void *scratch_get(ScratchPool *sp){
+    pthread_mutex_lock(&sp->lock);
+    void *buf = sp->free_list;
+    if(buf != NULL){
+        sp->free_list = *(void**)buf;
+    }
+    pthread_mutex_unlock(&sp->lock);
+    return buf != NULL ? buf : arena_alloc(sp->arena, sp->buf_size);
+}
+
+void scratch_put(ScratchPool *sp, void *buf){
+    if(buf == NULL) return;
+    pthread_mutex_lock(&sp->lock);
+    *(void**)buf = sp->free_list;
+    sp->free_list = buf;
+    pthread_mutex_unlock(&sp->lock);
+}
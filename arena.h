@@ -0,0 +1,46 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+#include <pthread.h>
+
+//Bump allocator for the memory a process keeps until it exits: the key array, the key indexes,
+//value slabs and message buffers. Memory is mapped in big blocks (optionally hugepages) and only
+//given back all at once by arena_release, so there is no per key malloc and nothing to fragment.
+//Allocations are 64 byte aligned, large ones page aligned so first touch still places them.
+
+#define ARENA_DEFAULT_BLOCK (4UL << 20)
+#define ARENA_HUGEPAGE_SIZE (2UL << 20)
+
+typedef struct ArenaBlock{
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+typedef struct{
+    ArenaBlock *blocks;        //newest first, allocations come from the head
+    size_t block_size;
+    int use_hugepages;
+    size_t mapped;             //bytes mapped over all blocks
+    pthread_mutex_t lock;      //workers allocate their indexes at the same time
+} Arena;
+
+//Fixed size buffers that go back to a free list instead of free(), for scratch space
+//that is needed per message. The free list is kept inside the unused buffers.
+typedef struct{
+    Arena *arena;
+    size_t buf_size;
+    void *free_list;
+    pthread_mutex_t lock;      //a buffer may be taken on the main thread and returned by a worker
+} ScratchPool;
+
+int arena_init(Arena *a, size_t block_size, int use_hugepages);
+int arena_reserve(Arena *a, size_t bytes);
+void *arena_alloc(Arena *a, size_t size);
+void arena_release(Arena *a);
+
+void scratch_pool_init(ScratchPool *sp, Arena *a, size_t buf_size);
+void *scratch_get(ScratchPool *sp);
+void scratch_put(ScratchPool *sp, void *buf);
+
+#endif
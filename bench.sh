@@ -0,0 +1,54 @@
+#!/bin/bash
+# Runs the same seeded workload against the Bloom engine (./process) and the maplet engine
+# (./process_maplet) and prints the numbers side by side.
+# usage: ./bench.sh [seed] [engine ...]
+set -e
+
+SEED=${1:-7270}
+shift || true
+ENGINES=${@:-"process process_maplet"}
+
+for engine in $ENGINES; do
+    if [ ! -x "./$engine" ]; then
+        echo "./$engine is missing, run make first (make maplet for process_maplet)" >&2
+        exit 1
+    fi
+done
+
+for engine in $ENGINES; do
+    echo "Running $engine with seed $SEED..."
+    ./manager "./$engine" "$SEED" > "bench_$engine.log" 2>&1 || true
+done
+
+# Everything is taken from the [BENCH] lines of the manager and the processes
+summarize() {
+    awk '
+        /\[BENCH\] Process [0-9]+ build_ms/ { if ($5 >= 0) { build += $5; builds++; if ($5 > build_max) build_max = $5 } routed += $7; probes += $9; hedged += $11 }
+        /\[BENCH\] Process [0-9]+ peak_rss_kb/ { mem += $5; mems++; if ($5 > mem_max) mem_max = $5 }
+        /\[BENCH\] latency_ms/ { avg = $4; p50 = $6; p95 = $8; p99 = $10; answered = $12; found = $14 }
+        END {
+            printf "%.1f %.1f %.0f %.0f %.2f %d %s %s %s %s %s %s\n",
+                builds ? build / builds : -1, build_max, mems ? mem / mems : -1, mem_max,
+                routed ? probes / routed : 0, hedged, avg, p50, p95, p99, answered, found
+        }' "$1"
+}
+
+printf "\n%-26s" "metric"
+for engine in $ENGINES; do printf "%18s" "$engine"; done
+printf "\n"
+
+LABELS=("build to routable (avg ms)" "build to routable (max ms)" "peak RSS avg (KB)" "peak RSS max (KB)"
+        "filter probes per query" "hedged peer queries" "latency avg (ms)" "latency p50 (ms)" "latency p95 (ms)"
+        "latency p99 (ms)" "answered" "found")
+declare -A RESULTS
+for engine in $ENGINES; do
+    RESULTS[$engine]=$(summarize "bench_$engine.log")
+done
+for i in "${!LABELS[@]}"; do
+    printf "%-26s" "${LABELS[$i]}"
+    for engine in $ENGINES; do
+        read -ra values <<< "${RESULTS[$engine]}"
+        printf "%18s" "${values[$i]:--}"
+    done
+    printf "\n"
+done
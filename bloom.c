@@ -51,6 +51,18 @@ static void __update_elements_added_on_disk(BloomFilter *bf);
 static int __sum_bits_set_char(unsigned char c);
 static int __check_if_union_or_intersection_ok(BloomFilter *res, BloomFilter *bf1, BloomFilter *bf2);
 
+static __inline__ unsigned int __get_counter(const unsigned char *counters, uint64_t idx) {
+    return (idx & 1) ? (counters[idx / 2] >> 4) : (counters[idx / 2] & 0x0F);
+}
+
+static __inline__ void __set_counter(unsigned char *counters, uint64_t idx, unsigned int count) {
+    if (idx & 1) {
+        counters[idx / 2] = (counters[idx / 2] & 0x0F) | (count << 4);
+    } else {
+        counters[idx / 2] = (counters[idx / 2] & 0xF0) | count;
+    }
+}
+
 
 int bloom_filter_init_alt(BloomFilter *bf, uint64_t estimated_elements, float false_positive_rate, BloomHashFunction hash_function) {
     if(estimated_elements == 0 || estimated_elements > UINT64_MAX || false_positive_rate <= 0.0 || false_positive_rate >= 1.0) {
@@ -391,6 +403,135 @@ float bloom_filter_jaccard_index(BloomFilter *bf1, BloomFilter *bf2) {
     return (float)bloom_filter_count_intersection_bits_set(bf1, bf2) / set_union_bits;
 }
 
+/*******************************************************************************
+***  COUNTING BLOOM FILTER
+*******************************************************************************/
+int counting_bloom_filter_init_alt(CountingBloomFilter *cbf, uint64_t estimated_elements, float false_positive_rate, BloomHashFunction hash_function) {
+    if(estimated_elements == 0 || estimated_elements > UINT64_MAX || false_positive_rate <= 0.0 || false_positive_rate >= 1.0) {
+        return BLOOM_FAILURE;
+    }
+    // borrow the sizing of the plain filter so both agree on number_bits and number_hashes
+    BloomFilter sizing;
+    sizing.estimated_elements = estimated_elements;
+    sizing.false_positive_probability = false_positive_rate;
+    __calculate_optimal_hashes(&sizing);
+
+    cbf->estimated_elements = estimated_elements;
+    cbf->false_positive_probability = false_positive_rate;
+    cbf->number_hashes = sizing.number_hashes;
+    cbf->number_bits = sizing.number_bits;
+    cbf->counters_length = (cbf->number_bits + 1) / 2;
+    cbf->counters = (unsigned char*)calloc(cbf->counters_length + 1, sizeof(char)); // pad like the plain filter
+    if (cbf->counters == NULL) {
+        return BLOOM_FAILURE;
+    }
+    cbf->elements_added = 0;
+    cbf->saturated_counters = 0;
+    cbf->hash_function = (hash_function == NULL) ? __default_hash : hash_function;
+    return BLOOM_SUCCESS;
+}
+
+int counting_bloom_filter_destroy(CountingBloomFilter *cbf) {
+    free(cbf->counters);
+    cbf->counters = NULL;
+    cbf->counters_length = 0;
+    cbf->elements_added = 0;
+    cbf->saturated_counters = 0;
+    cbf->estimated_elements = 0;
+    cbf->false_positive_probability = 0;
+    cbf->number_hashes = 0;
+    cbf->number_bits = 0;
+    cbf->hash_function = NULL;
+    return BLOOM_SUCCESS;
+}
+
+uint64_t* counting_bloom_filter_calculate_hashes(CountingBloomFilter *cbf, const char *str, unsigned int number_hashes) {
+    return cbf->hash_function(number_hashes, str);
+}
+
+unsigned int counting_bloom_filter_get_count(CountingBloomFilter *cbf, uint64_t idx) {
+    return __get_counter(cbf->counters, idx);
+}
+
+int counting_bloom_filter_add_string_alt(CountingBloomFilter *cbf, uint64_t *hashes, unsigned int number_hashes_passed) {
+    if (number_hashes_passed < cbf->number_hashes) {
+        fprintf(stderr, "Error: not enough hashes passed in to correctly check!\n");
+        return BLOOM_FAILURE;
+    }
+
+    for (unsigned int i = 0; i < cbf->number_hashes; ++i) {
+        uint64_t idx = hashes[i] % cbf->number_bits;
+        unsigned int count = __get_counter(cbf->counters, idx);
+        if (count == COUNTING_BLOOM_MAX_COUNT) {
+            continue; // saturated, stays that way
+        }
+        __set_counter(cbf->counters, idx, ++count);
+        if (count == COUNTING_BLOOM_MAX_COUNT) {
+            cbf->saturated_counters++;
+        }
+    }
+    cbf->elements_added++;
+    return BLOOM_SUCCESS;
+}
+
+int counting_bloom_filter_remove_string_alt(CountingBloomFilter *cbf, uint64_t *hashes, unsigned int number_hashes_passed) {
+    if (number_hashes_passed < cbf->number_hashes) {
+        fprintf(stderr, "Error: not enough hashes passed in to correctly check!\n");
+        return BLOOM_FAILURE;
+    }
+
+    // a string that was never added must not take counts away from the ones that were
+    if (counting_bloom_filter_check_string_alt(cbf, hashes, number_hashes_passed) == BLOOM_FAILURE) {
+        return BLOOM_FAILURE;
+    }
+    for (unsigned int i = 0; i < cbf->number_hashes; ++i) {
+        uint64_t idx = hashes[i] % cbf->number_bits;
+        unsigned int count = __get_counter(cbf->counters, idx);
+        if (count == 0 || count == COUNTING_BLOOM_MAX_COUNT) {
+            continue; // 0 only if two hashes of this string hit the same counter
+        }
+        __set_counter(cbf->counters, idx, count - 1);
+    }
+    if (cbf->elements_added > 0) {
+        cbf->elements_added--;
+    }
+    return BLOOM_SUCCESS;
+}
+
+int counting_bloom_filter_check_string_alt(CountingBloomFilter *cbf, uint64_t *hashes, unsigned int number_hashes_passed) {
+    if (number_hashes_passed < cbf->number_hashes) {
+        fprintf(stderr, "Error: not enough hashes passed in to correctly check!\n");
+        return BLOOM_FAILURE;
+    }
+
+    for (unsigned int i = 0; i < cbf->number_hashes; ++i) {
+        if (__get_counter(cbf->counters, hashes[i] % cbf->number_bits) == 0) {
+            return BLOOM_FAILURE;
+        }
+    }
+    return BLOOM_SUCCESS;
+}
+
+int counting_bloom_filter_export_bloom(CountingBloomFilter *cbf, BloomFilter *bf) {
+    if (bf->number_bits != cbf->number_bits || bf->number_hashes != cbf->number_hashes) {
+        return BLOOM_FAILURE;
+    }
+    // every counter byte covers two bits, so four bytes make one byte of the plain filter
+    for (unsigned long i = 0; i < bf->bloom_length; ++i) {
+        unsigned char bits = 0;
+        for (int j = 0; j < CHAR_LEN; ++j) {
+            uint64_t idx = (uint64_t)i * CHAR_LEN + j;
+            if (idx < cbf->number_bits && __get_counter(cbf->counters, idx) != 0) {
+                bits |= (1 << j);
+            }
+        }
+        bf->bloom[i] = bits;
+    }
+    bf->elements_added = cbf->elements_added;
+    __update_elements_added_on_disk(bf);
+    return BLOOM_SUCCESS;
+}
+
 /*******************************************************************************
 *    PRIVATE FUNCTIONS
 *******************************************************************************/
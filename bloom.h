@@ -59,6 +59,26 @@ typedef struct bloom_filter {
 } BloomFilter;
 
 
+/*  Counting variant: every bit is a 4 bit counter (two per byte) so elements can be
+    removed again. A counter that reaches 15 saturates and is never decremented, the
+    bit then stays set, which only costs false positives and never false negatives. */
+#define COUNTING_BLOOM_MAX_COUNT 15
+
+typedef struct counting_bloom_filter {
+    /* bloom parameters, same meaning as in BloomFilter */
+    uint64_t estimated_elements;
+    float false_positive_probability;
+    unsigned int number_hashes;
+    uint64_t number_bits;
+    /* packed counters, counter i is the low nibble of byte i/2 for even i */
+    unsigned char *counters;
+    unsigned long counters_length;
+    uint64_t elements_added;
+    uint64_t saturated_counters;
+    BloomHashFunction hash_function;
+} CountingBloomFilter;
+
+
 /*  Initialize a standard bloom filter in memory; this will provide 'optimal' size and hash numbers.
 
     Estimated elements is 0 < x <= UINT64_MAX.
@@ -171,6 +191,42 @@ uint64_t bloom_filter_count_intersection_bits_set(BloomFilter *bf1, BloomFilter
 float bloom_filter_jaccard_index(BloomFilter *bf1, BloomFilter *bf2);
 
 
+/*******************************************************************************
+    Counting Bloom Filter Functions
+    NOTE: Sized exactly like a BloomFilter with the same estimated elements and
+    false positive rate, so hashes and bit positions are interchangeable.
+*******************************************************************************/
+
+/* Initialize a counting bloom filter in memory */
+int counting_bloom_filter_init_alt(CountingBloomFilter *cbf, uint64_t estimated_elements, float false_positive_rate, BloomHashFunction hash_function);
+static __inline__ int counting_bloom_filter_init(CountingBloomFilter *cbf, uint64_t estimated_elements, float false_positive_rate) {
+    return counting_bloom_filter_init_alt(cbf, estimated_elements, false_positive_rate, NULL);
+}
+
+/* Release all memory used by the counting bloom filter */
+int counting_bloom_filter_destroy(CountingBloomFilter *cbf);
+
+/* Generate the desired number of hashes, the caller frees the result */
+uint64_t* counting_bloom_filter_calculate_hashes(CountingBloomFilter *cbf, const char *str, unsigned int number_hashes);
+
+/* Add a string to the counting bloom filter using the defined hashes */
+int counting_bloom_filter_add_string_alt(CountingBloomFilter *cbf, uint64_t *hashes, unsigned int number_hashes_passed);
+
+/*  Remove a string using the defined hashes. Fails without changing anything if one of
+    its counters is already 0, i.e. the string was never added */
+int counting_bloom_filter_remove_string_alt(CountingBloomFilter *cbf, uint64_t *hashes, unsigned int number_hashes_passed);
+
+/* Check if a string is in the counting bloom filter using the passed hashes */
+int counting_bloom_filter_check_string_alt(CountingBloomFilter *cbf, uint64_t *hashes, unsigned int number_hashes_passed);
+
+/* Current value of the counter behind bit idx (0 - COUNTING_BLOOM_MAX_COUNT) */
+unsigned int counting_bloom_filter_get_count(CountingBloomFilter *cbf, uint64_t idx);
+
+/*  Collapse into a plain bloom filter (bit set where the counter is not 0) for shipping to
+    peers. bf has to be initialized with the same estimated elements and false positive rate */
+int counting_bloom_filter_export_bloom(CountingBloomFilter *cbf, BloomFilter *bf);
+
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bloom.h"
+#include "test_check.h"
+
+#define NUM_KEYS 5000
+#define FALSE_POSITIVE_RATE 0.01
+
+static void add_key(CountingBloomFilter *cbf, BloomFilter *bf, int key){
+    char key_str[32];
+    snprintf(key_str, sizeof(key_str), "%d", key);
+    uint64_t *hashes = counting_bloom_filter_calculate_hashes(cbf, key_str, cbf->number_hashes);
+    counting_bloom_filter_add_string_alt(cbf, hashes, cbf->number_hashes);
+    if(bf != NULL) bloom_filter_add_string_alt(bf, hashes, cbf->number_hashes);
+    free(hashes);
+}
+
+static int remove_key(CountingBloomFilter *cbf, int key){
+    char key_str[32];
+    snprintf(key_str, sizeof(key_str), "%d", key);
+    uint64_t *hashes = counting_bloom_filter_calculate_hashes(cbf, key_str, cbf->number_hashes);
+    int result = counting_bloom_filter_remove_string_alt(cbf, hashes, cbf->number_hashes);
+    free(hashes);
+    return result;
+}
+
+//The exported filter has to be byte for byte the plain filter of the same keys
+static int exports_as(CountingBloomFilter *cbf, BloomFilter *expected){
+    BloomFilter exported;
+    bloom_filter_init(&exported, NUM_KEYS, FALSE_POSITIVE_RATE);
+    int same = counting_bloom_filter_export_bloom(cbf, &exported) == BLOOM_SUCCESS &&
+               exported.bloom_length == expected->bloom_length &&
+               memcmp(exported.bloom, expected->bloom, expected->bloom_length) == 0;
+    bloom_filter_destroy(&exported);
+    return same;
+}
+
+//Two counters share a byte, hashes that all hit one index drive a single counter
+static void check_nibbles(CountingBloomFilter *cbf){
+    unsigned int k = cbf->number_hashes;
+    uint64_t *low = malloc(k * sizeof(uint64_t));
+    uint64_t *high = malloc(k * sizeof(uint64_t));
+    for(unsigned int i = 0; i < k; i++){
+        low[i] = 10;
+        high[i] = 11;
+    }
+    unsigned char *before = malloc(cbf->counters_length);
+
+    counting_bloom_filter_add_string_alt(cbf, low, k);
+    check(counting_bloom_filter_get_count(cbf, 10) == k && counting_bloom_filter_get_count(cbf, 11) == 0, "low nibble counts alone");
+    counting_bloom_filter_add_string_alt(cbf, high, k);
+    check(counting_bloom_filter_get_count(cbf, 10) == k && counting_bloom_filter_get_count(cbf, 11) == k, "high nibble counts alone");
+    check(counting_bloom_filter_remove_string_alt(cbf, low, k) == BLOOM_SUCCESS, "remove of an added string works");
+    check(counting_bloom_filter_get_count(cbf, 10) == 0 && counting_bloom_filter_get_count(cbf, 11) == k, "remove leaves the other nibble");
+
+    //Removing what is not there fails and changes nothing
+    memcpy(before, cbf->counters, cbf->counters_length);
+    check(counting_bloom_filter_remove_string_alt(cbf, low, k) == BLOOM_FAILURE, "remove of a missing string fails");
+    check(memcmp(before, cbf->counters, cbf->counters_length) == 0, "failed remove changes no counter");
+
+    //Saturate: the counter sticks at the maximum and is never decremented again
+    uint64_t saturated = cbf->saturated_counters;
+    for(int i = 0; i < 3; i++){
+        counting_bloom_filter_add_string_alt(cbf, high, k);
+    }
+    check(counting_bloom_filter_get_count(cbf, 11) == COUNTING_BLOOM_MAX_COUNT, "counter saturates at the maximum");
+    check(cbf->saturated_counters == saturated + 1, "saturation is counted once");
+    check(counting_bloom_filter_get_count(cbf, 10) == 0, "saturation does not carry into the low nibble");
+    for(int i = 0; i < 10; i++){
+        counting_bloom_filter_remove_string_alt(cbf, high, k);
+    }
+    check(counting_bloom_filter_get_count(cbf, 11) == COUNTING_BLOOM_MAX_COUNT, "saturated counter survives removes");
+    check(counting_bloom_filter_check_string_alt(cbf, high, k) == BLOOM_SUCCESS, "saturated string is still found");
+
+    free(low);
+    free(high);
+    free(before);
+}
+
+//Checks the counting filter against plain filters of the same keys: adding, removing and
+//exporting have to give the same bits, and the nibble counters have to stay independent.
+int main(){
+    CountingBloomFilter cbf;
+    BloomFilter all, even;
+    if(counting_bloom_filter_init(&cbf, NUM_KEYS, FALSE_POSITIVE_RATE) != BLOOM_SUCCESS ||
+       bloom_filter_init(&all, NUM_KEYS, FALSE_POSITIVE_RATE) != BLOOM_SUCCESS ||
+       bloom_filter_init(&even, NUM_KEYS, FALSE_POSITIVE_RATE) != BLOOM_SUCCESS){
+        printf("[FAIL] could not allocate the filters\n");
+        return 1;
+    }
+    check(cbf.number_bits == all.number_bits && cbf.number_hashes == all.number_hashes, "sized like the plain filter");
+
+    for(int key = 0; key < NUM_KEYS; key++){
+        add_key(&cbf, &all, key);
+        //A key that is added and removed again leaves no trace
+        if(key % 2 == 0){
+            add_key(&cbf, NULL, key + NUM_KEYS);
+            check(remove_key(&cbf, key + NUM_KEYS) == BLOOM_SUCCESS, "remove right after the add works");
+        }
+    }
+    printf("Added %d keys, %lu saturated counters\n", NUM_KEYS, (unsigned long)cbf.saturated_counters);
+    check(exports_as(&cbf, &all), "export after adds equals the plain filter");
+
+    for(int key = 0; key < NUM_KEYS; key++){
+        if(key % 2 == 0){
+            char key_str[32];
+            snprintf(key_str, sizeof(key_str), "%d", key);
+            bloom_filter_add_string(&even, key_str);
+        } else {
+            check(remove_key(&cbf, key) == BLOOM_SUCCESS, "remove of an added key works");
+        }
+    }
+    //Without saturated counters removing is exact
+    if(cbf.saturated_counters == 0){
+        check(exports_as(&cbf, &even), "export after removes equals the plain filter of the rest");
+    }
+    int lost = 0;
+    for(int key = 0; key < NUM_KEYS; key += 2){
+        char key_str[32];
+        snprintf(key_str, sizeof(key_str), "%d", key);
+        uint64_t *hashes = counting_bloom_filter_calculate_hashes(&cbf, key_str, cbf.number_hashes);
+        lost += counting_bloom_filter_check_string_alt(&cbf, hashes, cbf.number_hashes) != BLOOM_SUCCESS;
+        free(hashes);
+    }
+    check(lost == 0, "no false negatives after removes");
+    check(cbf.elements_added == NUM_KEYS / 2, "element count follows adds and removes");
+
+    counting_bloom_filter_destroy(&cbf);
+    counting_bloom_filter_init(&cbf, NUM_KEYS, FALSE_POSITIVE_RATE);
+    check_nibbles(&cbf);
+
+    counting_bloom_filter_destroy(&cbf);
+    bloom_filter_destroy(&all);
+    bloom_filter_destroy(&even);
+
+    return test_result("counting filter matches the plain filters");
+}
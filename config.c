@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+#include "config.h"
+#include "keyhash.h"
+#include "workload.h"
+
+Config config = {
+    .seed = -1,
+    .engine = "./process",
+    .key_file = "",
+    .key_distribution = KEY_DIST_UNIFORM,
+    .key_space = 100000000,
+    .key_zipf_exponent = 0.99,
+    .key_cluster_size = 1000,
+    .num_processes = 64,
+    .keys_per_process = 156250,
+    .num_queries = 100,
+    .query_hit_ratio = 1,
+    .query_locality = 0,
+    .query_remote_share = 1,
+    .num_updates = 0,
+    .num_values = 0,
+    .kill_process_before_queries = -1,
+    .max_keys_per_chunk = 7000,
+    .query_batch_size = 64,
+    .bloom_exchange_time = 30,
+    .false_positive_rate = 0.01,
+    .key_placement = KEY_PLACEMENT_JUMP,
+    .replication_factor = 1,
+    .snapshots = 0,
+    .workers_per_process = 1,
+    .receive_queues = 0,
+    .pin_processes = 1,
+    .interleave_peer_filters = 0,
+    .hugepages = 0,
+    .bloom_msg_size = 262144,
+    .socket_rcvbuf = 1048576,
+    .address_map = "",
+    .io_uring = 0,
+    .heartbeat_ms = 100,
+    .heartbeat_timeout_ms = 1000,
+    .heartbeat_kill_ms = 10000,
+    .respawn_wait_ms = 30000,
+};
+
+typedef enum{ CONFIG_INT, CONFIG_LONG, CONFIG_DOUBLE, CONFIG_STRING } ConfigType;
+
+typedef struct{
+    const char *name;
+    ConfigType type;
+    size_t offset;
+    double min;                    //numbers below are rejected, strings are not checked
+    const char *help;
+} ConfigParam;
+
+#define PARAM(field, type, min, help) {#field, type, offsetof(Config, field), min, help}
+
+static const ConfigParam params[] = {
+    PARAM(seed, CONFIG_LONG, -1, "Same seed, same keys and queries for every engine, -1 picks one from the clock"),
+    PARAM(engine, CONFIG_STRING, 0, "Process binary, ./process_maplet runs the quotient filter engine"),
+    PARAM(key_file, CONFIG_STRING, 0, "Empty generates the keys, \"-\" reads text from stdin, *.bin is raw int32 keys"),
+    PARAM(key_distribution, CONFIG_INT, 0, "Generated keys, 0: uniform without duplicates, 1: zipf (hot keys repeat), 2: sequential, 3: clustered"),
+    PARAM(key_space, CONFIG_INT, 1, "Generated keys are below this, the update check adds new keys above it"),
+    PARAM(key_zipf_exponent, CONFIG_DOUBLE, 0, "Skew of key_distribution 1, 0 is uniform with repeats"),
+    PARAM(key_cluster_size, CONFIG_INT, 1, "Consecutive keys per run of key_distribution 3"),
+    PARAM(num_processes, CONFIG_INT, 1, "Processes the keys are spread over"),
+    PARAM(keys_per_process, CONFIG_INT, 1, "Generated keys per process"),
+    PARAM(num_queries, CONFIG_INT, 0, "Queries of the benchmark"),
+    PARAM(query_hit_ratio, CONFIG_DOUBLE, 0, "Share of queries for loaded keys, the rest ask for keys nobody holds (at most 1)"),
+    PARAM(query_locality, CONFIG_DOUBLE, 0, "0 queries every picked key once, above 0 is the zipf exponent hot keys are queried again with"),
+    PARAM(query_remote_share, CONFIG_DOUBLE, 0, "Share of hits asked at a process without the key, the rest at one that holds it (at most 1)"),
+    PARAM(num_updates, CONFIG_INT, 0, "After the benchmark, PUT this many new keys and DELETE this many old ones, then query them"),
+    PARAM(num_values, CONFIG_INT, 0, "After the update check, SET values for this many queried keys (every 4th one above VALUE_INLINE_MAX) and GET them back"),
+    PARAM(kill_process_before_queries, CONFIG_INT, -1, ">= 0 SIGKILLs that process right before the queries to exercise the supervisor"),
+    PARAM(max_keys_per_chunk, CONFIG_INT, 1, "Keys per KEYS message while loading"),
+    PARAM(query_batch_size, CONFIG_INT, 1, "Keys packed into one QUERY message per target process"),
+    PARAM(bloom_exchange_time, CONFIG_INT, 0, "Seconds the manager waits for the filter exchange after loading"),
+    PARAM(false_positive_rate, CONFIG_DOUBLE, 0.000001, "False positive rate the process filters are sized for"),
+    PARAM(key_placement, CONFIG_INT, 0, "0: keys_per_process keys in a row, 1: salted hash over the processes, 2: jump consistent hash"),
+    PARAM(replication_factor, CONFIG_INT, 1, "Every key also goes to the next replication_factor-1 processes, slow peers get a hedged PQUERY"),
+    PARAM(snapshots, CONFIG_INT, 0, "1: processes checkpoint keys, index and filter, a later run with the same workload restores them"),
+    PARAM(workers_per_process, CONFIG_INT, 1, "Worker threads per process, 1 keeps the single threaded event loop"),
+    PARAM(receive_queues, CONFIG_INT, 0, "0 or workers_per_process, lets every worker read its own socket"),
+    PARAM(pin_processes, CONFIG_INT, 0, "Manager on its own core, every process on workers_per_process cores of one node"),
+    PARAM(interleave_peer_filters, CONFIG_INT, 0, "1 spreads the peer filter copies over all nodes instead of keeping them local"),
+    PARAM(hugepages, CONFIG_INT, 0, "1 maps the process arenas (keys, indexes, buffers) with hugepages when the system has them"),
+    PARAM(bloom_msg_size, CONFIG_INT, 65536, "Receive buffer of a process, bytes"),
+    PARAM(socket_rcvbuf, CONFIG_INT, 4096, "SO_RCVBUF of every receiving socket, bytes"),
+    PARAM(address_map, CONFIG_STRING, 0, "Address map (\"<id> <host> <port>\" lines) switches every process from unix sockets to TCP"),
+    PARAM(io_uring, CONFIG_INT, 0, "1 receives and sends the unix datagrams in rounds through io_uring, plain system calls where the kernel has none"),
+    PARAM(heartbeat_ms, CONFIG_INT, 1, "Supervisor PINGs every process this often once the keys are loaded"),
+    PARAM(heartbeat_timeout_ms, CONFIG_INT, 1, "No PONG for this long: peers stop routing to the process"),
+    PARAM(heartbeat_kill_ms, CONFIG_INT, 1, "Still silent after this long: the process is killed and re-spawned"),
+    PARAM(respawn_wait_ms, CONFIG_INT, 0, "Longest the checks after the queries wait for re-spawned processes to be READY"),
+};
+
+#define NUM_PARAMS ((int)(sizeof(params) / sizeof(params[0])))
+
+static const ConfigParam *find_param(const char *name, size_t len){
+    for(int i = 0; i < NUM_PARAMS; i++){
+        if(strlen(params[i].name) == len && strncmp(params[i].name, name, len) == 0) return &params[i];
+    }
+    return NULL;
+}
+
+static int set_param(const ConfigParam *p, const char *value){
+    char *field = (char*)&config + p->offset;
+    char *end;
+    errno = 0;
+    if(p->type == CONFIG_STRING){
+        char *copy = strdup(value);
+        if(copy == NULL) return -1;
+        *(const char**)field = copy;
+        return 0;
+    }
+    if(p->type == CONFIG_DOUBLE){
+        double d = strtod(value, &end);
+        if(end == value || *end != '\0' || errno != 0 || d < p->min){
+            fprintf(stderr, "[ERROR HAPPENED] : %s needs a number of at least %g, got \"%s\"\n", p->name, p->min, value);
+            return -1;
+        }
+        *(double*)field = d;
+        return 0;
+    }
+    long long n = strtoll(value, &end, 10);
+    long long max = p->type == CONFIG_INT ? 2147483647LL : 4294967295LL;
+    if(end == value || *end != '\0' || errno != 0 || n < (long long)p->min || n > max){
+        fprintf(stderr, "[ERROR HAPPENED] : %s needs a whole number of at least %.0f, got \"%s\"\n", p->name, p->min, value);
+        return -1;
+    }
+    if(p->type == CONFIG_INT){
+        *(int*)field = (int)n;
+    } else {
+        *(long*)field = (long)n;
+    }
+    return 0;
+}
+
+//-1 if the parameter does not exist or the value does not fit it
+int config_set(const char *name, const char *value){
+    const ConfigParam *p = find_param(name, strlen(name));
+    if(p == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : Unknown parameter %s, ./manager --help lists them\n", name);
+        return -1;
+    }
+    return set_param(p, value);
+}
+
+static char *trim(char *s){
+    while(isspace((unsigned char)*s)) s++;
+    char *end = s + strlen(s);
+    while(end > s && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    return s;
+}
+
+//"name = value" per line, # starts a comment. Same format as config_print writes.
+int config_load_file(const char *path){
+    FILE *f = fopen(path, "r");
+    if(f == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : Could not open config file %s\n", path);
+        return -1;
+    }
+    char line[1024];
+    int line_no = 0;
+    int rc = 0;
+    while(rc == 0 && fgets(line, sizeof(line), f) != NULL){
+        line_no++;
+        char *comment = strchr(line, '#');
+        if(comment != NULL) *comment = '\0';
+        char *s = trim(line);
+        if(*s == '\0') continue;
+        char *eq = strchr(s, '=');
+        if(eq == NULL){
+            fprintf(stderr, "[ERROR HAPPENED] : %s line %d is not \"name = value\"\n", path, line_no);
+            rc = -1;
+            break;
+        }
+        *eq = '\0';
+        rc = config_set(trim(s), trim(eq + 1));
+    }
+    fclose(f);
+    return rc;
+}
+
+//1 if arg was a --name=value flag (or --config=path) and is applied, 0 if it is no flag, -1 on errors
+int config_apply_arg(const char *arg){
+    if(strncmp(arg, "--", 2) != 0) return 0;
+    const char *name = arg + 2;
+    const char *eq = strchr(name, '=');
+    if(eq == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : %s has no value, flags are --name=value\n", arg);
+        return -1;
+    }
+    if((size_t)(eq - name) == 6 && strncmp(name, "config", 6) == 0){
+        return config_load_file(eq + 1) == 0 ? 1 : -1;
+    }
+    const ConfigParam *p = find_param(name, (size_t)(eq - name));
+    if(p == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : Unknown parameter %.*s, ./manager --help lists them\n", (int)(eq - name), name);
+        return -1;
+    }
+    return set_param(p, eq + 1) == 0 ? 1 : -1;
+}
+
+static void format_value(const ConfigParam *p, char *buf, size_t size){
+    const char *field = (const char*)&config + p->offset;
+    if(p->type == CONFIG_INT){
+        snprintf(buf, size, "%d", *(const int*)field);
+    } else if(p->type == CONFIG_LONG){
+        snprintf(buf, size, "%ld", *(const long*)field);
+    } else if(p->type == CONFIG_DOUBLE){
+        snprintf(buf, size, "%.17g", *(const double*)field);
+    } else {
+        snprintf(buf, size, "%s", *(const char* const*)field);
+    }
+}
+
+//Every parameter as a --name=value flag for a child process, returns how many were written
+int config_to_args(char **args, int max_args){
+    int n = 0;
+    for(int i = 0; i < NUM_PARAMS && n < max_args; i++){
+        char value[512];
+        format_value(&params[i], value, sizeof(value));
+        size_t len = strlen(params[i].name) + strlen(value) + 4;
+        args[n] = malloc(len);
+        if(args[n] == NULL) break;
+        snprintf(args[n], len, "--%s=%s", params[i].name, value);
+        n++;
+    }
+    return n;
+}
+
+//The effective configuration, can be loaded again with --config
+void config_print(FILE *out){
+    for(int i = 0; i < NUM_PARAMS; i++){
+        char value[512];
+        format_value(&params[i], value, sizeof(value));
+        fprintf(out, "%s = %s\n", params[i].name, value);
+    }
+}
+
+void config_usage(FILE *out){
+    fprintf(out, "Parameters, as --name=value or \"name = value\" lines of a --config=path file (default in brackets):\n");
+    for(int i = 0; i < NUM_PARAMS; i++){
+        char value[512];
+        format_value(&params[i], value, sizeof(value));
+        fprintf(out, "  %-28s %s [%s]\n", params[i].name, params[i].help, value);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+#include <stdio.h>
+
+//Runtime parameters of the manager and the processes, instead of #defines and a recompile.
+//A parameter starts at its default, then a config file ("name = value" lines, --config=path)
+//and --name=value flags change it, in the order they are given. The manager starts every
+//process with the whole table as --name=value flags, so both sides always agree.
+//./manager --help lists them all.
+
+typedef struct{
+    //Workload
+    long seed;                     //-1 picks one from the clock
+    const char *engine;
+    const char *key_file;
+    int key_distribution;
+    int key_space;
+    double key_zipf_exponent;
+    int key_cluster_size;
+    int num_processes;
+    int keys_per_process;
+    int num_queries;
+    double query_hit_ratio;
+    double query_locality;
+    double query_remote_share;
+    int num_updates;
+    int num_values;
+    int kill_process_before_queries;
+    //Loading and querying
+    int max_keys_per_chunk;
+    int query_batch_size;
+    int bloom_exchange_time;
+    double false_positive_rate;
+    int key_placement;
+    int replication_factor;
+    int snapshots;
+    //Process layout
+    int workers_per_process;
+    int receive_queues;
+    int pin_processes;
+    int interleave_peer_filters;
+    int hugepages;
+    //IPC
+    int bloom_msg_size;
+    int socket_rcvbuf;
+    const char *address_map;
+    int io_uring;
+    //Supervision
+    int heartbeat_ms;
+    int heartbeat_timeout_ms;
+    int heartbeat_kill_ms;
+    int respawn_wait_ms;
+} Config;
+
+extern Config config;
+
+int config_set(const char *name, const char *value);
+int config_load_file(const char *path);
+int config_apply_arg(const char *arg);
+int config_to_args(char **args, int max_args);
+void config_print(FILE *out);
+void config_usage(FILE *out);
+
+#endif
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include "filter_sync.h"
+
+#define FILTER_SYNC_MAX_VARINT 10
+
+static size_t put_varint(uint8_t *out, uint64_t value){
+    size_t pos = 0;
+    while(value >= 0x80){
+        out[pos++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[pos++] = (uint8_t)value;
+    return pos;
+}
+
+//Returns the number of bytes read, 0 if the varint is cut off
+static size_t get_varint(const uint8_t *in, size_t in_len, uint64_t *value){
+    size_t pos = 0;
+    int shift = 0;
+    *value = 0;
+    while(pos < in_len && shift <= 63){
+        uint8_t byte = in[pos++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if((byte & 0x80) == 0) return pos;
+        shift += 7;
+    }
+    return 0;
+}
+
+static uint64_t block_bytes(uint64_t block, uint64_t filter_bytes){
+    uint64_t start = block * FILTER_SYNC_BLOCK_SIZE;
+    uint64_t end = start + FILTER_SYNC_BLOCK_SIZE;
+    return (end > filter_bytes ? filter_bytes : end) - start;
+}
+
+uint64_t filter_sync_num_blocks(uint64_t filter_bytes){
+    return (filter_bytes + FILTER_SYNC_BLOCK_SIZE - 1) / FILTER_SYNC_BLOCK_SIZE;
+}
+
+//Encodes the blocks changed after since_generation, starting at from_block, as long as they fit in out_size.
+//Returns the number of blocks taken. *next_block is where the next message has to continue,
+//filter_sync_num_blocks() once everything was sent.
+int filter_sync_encode(const unsigned char *filter, uint64_t filter_bytes, const uint64_t *block_generation,
+                       uint64_t since_generation, uint64_t from_block,
+                       uint8_t *out, size_t out_size, size_t *out_len, uint64_t *next_block){
+    uint64_t num_blocks = filter_sync_num_blocks(filter_bytes);
+    uint64_t block = from_block;
+    uint64_t previous_end = from_block;
+    size_t pos = 0;
+    int encoded = 0;
+
+    while(block < num_blocks){
+        if(block_generation[block] <= since_generation){
+            block++;
+            continue;
+        }
+        uint64_t run_end = block + 1;
+        while(run_end < num_blocks && block_generation[run_end] > since_generation) run_end++;
+
+        //Shorten the run to what still fits, a run that does not fit at all ends the message
+        size_t header = 2 * FILTER_SYNC_MAX_VARINT;
+        if(pos + header + block_bytes(block, filter_bytes) > out_size) break;
+        uint64_t fit_end = block;
+        size_t payload = 0;
+        while(fit_end < run_end && pos + header + payload + block_bytes(fit_end, filter_bytes) <= out_size){
+            payload += block_bytes(fit_end, filter_bytes);
+            fit_end++;
+        }
+
+        pos += put_varint(out + pos, block - previous_end);
+        pos += put_varint(out + pos, fit_end - block);
+        memcpy(out + pos, filter + block * FILTER_SYNC_BLOCK_SIZE, payload);
+        pos += payload;
+        encoded += (int)(fit_end - block);
+
+        block = fit_end;
+        previous_end = fit_end;
+        if(fit_end < run_end) break;
+    }
+
+    *out_len = pos;
+    *next_block = block < num_blocks ? block : num_blocks;
+    return encoded;
+}
+
+//Copies the runs of an encoded message into filter. from_block has to match the one given to the encoder.
+//Returns the number of blocks written, -1 if the message is cut off or runs past the filter.
+int filter_sync_apply(const uint8_t *in, size_t in_len, uint64_t from_block, unsigned char *filter, uint64_t filter_bytes){
+    uint64_t num_blocks = filter_sync_num_blocks(filter_bytes);
+    uint64_t block = from_block;
+    size_t pos = 0;
+    int applied = 0;
+
+    while(pos < in_len){
+        uint64_t skip, count;
+        size_t used = get_varint(in + pos, in_len - pos, &skip);
+        if(used == 0) return -1;
+        pos += used;
+        used = get_varint(in + pos, in_len - pos, &count);
+        if(used == 0) return -1;
+        pos += used;
+
+        if(skip > num_blocks - block || count > num_blocks - block - skip) return -1;
+        block += skip;
+        uint64_t bytes = (block + count) * FILTER_SYNC_BLOCK_SIZE;
+        if(bytes > filter_bytes) bytes = filter_bytes;
+        bytes -= block * FILTER_SYNC_BLOCK_SIZE;
+        if(bytes > in_len - pos) return -1;
+
+        memcpy(filter + block * FILTER_SYNC_BLOCK_SIZE, in + pos, bytes);
+        pos += bytes;
+        block += count;
+        applied += (int)count;
+    }
+    return applied;
+}
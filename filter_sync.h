@@ -0,0 +1,19 @@
+#ifndef FILTER_SYNC_H
+#define FILTER_SYNC_H
+#include <stdint.h>
+#include <stddef.h>
+
+//Versioned sync of a bloom filter in 64 byte blocks. The owner stamps every block with the
+//generation it last changed in, a peer asks for the blocks newer than the generation it has.
+//Changed blocks go out as runs: varint count of unchanged blocks skipped since the previous run,
+//varint run length in blocks, then the raw bytes of the run. Adjacent changes cost one run header.
+
+#define FILTER_SYNC_BLOCK_SIZE 64
+
+uint64_t filter_sync_num_blocks(uint64_t filter_bytes);
+int filter_sync_encode(const unsigned char *filter, uint64_t filter_bytes, const uint64_t *block_generation,
+                       uint64_t since_generation, uint64_t from_block,
+                       uint8_t *out, size_t out_size, size_t *out_len, uint64_t *next_block);
+int filter_sync_apply(const uint8_t *in, size_t in_len, uint64_t from_block, unsigned char *filter, uint64_t filter_bytes);
+
+#endif
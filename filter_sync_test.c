@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filter_sync.h"
+#include "test_check.h"
+
+#define FILTER_BYTES (1000 * FILTER_SYNC_BLOCK_SIZE + 37)  //the last block is a partial one
+#define NUM_ROUNDS 8
+
+//Changes block b in the owner's filter and stamps it with the generation
+static void touch_block(unsigned char *filter, uint64_t *block_generation, uint64_t b, uint64_t generation){
+    uint64_t start = b * FILTER_SYNC_BLOCK_SIZE;
+    uint64_t end = start + FILTER_SYNC_BLOCK_SIZE;
+    if(end > FILTER_BYTES) end = FILTER_BYTES;
+    for(uint64_t i = start; i < end; i++){
+        filter[i] = (unsigned char)rand();
+    }
+    block_generation[b] = generation;
+}
+
+//Pulls everything newer than since into copy the way Process.c does, one message per out_size.
+//Returns the number of blocks written, -1 if a message did not apply.
+static int sync_copy(const unsigned char *filter, const uint64_t *block_generation, uint64_t since,
+                     unsigned char *copy, size_t out_size, int *messages){
+    uint8_t *msg = malloc(out_size);
+    uint64_t num_blocks = filter_sync_num_blocks(FILTER_BYTES);
+    uint64_t from_block = 0, next_block = 0;
+    int total = 0;
+    *messages = 0;
+    do {
+        size_t len;
+        int encoded = filter_sync_encode(filter, FILTER_BYTES, block_generation, since, from_block, msg, out_size, &len, &next_block);
+        int applied = filter_sync_apply(msg, len, from_block, copy, FILTER_BYTES);
+        (*messages)++;
+        if(applied != encoded || (encoded == 0 && next_block < num_blocks)){
+            free(msg);
+            return -1;
+        }
+        total += applied;
+        from_block = next_block;
+    } while(next_block < num_blocks);
+    free(msg);
+    return total;
+}
+
+//Checks that peers following the owner's filter over the generations end up with the same bytes,
+//whether they sync every round or skip some, with whole or split messages, and that cut-off or
+//out of range messages are refused.
+int main(){
+    uint64_t num_blocks = filter_sync_num_blocks(FILTER_BYTES);
+    unsigned char *filter = malloc(FILTER_BYTES);
+    unsigned char *every_round = malloc(FILTER_BYTES);
+    unsigned char *every_third = malloc(FILTER_BYTES);
+    uint64_t *block_generation = calloc(num_blocks, sizeof(uint64_t));
+    srand(7);
+    for(uint64_t i = 0; i < FILTER_BYTES; i++){
+        filter[i] = (unsigned char)rand();
+    }
+    memcpy(every_round, filter, FILTER_BYTES);
+    memcpy(every_third, filter, FILTER_BYTES);
+    check(num_blocks == 1001, "partial last block is counted");
+
+    size_t len;
+    uint64_t next_block;
+    uint8_t msg[2048];
+    check(filter_sync_encode(filter, FILTER_BYTES, block_generation, 0, 0, msg, sizeof(msg), &len, &next_block) == 0 &&
+          len == 0 && next_block == num_blocks, "nothing changed encodes nothing");
+
+    uint64_t every_third_generation = 0;
+    for(uint64_t g = 1; g <= NUM_ROUNDS; g++){
+        //A long run, single blocks far apart (skips over 127 need two varint bytes), the first and the partial last block
+        uint64_t run_start = (g * 97) % (num_blocks - 40);
+        for(uint64_t b = run_start; b < run_start + 30; b++){
+            touch_block(filter, block_generation, b, g);
+        }
+        for(int i = 0; i < 5; i++){
+            touch_block(filter, block_generation, (uint64_t)rand() % num_blocks, g);
+        }
+        if(g % 2 == 1) touch_block(filter, block_generation, 0, g);
+        if(g % 3 == 0) touch_block(filter, block_generation, num_blocks - 1, g);
+
+        int messages;
+        //Small messages split runs, the large one takes the whole round at once
+        int blocks = sync_copy(filter, block_generation, g - 1, every_round, g % 2 ? 700 : 65000, &messages);
+        check(blocks > 0, "every round sync applies");
+        check(memcmp(filter, every_round, FILTER_BYTES) == 0, "every round copy equals the filter");
+        check(g % 2 == 0 || messages >= 2, "small messages split the round");
+
+        if(g % 3 == 0){
+            check(sync_copy(filter, block_generation, every_third_generation, every_third, 1500, &messages) > 0,
+                  "sync over several generations applies");
+            check(memcmp(filter, every_third, FILTER_BYTES) == 0, "copy that skipped generations equals the filter");
+            every_third_generation = g;
+        }
+    }
+
+    //Broken messages: the last byte missing, a cut-off varint, a run past the end of the filter
+    memset(block_generation, 0, num_blocks * sizeof(uint64_t));
+    block_generation[num_blocks - 1] = 1;
+    filter_sync_encode(filter, FILTER_BYTES, block_generation, 0, 0, msg, sizeof(msg), &len, &next_block);
+    check(len > 0 && filter_sync_apply(msg, len - 1, 0, every_round, FILTER_BYTES) < 0, "cut-off payload is refused");
+    uint8_t cut_varint[] = {0x80};
+    check(filter_sync_apply(cut_varint, sizeof(cut_varint), 0, every_round, FILTER_BYTES) < 0, "cut-off varint is refused");
+    uint8_t past_end[] = {0xe8, 0x07, 0x02};  //skip 1000 blocks, then a run of 2
+    check(filter_sync_apply(past_end, sizeof(past_end), 0, every_round, FILTER_BYTES) < 0, "run past the filter is refused");
+    check(filter_sync_encode(filter, FILTER_BYTES, block_generation, 0, 0, msg, 16, &len, &next_block) == 0 &&
+          len == 0 && next_block == num_blocks - 1, "block that does not fit stays for the next message");
+
+    free(filter);
+    free(every_round);
+    free(every_third);
+    free(block_generation);
+
+    return test_result("every generation synced into identical copies");
+}
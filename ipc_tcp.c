@@ -0,0 +1,647 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "IPC.h"
+#include "ipc_transport.h"
+
+//The same messages over TCP, so processes can run on several hosts (or on one over loopback).
+//Every message is one frame: a 4 byte length in network order, then the bytes.
+//A sender keeps one connection per (receiver, queue) and starts it with 4 bytes naming the queue,
+//so a process needs one port for all its receive queues: the main endpoint accepts every
+//connection and hands it to the queue it names. While the sending thread is corked, frames for
+//one connection are collected and written together.
+
+#define TCP_OUT_BUF 16384          //coalesced frames per connection, bigger frames are written directly
+#define TCP_IN_BUF_MIN 16384       //grows up to one whole frame
+#define TCP_EPOLL_EVENTS 64
+#define TCP_MAX_LOCAL_ENDPOINTS 80 //main endpoint and the receive queues of this process
+
+typedef struct{
+    char host[64];
+    int port;                      //0 if the map has no line for this id
+} TcpAddress;
+
+//"<id> <host> <port>" per line, "default <host> <base_port>" puts every id not listed at base_port + id
+static TcpAddress *address_map = NULL;
+static int address_count = 0;
+static char default_host[64] = "";
+static int default_port = 0;
+
+typedef struct{
+    pthread_mutex_t lock;
+    int receiver_id;
+    int queue;
+    int fd;                        //-1 until connected, and again after the receiver went away
+    char *out;                     //frames not written yet, allocated on first use
+    size_t out_len;
+} OutConn;
+
+typedef struct{
+    pthread_mutex_t lock;          //guards the slots, not the connections
+    OutConn **slots;               //queue + 1, slot 0 is the main endpoint
+    int num_slots;
+} TcpPeer;
+
+static TcpPeer *peers = NULL;
+static int num_peers = 0;
+
+static __thread int cork_depth = 0;
+static __thread OutConn **corked = NULL;
+static __thread int num_corked = 0;
+static __thread int corked_cap = 0;
+
+typedef struct{
+    int fd;                        //-1 once the sender closed it, buffered frames are still delivered
+    int known;                     //already in the conns of the endpoint that reads it
+    uint32_t hello;                //queue + 1 in network order, the first 4 bytes the sender writes
+    int hello_len;                 //bytes of it read so far, the main endpoint holds the connection until 4
+    char *buf;
+    size_t cap;
+    size_t start;
+    size_t len;
+} InConn;
+
+typedef struct{
+    int id;
+    int queue;
+    int epoll_fd;                  //what receive_msg is called with
+    int listen_fd;                 //main endpoint only
+    InConn **conns;                //only touched by the thread that reads this endpoint
+    int num_conns;
+    int conns_cap;
+    int next_conn;                 //round robin, one busy sender does not starve the others
+} TcpEndpoint;
+
+//Endpoints are opened before any worker starts, lookups afterwards do not lock
+static TcpEndpoint *endpoints[TCP_MAX_LOCAL_ENDPOINTS];
+static int num_local_endpoints = 0;
+static char listener_tag;          //epoll data of the listening socket
+
+int tcp_load_address_map(const char *path){
+    FILE *f = fopen(path, "r");
+    if(f == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : Could not open address map %s\n", path);
+        return -1;
+    }
+    char line[256];
+    int line_no = 0;
+    while(fgets(line, sizeof(line), f) != NULL){
+        line_no++;
+        char *comment = strchr(line, '#');
+        if(comment != NULL) *comment = '\0';
+
+        char first[32], host[64];
+        int port;
+        int fields = sscanf(line, "%31s %63s %d", first, host, &port);
+        if(fields <= 0) continue;
+        if(fields != 3 || port <= 0 || port > 65535){
+            fprintf(stderr, "[ERROR HAPPENED] : %s line %d is not \"<id> <host> <port>\"\n", path, line_no);
+            fclose(f);
+            return -1;
+        }
+        if(strcmp(first, "default") == 0){
+            snprintf(default_host, sizeof(default_host), "%s", host);
+            default_port = port;
+            continue;
+        }
+        char *end;
+        long id = strtol(first, &end, 10);
+        if(*end != '\0' || id < 0 || id > 1000000){
+            fprintf(stderr, "[ERROR HAPPENED] : %s line %d has no valid endpoint id\n", path, line_no);
+            fclose(f);
+            return -1;
+        }
+        if(id >= address_count){
+            TcpAddress *bigger = realloc(address_map, (id + 1) * sizeof(TcpAddress));
+            if(bigger == NULL){
+                fclose(f);
+                return -1;
+            }
+            memset(bigger + address_count, 0, (id + 1 - address_count) * sizeof(TcpAddress));
+            address_map = bigger;
+            address_count = id + 1;
+        }
+        snprintf(address_map[id].host, sizeof(address_map[id].host), "%s", host);
+        address_map[id].port = port;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int lookup_address(int id, const char **host, int *port){
+    if(id < address_count && address_map[id].port > 0){
+        *host = address_map[id].host;
+        *port = address_map[id].port;
+        return 0;
+    }
+    if(default_port > 0 && default_port + id <= 65535){
+        *host = default_host;
+        *port = default_port + id;
+        return 0;
+    }
+    fprintf(stderr, "[ERROR HAPPENED] : The address map has no entry for endpoint %d\n", id);
+    return -1;
+}
+
+static int send_all(int fd, const void *data, size_t len, int flags){
+    const char *p = data;
+    while(len > 0){
+        ssize_t n = send(fd, p, len, flags | MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int tcp_reserve(int count){
+    if(peers != NULL) return count <= num_peers ? 0 : -1;
+    peers = calloc(count, sizeof(TcpPeer));
+    if(peers == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : Could not allocate %d TCP peers\n", count);
+        return -1;
+    }
+    for(int i = 0; i < count; i++){
+        pthread_mutex_init(&peers[i].lock, NULL);
+    }
+    num_peers = count;
+    return 0;
+}
+
+//A refused connection is not reported, like a datagram to a socket that is not bound yet
+static int connect_endpoint(int receiver_id, int queue){
+    const char *host;
+    int port;
+    if(lookup_address(receiver_id, &host, &port) != 0) return -1;
+
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host, port_str, &hints, &res) != 0){
+        fprintf(stderr, "[ERROR HAPPENED] : Could not resolve %s for endpoint %d\n", host, receiver_id);
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) != 0){
+        if(fd >= 0 && errno != ECONNREFUSED){
+            perror("[ERROR HAPPENED] : TCP connect failed");
+        }
+        if(fd >= 0) close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    //Frames are coalesced here already, Nagle would only add latency
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    uint32_t hello = htonl((uint32_t)(queue + 1));
+    if(send_all(fd, &hello, sizeof(hello), 0) != 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static OutConn *get_out_conn(int receiver_id, int queue){
+    if(receiver_id < 0 || receiver_id >= num_peers || queue < -1){
+        fprintf(stderr, "[ERROR HAPPENED] : No endpoint %d, only %d reserved\n", receiver_id, num_peers);
+        return NULL;
+    }
+    TcpPeer *peer = &peers[receiver_id];
+    int slot = queue + 1;
+    pthread_mutex_lock(&peer->lock);
+    if(slot >= peer->num_slots){
+        OutConn **bigger = realloc(peer->slots, (slot + 1) * sizeof(OutConn*));
+        if(bigger == NULL){
+            pthread_mutex_unlock(&peer->lock);
+            return NULL;
+        }
+        memset(bigger + peer->num_slots, 0, (slot + 1 - peer->num_slots) * sizeof(OutConn*));
+        peer->slots = bigger;
+        peer->num_slots = slot + 1;
+    }
+    OutConn *c = peer->slots[slot];
+    if(c == NULL){
+        c = calloc(1, sizeof(OutConn));
+        if(c != NULL){
+            pthread_mutex_init(&c->lock, NULL);
+            c->receiver_id = receiver_id;
+            c->queue = queue;
+            c->fd = -1;
+            peer->slots[slot] = c;
+        }
+    }
+    pthread_mutex_unlock(&peer->lock);
+    return c;
+}
+
+//Receivers never write back, so a readable connection was closed by a receiver that died.
+//Writing into it would still succeed locally and the message would be lost, a re-spawned
+//receiver listening on the same port gets a new connection instead.
+static int ensure_connected(OutConn *c){
+    if(c->fd >= 0){
+        struct pollfd pfd = {c->fd, POLLIN | POLLRDHUP, 0};
+        if(poll(&pfd, 1, 0) != 0){
+            close(c->fd);
+            c->fd = -1;
+        }
+    }
+    if(c->fd < 0){
+        c->fd = connect_endpoint(c->receiver_id, c->queue);
+    }
+    return c->fd >= 0 ? 0 : -1;
+}
+
+//A failed write drops the connection and what was buffered for it, the next send connects again
+static int flush_conn_locked(OutConn *c){
+    if(c->out_len == 0) return 0;
+    int rc = ensure_connected(c) == 0 ? send_all(c->fd, c->out, c->out_len, 0) : -1;
+    c->out_len = 0;
+    if(rc != 0 && c->fd >= 0){
+        close(c->fd);
+        c->fd = -1;
+    }
+    return rc;
+}
+
+static void remember_corked(OutConn *c){
+    for(int i = 0; i < num_corked; i++){
+        if(corked[i] == c) return;
+    }
+    if(num_corked == corked_cap){
+        int cap = corked_cap > 0 ? corked_cap * 2 : 16;
+        OutConn **bigger = realloc(corked, cap * sizeof(OutConn*));
+        if(bigger == NULL){
+            flush_conn_locked(c);
+            return;
+        }
+        corked = bigger;
+        corked_cap = cap;
+    }
+    corked[num_corked++] = c;
+}
+
+static int tcp_send(int receiver_id, int queue, const void *data, size_t len){
+    OutConn *c = get_out_conn(receiver_id, queue);
+    if(c == NULL) return -1;
+
+    pthread_mutex_lock(&c->lock);
+    //Refused right away like a datagram, the liveness check waits for the flush
+    if(c->fd < 0 && ensure_connected(c) != 0){
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    uint32_t header = htonl((uint32_t)len);
+    int rc = 0;
+    if(c->out_len + sizeof(header) + len > TCP_OUT_BUF){
+        rc = flush_conn_locked(c);
+    }
+    if(rc == 0 && sizeof(header) + len > TCP_OUT_BUF){
+        rc = ensure_connected(c);
+        if(rc == 0) rc = send_all(c->fd, &header, sizeof(header), MSG_MORE);
+        if(rc == 0) rc = send_all(c->fd, data, len, 0);
+        if(rc != 0 && c->fd >= 0){
+            close(c->fd);
+            c->fd = -1;
+        }
+    } else if(rc == 0){
+        if(c->out == NULL && (c->out = malloc(TCP_OUT_BUF)) == NULL){
+            pthread_mutex_unlock(&c->lock);
+            return -1;
+        }
+        memcpy(c->out + c->out_len, &header, sizeof(header));
+        memcpy(c->out + c->out_len + sizeof(header), data, len);
+        c->out_len += sizeof(header) + len;
+        if(cork_depth == 0){
+            rc = flush_conn_locked(c);
+        } else {
+            remember_corked(c);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+static void tcp_cork(){
+    cork_depth++;
+}
+
+static void tcp_uncork(){
+    if(cork_depth == 0 || --cork_depth > 0) return;
+    for(int i = 0; i < num_corked; i++){
+        pthread_mutex_lock(&corked[i]->lock);
+        flush_conn_locked(corked[i]);
+        pthread_mutex_unlock(&corked[i]->lock);
+    }
+    num_corked = 0;
+}
+
+static TcpEndpoint *find_endpoint(int epoll_fd){
+    int count = __atomic_load_n(&num_local_endpoints, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < count; i++){
+        if(endpoints[i] != NULL && endpoints[i]->epoll_fd == epoll_fd) return endpoints[i];
+    }
+    return NULL;
+}
+
+static TcpEndpoint *find_queue_endpoint(int id, int queue){
+    int count = __atomic_load_n(&num_local_endpoints, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < count; i++){
+        if(endpoints[i] != NULL && endpoints[i]->id == id && endpoints[i]->queue == queue) return endpoints[i];
+    }
+    return NULL;
+}
+
+//Only the main endpoint listens, queue endpoints get their connections from it
+static int tcp_open_endpoint(int id, int queue){
+    if(num_local_endpoints == TCP_MAX_LOCAL_ENDPOINTS){
+        fprintf(stderr, "[ERROR HAPPENED] : Too many TCP endpoints in process %d\n", id);
+        exit(EXIT_FAILURE);
+    }
+    TcpEndpoint *ep = calloc(1, sizeof(TcpEndpoint));
+    if(ep == NULL || (ep->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+        perror("[ERROR HAPPENED] : Error happened when creating the TCP endpoint");
+        exit(EXIT_FAILURE);
+    }
+    ep->id = id;
+    ep->queue = queue;
+    ep->listen_fd = -1;
+
+    if(queue < 0){
+        const char *host;
+        int port;
+        if(lookup_address(id, &host, &port) != 0) exit(EXIT_FAILURE);
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons((uint16_t)port);
+        int one = 1;
+        ep->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        //A re-spawned process binds the port of its predecessor while old connections are in TIME_WAIT
+        if(ep->listen_fd < 0 || setsockopt(ep->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+           bind(ep->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(ep->listen_fd, SOMAXCONN) < 0){
+            perror("[ERROR HAPPENED] : Error happened when binding the TCP endpoint");
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &listener_tag;
+        epoll_ctl(ep->epoll_fd, EPOLL_CTL_ADD, ep->listen_fd, &ev);
+        printf("[SUCCESS] : Endpoint %d listening on %s:%d\n", id, host, port);
+    }
+    endpoints[num_local_endpoints] = ep;
+    __atomic_store_n(&num_local_endpoints, num_local_endpoints + 1, __ATOMIC_RELEASE);
+    return ep->epoll_fd;
+}
+
+//New connections wait on the main endpoint's epoll until their hello arrived, nothing blocks on a slow sender
+static void accept_connections(TcpEndpoint *ep){
+    while(1){
+        int fd = accept4(ep->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) return;
+
+        InConn *c = calloc(1, sizeof(InConn));
+        if(c == NULL){
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &ipc_receive_buffer, sizeof(ipc_receive_buffer));
+        c->fd = fd;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if(epoll_ctl(ep->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0){
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+//A connection without its whole hello is in no conns list yet, so it is freed right away
+static void drop_new_conn(TcpEndpoint *ep, InConn *c){
+    epoll_ctl(ep->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c);
+}
+
+//Reads what is there of the hello. Returns 1 once it names the main endpoint, which reads the
+//connection from then on. A connection for a receive queue moves to that queue's epoll.
+static int read_hello(TcpEndpoint *ep, InConn *c){
+    ssize_t n = recv(c->fd, (char*)&c->hello + c->hello_len, sizeof(c->hello) - c->hello_len, 0);
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    if(n <= 0){
+        drop_new_conn(ep, c);
+        return 0;
+    }
+    c->hello_len += (int)n;
+    if(c->hello_len < (int)sizeof(c->hello)) return 0;
+
+    int queue = (int)ntohl(c->hello) - 1;
+    TcpEndpoint *target = queue < 0 ? ep : find_queue_endpoint(ep->id, queue);
+    if(target == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : Endpoint %d has no receive queue %d\n", ep->id, queue);
+        drop_new_conn(ep, c);
+        return 0;
+    }
+    if(target == ep) return 1;
+
+    //The reader of the target endpoint takes it over with its first event
+    epoll_ctl(ep->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if(epoll_ctl(target->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) != 0){
+        close(c->fd);
+        free(c);
+    }
+    return 0;
+}
+
+static void add_conn(TcpEndpoint *ep, InConn *c){
+    if(ep->num_conns == ep->conns_cap){
+        int cap = ep->conns_cap > 0 ? ep->conns_cap * 2 : 16;
+        InConn **bigger = realloc(ep->conns, cap * sizeof(InConn*));
+        if(bigger == NULL) return;
+        ep->conns = bigger;
+        ep->conns_cap = cap;
+    }
+    ep->conns[ep->num_conns++] = c;
+    c->known = 1;
+}
+
+static void close_in_conn(TcpEndpoint *ep, InConn *c){
+    epoll_ctl(ep->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+//Reads what the socket has, the buffer grows until the next frame fits
+static void fill_conn(TcpEndpoint *ep, InConn *c){
+    while(c->fd >= 0){
+        if(c->start > 0){
+            memmove(c->buf, c->buf + c->start, c->len);
+            c->start = 0;
+        }
+        size_t need = TCP_IN_BUF_MIN;
+        if(c->len >= sizeof(uint32_t)){
+            uint32_t frame_len;
+            memcpy(&frame_len, c->buf, sizeof(frame_len));
+            frame_len = ntohl(frame_len);
+            if(frame_len > MAX_DATAGRAM_SIZE){
+                fprintf(stderr, "[ERROR HAPPENED] : Endpoint %d got a %u byte frame, closing the connection\n", ep->id, frame_len);
+                c->len = 0;
+                close_in_conn(ep, c);
+                return;
+            }
+            if(sizeof(frame_len) + frame_len > need) need = sizeof(frame_len) + frame_len;
+        }
+        if(c->cap < need){
+            char *bigger = realloc(c->buf, need);
+            if(bigger == NULL) return;
+            c->buf = bigger;
+            c->cap = need;
+        }
+        if(c->len == c->cap) return;  //full of whole frames, epoll reports the rest again
+
+        ssize_t n = recv(c->fd, c->buf + c->len, c->cap - c->len, 0);
+        if(n > 0){
+            c->len += (size_t)n;
+        } else if(n < 0 && errno == EINTR){
+            continue;
+        } else {
+            if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+                close_in_conn(ep, c);
+            }
+            return;
+        }
+    }
+}
+
+//Next whole frame of any connection, -1 if none is complete
+static int next_frame(TcpEndpoint *ep, char *buf, size_t buf_size){
+    for(int k = 0; k < ep->num_conns; k++){
+        int i = (ep->next_conn + k) % ep->num_conns;
+        InConn *c = ep->conns[i];
+        if(c->len < sizeof(uint32_t)) continue;
+        uint32_t frame_len;
+        memcpy(&frame_len, c->buf + c->start, sizeof(frame_len));
+        frame_len = ntohl(frame_len);
+        if(c->len < sizeof(frame_len) + frame_len) continue;
+
+        //Like recv on a datagram socket, what does not fit is cut off
+        size_t n = frame_len < buf_size - 1 ? frame_len : buf_size - 1;
+        memcpy(buf, c->buf + c->start + sizeof(frame_len), n);
+        buf[n] = '\0';
+        c->start += sizeof(frame_len) + frame_len;
+        c->len -= sizeof(frame_len) + frame_len;
+        if(c->len == 0) c->start = 0;
+        ep->next_conn = (i + 1) % ep->num_conns;
+        return (int)n;
+    }
+    return -1;
+}
+
+//Connections the sender closed are freed once their last whole frame was delivered
+static void sweep_closed(TcpEndpoint *ep){
+    for(int i = 0; i < ep->num_conns; ){
+        InConn *c = ep->conns[i];
+        if(c->fd >= 0){
+            i++;
+            continue;
+        }
+        free(c->buf);
+        free(c);
+        ep->conns[i] = ep->conns[--ep->num_conns];
+    }
+    ep->next_conn = 0;
+}
+
+static int tcp_receive(int fd, char *buf, size_t buf_size){
+    TcpEndpoint *ep = find_endpoint(fd);
+    if(ep == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : %d is not a TCP endpoint\n", fd);
+        return -1;
+    }
+    int n = next_frame(ep, buf, buf_size);
+    if(n >= 0) return n;
+
+    struct epoll_event events[TCP_EPOLL_EVENTS];
+    int ready = epoll_wait(ep->epoll_fd, events, TCP_EPOLL_EVENTS, 0);
+    int closed = 0;
+    for(int i = 0; i < ready; i++){
+        if(events[i].data.ptr == &listener_tag){
+            accept_connections(ep);
+            continue;
+        }
+        InConn *c = events[i].data.ptr;
+        if(c->hello_len < (int)sizeof(c->hello) && !read_hello(ep, c)) continue;
+        if(!c->known) add_conn(ep, c);
+        fill_conn(ep, c);
+        closed |= c->fd < 0;
+    }
+    n = next_frame(ep, buf, buf_size);
+    if(n < 0 && closed) sweep_closed(ep);
+    return n >= 0 ? n : 0;
+}
+
+static void tcp_close_endpoint(int id, int queue, int fd){
+    (void)id;
+    (void)queue;
+    TcpEndpoint *ep = find_endpoint(fd);
+    if(ep == NULL) return;
+    for(int i = 0; i < ep->num_conns; i++){
+        if(ep->conns[i]->fd >= 0) close(ep->conns[i]->fd);
+        ep->conns[i]->fd = -1;
+    }
+    if(ep->listen_fd >= 0) close(ep->listen_fd);
+    ep->listen_fd = -1;
+    close(ep->epoll_fd);
+    ep->epoll_fd = -1;
+}
+
+//Also called from signal handlers, so the connection locks are not taken
+static void tcp_close_senders(){
+    for(int p = 0; p < num_peers; p++){
+        for(int s = 0; s < peers[p].num_slots; s++){
+            OutConn *c = peers[p].slots[s];
+            if(c != NULL && c->fd >= 0){
+                close(c->fd);
+                c->fd = -1;
+            }
+        }
+    }
+}
+
+const Transport tcp_transport = {
+    "TCP",
+    tcp_reserve,
+    tcp_open_endpoint,
+    tcp_send,
+    tcp_receive,
+    tcp_close_endpoint,
+    tcp_close_senders,
+    tcp_cork,
+    tcp_uncork
+};
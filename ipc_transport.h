@@ -0,0 +1,34 @@
+#ifndef IPC_TRANSPORT_H
+#define IPC_TRANSPORT_H
+#include <stddef.h>
+#include <sys/un.h>
+
+//What IPC.c needs from a transport. Endpoint ids are process ids, the manager is num_processes.
+//queue < 0 is the main endpoint of a process, queue >= 0 one of its receive queues.
+//Unix datagrams live in IPC.c and stay the default, ipc_tcp.c carries the same messages over TCP,
+//ipc_uring.c the unix datagrams through io_uring.
+typedef struct{
+    const char *name;
+    int (*reserve)(int count);                       //sender table for count endpoints
+    int (*open_endpoint)(int id, int queue);         //returns the fd receive_msg is called with
+    int (*send)(int receiver_id, int queue, const void *data, size_t len);
+    int (*receive)(int fd, char *buf, size_t buf_size);
+    void (*close_endpoint)(int id, int queue, int fd);
+    void (*close_senders)();
+    void (*cork)();                                  //NULL if every send goes out right away
+    void (*uncork)();
+} Transport;
+
+extern int ipc_receive_buffer;
+extern const Transport unix_transport;
+extern const Transport tcp_transport;
+extern const Transport uring_transport;
+int tcp_load_address_map(const char *path);
+int uring_available();
+
+//The unix datagram pieces ipc_uring.c drives through io_uring
+int unix_sender_socket(int receiver_id);
+void unix_endpoint_address(struct sockaddr_un *addr, int id, int queue);
+int unix_send_error(int receiver_id, int err);
+
+#endif
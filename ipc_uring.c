@@ -0,0 +1,445 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "IPC.h"
+#include "ipc_transport.h"
+
+//Unix datagrams driven through io_uring, with the three system calls and the ring layout from the
+//kernel header (no liburing needed).
+//Receive: the thread that reads an endpoint gives it a ring with one multishot recv on the socket
+//and a ring of provided buffers the kernel fills. receive_msg takes datagrams straight from the
+//completion queue and only enters the kernel when that is empty, so one system call reaps every
+//datagram that arrived since the last one.
+//Send: while a thread is corked its datagrams become sendmsg entries on its own ring, uncork
+//submits all of them and waits for them in one system call. Uncorked sends stay plain sendto.
+
+#define URING_RECV_ENTRIES 16          //twice as many completions, one per buffer and the ENOBUFS that ends the recv
+#define URING_RECV_BUFFERS 16          //datagrams the kernel holds for us, the rest waits in the socket
+#define URING_RECV_BUFFER_SIZE 65536   //one whole datagram, MAX_DATAGRAM_SIZE rounded up
+#define URING_BUFFER_GROUP 0
+#define URING_SEND_ENTRIES 64          //corked datagrams per submission
+#define URING_STAGE_SIZE 1048576       //copies of corked datagrams until they are sent
+#define URING_MAX_ENDPOINTS 80         //main endpoint and the receive queues of this process
+
+typedef struct{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;                 //entries filled in, the kernel sees them at the next enter
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+} Ring;
+
+enum{ URING_NEW, URING_READY, URING_PLAIN };
+
+typedef struct{
+    int fd;                            //the socket, what receive_msg is called with
+    int state;                         //URING_PLAIN: this endpoint stays on recv
+    int armed;                         //the multishot recv is still running
+    Ring ring;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    unsigned short buf_tail;
+} UringEndpoint;
+
+//Endpoints are opened before any worker starts, lookups afterwards do not lock
+static UringEndpoint *endpoints[URING_MAX_ENDPOINTS];
+static int num_local_endpoints = 0;
+
+typedef struct{
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_un addr;
+    int receiver_id;
+} StagedSend;
+
+static __thread Ring send_ring;
+static __thread int send_state = URING_NEW;
+static __thread int cork_depth = 0;
+static __thread StagedSend *staged = NULL;
+static __thread int num_staged = 0;
+static __thread char *stage = NULL;
+static __thread size_t stage_used = 0;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p){
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args){
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_free(Ring *r){
+    if(r->sqes != NULL && r->sqes != MAP_FAILED) munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    if(r->cq_map != NULL && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_size);
+    if(r->sq_map != NULL && r->sq_map != MAP_FAILED) munmap(r->sq_map, r->sq_map_size);
+    if(r->fd >= 0) close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+//Has to be called by the thread that uses the ring, completions only show up when it enters
+static int ring_init(Ring *r, unsigned entries){
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    r->fd = sys_io_uring_setup(entries, &p);
+    if(r->fd < 0 && errno == EINVAL){
+        //Kernels before 6.1 post completions from the network stack instead
+        memset(&p, 0, sizeof(p));
+        r->fd = sys_io_uring_setup(entries, &p);
+    }
+    if(r->fd < 0) return -1;
+
+    r->sq_entries = p.sq_entries;
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        if(r->cq_map_size > r->sq_map_size) r->sq_map_size = r->cq_map_size;
+        r->cq_map_size = r->sq_map_size;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_map == MAP_FAILED){
+        ring_free(r);
+        return -1;
+    }
+    r->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_map :
+                mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED){
+        ring_free(r);
+        return -1;
+    }
+
+    char *sq = r->sq_map;
+    char *cq = r->cq_map;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r->sqe_tail = *r->sq_tail;
+    return 0;
+}
+
+//NULL if the submission queue is full
+static struct io_uring_sqe *ring_get_sqe(Ring *r){
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if(r->sqe_tail - head >= r->sq_entries) return NULL;
+    unsigned index = r->sqe_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    r->sqe_tail++;
+    return sqe;
+}
+
+//Submits what was filled in and waits until min_complete completions are there
+static int ring_enter(Ring *r, unsigned min_complete){
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    while(1){
+        //Without SQPOLL the kernel only takes entries here, what it has not taken yet is still queued
+        unsigned to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        int ret = sys_io_uring_enter(r->fd, to_submit, min_complete, IORING_ENTER_GETEVENTS);
+        if(ret >= 0 || errno != EINTR) return ret;
+    }
+}
+
+static struct io_uring_cqe *ring_peek_cqe(Ring *r){
+    unsigned head = *r->cq_head;
+    if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+static void ring_advance_cq(Ring *r){
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+//Provided buffer rings came with 5.19, everything used here is at least that old
+int uring_available(){
+    Ring r;
+    if(ring_init(&r, 2) != 0) return -1;
+
+    void *probe_ring = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int ok = 0;
+    if(probe_ring != MAP_FAILED){
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)probe_ring;
+        reg.ring_entries = 1;
+        reg.bgid = URING_BUFFER_GROUP;
+        ok = sys_io_uring_register(r.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+    }
+    ring_free(&r);
+    if(probe_ring != MAP_FAILED) munmap(probe_ring, 4096);
+    return ok ? 0 : -1;
+}
+
+//The tail shares its bytes with the first buffer, so the entries are written field by field
+static void give_buffer(UringEndpoint *ep, unsigned short bid){
+    struct io_uring_buf *b = &ep->buf_ring->bufs[ep->buf_tail & (URING_RECV_BUFFERS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(ep->buffers + (size_t)bid * URING_RECV_BUFFER_SIZE);
+    b->len = URING_RECV_BUFFER_SIZE;
+    b->bid = bid;
+    ep->buf_tail++;
+    __atomic_store_n(&ep->buf_ring->tail, ep->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int endpoint_setup(UringEndpoint *ep){
+    if(ring_init(&ep->ring, URING_RECV_ENTRIES) != 0) return -1;
+
+    ep->buf_ring = mmap(NULL, URING_RECV_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ep->buffers = mmap(NULL, (size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ep->buf_ring;
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if(ep->buf_ring == MAP_FAILED || ep->buffers == MAP_FAILED ||
+       sys_io_uring_register(ep->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0){
+        if(ep->buf_ring != MAP_FAILED) munmap(ep->buf_ring, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+        if(ep->buffers != MAP_FAILED) munmap(ep->buffers, (size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+        ep->buf_ring = NULL;
+        ep->buffers = NULL;
+        ring_free(&ep->ring);
+        return -1;
+    }
+    for(unsigned short bid = 0; bid < URING_RECV_BUFFERS; bid++){
+        give_buffer(ep, bid);
+    }
+    return 0;
+}
+
+//Keeps posting one completion per datagram until the buffers run out
+static int arm_recv(UringEndpoint *ep){
+    struct io_uring_sqe *sqe = ring_get_sqe(&ep->ring);
+    if(sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = ep->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    ep->armed = 1;
+    return 0;
+}
+
+static UringEndpoint *find_endpoint(int fd){
+    int count = __atomic_load_n(&num_local_endpoints, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < count; i++){
+        if(endpoints[i] != NULL && endpoints[i]->fd == fd) return endpoints[i];
+    }
+    return NULL;
+}
+
+static int uring_open_endpoint(int id, int queue){
+    int fd = unix_transport.open_endpoint(id, queue);
+    UringEndpoint *ep = num_local_endpoints < URING_MAX_ENDPOINTS ? calloc(1, sizeof(UringEndpoint)) : NULL;
+    if(ep == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : Endpoint %d queue %d stays on plain recv\n", id, queue);
+        return fd;
+    }
+    ep->fd = fd;
+    ep->state = URING_NEW;
+    ep->ring.fd = -1;
+    endpoints[num_local_endpoints] = ep;
+    __atomic_store_n(&num_local_endpoints, num_local_endpoints + 1, __ATOMIC_RELEASE);
+    return fd;
+}
+
+static int uring_receive(int fd, char *buf, size_t buf_size){
+    UringEndpoint *ep = find_endpoint(fd);
+    if(ep == NULL || ep->state == URING_PLAIN){
+        return unix_transport.receive(fd, buf, buf_size);
+    }
+    if(ep->state == URING_NEW){
+        if(endpoint_setup(ep) != 0){
+            fprintf(stderr, "[ERROR HAPPENED] : No io_uring for socket %d, it stays on plain recv\n", fd);
+            ep->state = URING_PLAIN;
+            return unix_transport.receive(fd, buf, buf_size);
+        }
+        ep->state = URING_READY;
+    }
+
+    for(int entered = 0; ; entered = 1){
+        struct io_uring_cqe *cqe;
+        while((cqe = ring_peek_cqe(&ep->ring)) != NULL){
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring_advance_cq(&ep->ring);
+            if(!(flags & IORING_CQE_F_MORE)) ep->armed = 0;
+
+            if(res < 0){
+                //ENOBUFS: every buffer holds a datagram, the recv is armed again once they are read
+                if(res == -EINVAL){
+                    fprintf(stderr, "[ERROR HAPPENED] : The kernel has no multishot recv, socket %d stays on plain recv\n", fd);
+                    ep->state = URING_PLAIN;
+                    return unix_transport.receive(fd, buf, buf_size);
+                }
+                if(res != -ENOBUFS){
+                    errno = -res;
+                    perror("[ERROR HAPPENED] : When receiving a message");
+                }
+                continue;
+            }
+            if(!(flags & IORING_CQE_F_BUFFER)) continue;
+
+            unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            size_t n = (size_t)res < buf_size - 1 ? (size_t)res : buf_size - 1;
+            memcpy(buf, ep->buffers + (size_t)bid * URING_RECV_BUFFER_SIZE, n);
+            buf[n] = '\0';
+            give_buffer(ep, bid);
+            return (int)n;
+        }
+        if(entered) return 0;
+        if(!ep->armed && arm_recv(ep) != 0) return 0;
+        if(ring_enter(&ep->ring, 0) < 0){
+            perror("[ERROR HAPPENED] : io_uring_enter failed when receiving");
+            return -1;
+        }
+    }
+}
+
+static int send_ring_ready(){
+    if(send_state == URING_NEW){
+        staged = malloc(URING_SEND_ENTRIES * sizeof(StagedSend));
+        stage = malloc(URING_STAGE_SIZE);
+        if(staged == NULL || stage == NULL || ring_init(&send_ring, URING_SEND_ENTRIES) != 0){
+            fprintf(stderr, "[ERROR HAPPENED] : No io_uring for sending, this thread stays on sendto\n");
+            free(staged);
+            free(stage);
+            staged = NULL;
+            stage = NULL;
+            send_state = URING_PLAIN;
+        } else {
+            send_state = URING_READY;
+        }
+    }
+    return send_state == URING_READY ? 0 : -1;
+}
+
+//Submits every staged datagram and reaps all of their completions with as few entries as it takes
+static void flush_staged(){
+    int reaped = 0;
+
+    while(reaped < num_staged){
+        //EBUSY: the completion queue is full, it is emptied below before entering again
+        if(ring_enter(&send_ring, (unsigned)(num_staged - reaped)) < 0 && errno != EBUSY){
+            perror("[ERROR HAPPENED] : io_uring_enter failed when sending");
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        while((cqe = ring_peek_cqe(&send_ring)) != NULL){
+            if(cqe->res < 0 && cqe->user_data < (uint64_t)num_staged){
+                unix_send_error(staged[cqe->user_data].receiver_id, -cqe->res);
+            }
+            ring_advance_cq(&send_ring);
+            reaped++;
+        }
+    }
+    num_staged = 0;
+    stage_used = 0;
+}
+
+static int uring_send(int receiver_id, int queue, const void *data, size_t len){
+    if(cork_depth == 0 || send_ring_ready() != 0){
+        return unix_transport.send(receiver_id, queue, data, len);
+    }
+    int sock = unix_sender_socket(receiver_id);
+    if(sock < 0) return -1;
+    if(num_staged == URING_SEND_ENTRIES || stage_used + len > URING_STAGE_SIZE){
+        flush_staged();
+    }
+    struct io_uring_sqe *sqe = ring_get_sqe(&send_ring);
+    if(sqe == NULL){
+        return unix_transport.send(receiver_id, queue, data, len);
+    }
+
+    //The kernel may read the datagram after we return, so it is copied until the flush
+    StagedSend *s = &staged[num_staged];
+    memcpy(stage + stage_used, data, len);
+    unix_endpoint_address(&s->addr, receiver_id, queue);
+    s->iov.iov_base = stage + stage_used;
+    s->iov.iov_len = len;
+    memset(&s->msg, 0, sizeof(s->msg));
+    s->msg.msg_name = &s->addr;
+    s->msg.msg_namelen = sizeof(s->addr);
+    s->msg.msg_iov = &s->iov;
+    s->msg.msg_iovlen = 1;
+    s->receiver_id = receiver_id;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)&s->msg;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)num_staged;
+    stage_used += len;
+    num_staged++;
+    return 0;
+}
+
+static void uring_cork(){
+    cork_depth++;
+}
+
+static void uring_uncork(){
+    if(cork_depth == 0 || --cork_depth > 0) return;
+    if(num_staged > 0) flush_staged();
+}
+
+static int uring_reserve(int count){
+    return unix_transport.reserve(count);
+}
+
+//Also called from signal handlers, the rings are only closed
+static void uring_close_endpoint(int id, int queue, int fd){
+    UringEndpoint *ep = find_endpoint(fd);
+    if(ep != NULL && ep->ring.fd >= 0){
+        close(ep->ring.fd);
+        ep->ring.fd = -1;
+        ep->state = URING_PLAIN;
+    }
+    unix_transport.close_endpoint(id, queue, fd);
+}
+
+static void uring_close_senders(){
+    unix_transport.close_senders();
+}
+
+const Transport uring_transport = {
+    "unix datagram sockets over io_uring",
+    uring_reserve,
+    uring_open_endpoint,
+    uring_send,
+    uring_receive,
+    uring_close_endpoint,
+    uring_close_senders,
+    uring_cork,
+    uring_uncork
+};
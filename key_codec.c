@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "key_codec.h"
+
+static int compare_keys(const void *a, const void *b){
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+void key_codec_sort(uint32_t *keys, int count){
+    qsort(keys, count, sizeof(uint32_t), compare_keys);
+}
+
+//Encodes as many keys as fit in out_size, returns how many were taken.
+//Every call starts a new self contained block, so a receiver can decode datagrams in any order.
+int key_codec_encode(const uint32_t *sorted_keys, int count, uint8_t *out, size_t out_size, size_t *out_len){
+    size_t pos = 0;
+    int encoded = 0;
+
+    if(count <= 0 || out_size < sizeof(uint32_t)){
+        *out_len = 0;
+        return 0;
+    }
+
+    memcpy(out, &sorted_keys[0], sizeof(uint32_t));
+    pos = sizeof(uint32_t);
+    encoded = 1;
+
+    while(encoded < count && pos + KEY_CODEC_MAX_VARINT <= out_size){
+        uint32_t gap = sorted_keys[encoded] - sorted_keys[encoded - 1];
+        while(gap >= 0x80){
+            out[pos++] = (uint8_t)(gap | 0x80);
+            gap >>= 7;
+        }
+        out[pos++] = (uint8_t)gap;
+        encoded++;
+    }
+
+    *out_len = pos;
+    return encoded;
+}
+
+//Returns the number of keys written, -1 if the block is cut off or holds more than max_keys
+int key_codec_decode(const uint8_t *in, size_t in_len, uint32_t *keys, int max_keys){
+    size_t pos = 0;
+    int decoded = 0;
+
+    if(in_len == 0) return 0;
+    if(in_len < sizeof(uint32_t) || max_keys < 1) return -1;
+
+    uint32_t key;
+    memcpy(&key, in, sizeof(uint32_t));
+    pos = sizeof(uint32_t);
+    keys[decoded++] = key;
+
+    while(pos < in_len){
+        uint32_t gap = 0;
+        int shift = 0;
+        while(1){
+            if(pos >= in_len || shift > 28) return -1;
+            uint8_t byte = in[pos++];
+            gap |= (uint32_t)(byte & 0x7f) << shift;
+            if((byte & 0x80) == 0) break;
+            shift += 7;
+        }
+        if(decoded >= max_keys) return -1;
+        key += gap;
+        keys[decoded++] = key;
+    }
+    return decoded;
+}
@@ -0,0 +1,16 @@
+#ifndef KEY_CODEC_H
+#define KEY_CODEC_H
+#include <stdint.h>
+#include <stddef.h>
+
+//Binary form of a sorted key list: the first key as 4 raw bytes, then the gap to the
+//previous key as a varint (7 bits per byte, high bit means more bytes follow).
+//Dense random keys mostly need 2 bytes per key instead of ~9 characters of ASCII.
+
+#define KEY_CODEC_MAX_VARINT 5
+
+void key_codec_sort(uint32_t *keys, int count);
+int key_codec_encode(const uint32_t *sorted_keys, int count, uint8_t *out, size_t out_size, size_t *out_len);
+int key_codec_decode(const uint8_t *in, size_t in_len, uint32_t *keys, int max_keys);
+
+#endif
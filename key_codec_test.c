@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "key_codec.h"
+#include "test_check.h"
+
+#define NUM_KEYS 50000
+
+//Encodes all keys in blocks of out_size and decodes the blocks last to first, every block stands alone.
+//Returns the number of blocks, -1 if the decoded keys differ.
+static int round_trip(const uint32_t *keys, int count, size_t out_size){
+    uint8_t *block = malloc(out_size);
+    uint32_t *decoded = malloc(count * sizeof(uint32_t));
+    int *starts = malloc((count + 1) * sizeof(int));
+    uint8_t **blocks = malloc((count + 1) * sizeof(uint8_t*));
+    size_t *lengths = malloc((count + 1) * sizeof(size_t));
+    int num_blocks = 0;
+    int ok = 1;
+
+    for(int done = 0; done < count; ){
+        size_t len;
+        int taken = key_codec_encode(keys + done, count - done, block, out_size, &len);
+        if(taken <= 0 || len > out_size){
+            ok = 0;
+            break;
+        }
+        starts[num_blocks] = done;
+        blocks[num_blocks] = malloc(len);
+        memcpy(blocks[num_blocks], block, len);
+        lengths[num_blocks++] = len;
+        done += taken;
+    }
+    starts[num_blocks] = count;
+    for(int b = num_blocks - 1; ok && b >= 0; b--){
+        int expected = starts[b + 1] - starts[b];
+        int n = key_codec_decode(blocks[b], lengths[b], decoded + starts[b], expected);
+        ok = n == expected && memcmp(decoded + starts[b], keys + starts[b], expected * sizeof(uint32_t)) == 0;
+    }
+    for(int b = 0; b < num_blocks; b++){
+        free(blocks[b]);
+    }
+    free(block);
+    free(decoded);
+    free(starts);
+    free(blocks);
+    free(lengths);
+    return ok ? num_blocks : -1;
+}
+
+//Round trips sorted key lists with duplicates, both ends of the range and gaps of every varint
+//length through small and datagram sized blocks, and checks that cut-off blocks are refused.
+int main(){
+    uint32_t *keys = malloc(NUM_KEYS * sizeof(uint32_t));
+    srand(11);
+    for(int i = 0; i < NUM_KEYS; i++){
+        switch(i % 4){
+        case 0: keys[i] = (uint32_t)rand() * 2654435761u; break;   //whole range, long gaps
+        case 1: keys[i] = (uint32_t)(rand() % 100000); break;      //dense, 1 and 2 byte gaps
+        case 2: keys[i] = keys[i - 1]; break;                      //duplicate, gap 0
+        default: keys[i] = (uint32_t)rand() % 1000 + 0x7fffff00u; break;
+        }
+    }
+    keys[0] = 0;
+    keys[NUM_KEYS - 1] = 0xffffffffu;
+    key_codec_sort(keys, NUM_KEYS);
+    check(keys[0] == 0 && keys[NUM_KEYS - 1] == 0xffffffffu, "sort keeps both ends");
+
+    int blocks = round_trip(keys, NUM_KEYS, 1000);
+    check(blocks > 1, "small blocks round trip");
+    check(round_trip(keys, NUM_KEYS, 65000) > 0, "datagram sized blocks round trip");
+    check(round_trip(keys, 1, 4) == 1, "single key block round trip");
+    printf("Round tripped %d keys in %d small blocks\n", NUM_KEYS, blocks);
+
+    //One gap of every varint length, the last one needs all 5 bytes
+    uint32_t spread[] = {5, 5 + 100, 5 + 100 + 300, 5 + 100 + 300 + 70000, 5 + 100 + 300 + 70000 + 3000000, 0xfffffff0u};
+    int num_spread = (int)(sizeof(spread) / sizeof(spread[0]));
+    uint8_t block[64];
+    uint32_t decoded[16];
+    size_t len;
+    check(key_codec_encode(spread, num_spread, block, sizeof(block), &len) == num_spread && len == 4 + 1 + 2 + 3 + 4 + 5,
+          "gaps take 1 to 5 bytes");
+    check(key_codec_decode(block, len, decoded, 16) == num_spread && memcmp(decoded, spread, sizeof(spread)) == 0,
+          "every varint length decodes");
+
+    //A block cut inside a varint is refused, one cut between varints decodes the keys before it
+    check(key_codec_decode(block, len - 1, decoded, 16) < 0, "block cut inside the last varint is refused");
+    check(key_codec_decode(block, 3, decoded, 16) < 0, "block cut inside the first key is refused");
+    check(key_codec_decode(block, 4 + 1 + 2, decoded, 16) == 3 && memcmp(decoded, spread, 3 * sizeof(uint32_t)) == 0,
+          "block cut between varints decodes the keys before the cut");
+    check(key_codec_decode(block, len, decoded, num_spread - 1) < 0, "block with more than max_keys is refused");
+    uint8_t too_long[] = {0, 0, 0, 0, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01};
+    check(key_codec_decode(too_long, sizeof(too_long), decoded, 16) < 0, "varint longer than 5 bytes is refused");
+
+    //Room for only part of the keys: what was taken decodes, the rest starts the next block
+    int taken = key_codec_encode(spread, num_spread, block, 4 + 1 + 2 + 3 + KEY_CODEC_MAX_VARINT - 1, &len);
+    check(taken == 4 && key_codec_decode(block, len, decoded, 16) == 4, "full block stops at a whole key");
+    check(key_codec_encode(spread, num_spread, block, 3, &len) == 0 && len == 0, "no room for the first key encodes nothing");
+    check(key_codec_encode(spread, 0, block, sizeof(block), &len) == 0 && len == 0, "empty list encodes nothing");
+    check(key_codec_decode(block, 0, decoded, 16) == 0, "empty block decodes to nothing");
+
+    free(keys);
+
+    return test_result("key blocks decode to the encoded keys");
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "key_index.h"
+#include "keyhash.h"
+
+#define KEY_INDEX_EMPTY INT_MIN
+
+//Table is kept at most half full so probe sequences stay short
+int key_index_init(KeyIndex *ki, uint64_t expected_keys){
+    return key_index_init_in(ki, expected_keys, NULL);
+}
+
+int key_index_init_in(KeyIndex *ki, uint64_t expected_keys, Arena *arena){
+    uint64_t capacity = 16;
+    while(capacity < expected_keys * 2){
+        capacity <<= 1;
+    }
+
+    if(arena != NULL){
+        ki->keys = arena_alloc(arena, capacity * sizeof(int));
+        ki->values = arena_alloc(arena, capacity * sizeof(int));
+    } else {
+        ki->keys = malloc(capacity * sizeof(int));
+        ki->values = malloc(capacity * sizeof(int));
+    }
+    if(ki->keys == NULL || ki->values == NULL){
+        fprintf(stderr, "[ERROR HAPPENED] : Failed to allocate key index for %lu keys\n", (unsigned long)expected_keys);
+        if(arena == NULL){
+            free(ki->keys);
+            free(ki->values);
+        }
+        ki->keys = NULL;
+        ki->values = NULL;
+        return -1;
+    }
+    for(uint64_t i = 0; i < capacity; i++){
+        ki->keys[i] = KEY_INDEX_EMPTY;
+    }
+    ki->mask = capacity - 1;
+    ki->count = 0;
+    ki->arena = arena;
+    return 0;
+}
+
+//Arena tables stay mapped until the arena is released
+void key_index_destroy(KeyIndex *ki){
+    if(ki->arena == NULL){
+        free(ki->keys);
+        free(ki->values);
+    }
+    ki->keys = NULL;
+    ki->values = NULL;
+    ki->mask = 0;
+    ki->count = 0;
+}
+
+//Doubles the table once it would get more than half full, keys added at runtime can outgrow the initial size.
+//In an arena the old tables are left behind, which is fine as long as the index is sized from the key count.
+static int key_index_grow(KeyIndex *ki){
+    KeyIndex bigger;
+    if(key_index_init_in(&bigger, ki->mask + 1, ki->arena) != 0) return -1;
+    for(uint64_t i = 0; i <= ki->mask; i++){
+        if(ki->keys[i] != KEY_INDEX_EMPTY){
+            key_index_insert(&bigger, ki->keys[i], ki->values[i]);
+        }
+    }
+    key_index_destroy(ki);
+    *ki = bigger;
+    return 0;
+}
+
+//Inserting a key that is already there overwrites its value
+int key_index_insert(KeyIndex *ki, int key, int value){
+    if(key == KEY_INDEX_EMPTY || ki->keys == NULL) return -1;
+    if((ki->count + 1) * 2 > ki->mask + 1 && key_index_grow(ki) != 0){
+        fprintf(stderr, "[ERROR HAPPENED] : Key index is full (%lu keys)\n", (unsigned long)ki->count);
+        return -1;
+    }
+
+    uint64_t pos = key_hash64((uint64_t)(uint32_t)key) & ki->mask;
+    while(ki->keys[pos] != KEY_INDEX_EMPTY && ki->keys[pos] != key){
+        pos = (pos + 1) & ki->mask;
+    }
+    if(ki->keys[pos] == KEY_INDEX_EMPTY){
+        ki->keys[pos] = key;
+        ki->count++;
+    }
+    ki->values[pos] = value;
+    return 0;
+}
+
+//Returns the stored value or -1 if the key is not in the index
+int key_index_find(const KeyIndex *ki, int key){
+    if(key == KEY_INDEX_EMPTY || ki->keys == NULL) return -1;
+
+    uint64_t pos = key_hash64((uint64_t)(uint32_t)key) & ki->mask;
+    while(ki->keys[pos] != KEY_INDEX_EMPTY){
+        if(ki->keys[pos] == key){
+            return ki->values[pos];
+        }
+        pos = (pos + 1) & ki->mask;
+    }
+    return -1;
+}
+
+//Backward shift deletion: entries after the hole move up if their home slot allows it,
+//so lookups never need tombstones. Returns -1 if the key was not there.
+int key_index_remove(KeyIndex *ki, int key){
+    if(key == KEY_INDEX_EMPTY || ki->keys == NULL) return -1;
+
+    uint64_t pos = key_hash64((uint64_t)(uint32_t)key) & ki->mask;
+    while(ki->keys[pos] != key){
+        if(ki->keys[pos] == KEY_INDEX_EMPTY) return -1;
+        pos = (pos + 1) & ki->mask;
+    }
+
+    uint64_t hole = pos;
+    uint64_t next = (hole + 1) & ki->mask;
+    while(ki->keys[next] != KEY_INDEX_EMPTY){
+        uint64_t home = key_hash64((uint64_t)(uint32_t)ki->keys[next]) & ki->mask;
+        //The entry may fill the hole only if the hole lies between its home slot and where it sits now
+        if(((next - home) & ki->mask) >= ((next - hole) & ki->mask)){
+            ki->keys[hole] = ki->keys[next];
+            ki->values[hole] = ki->values[next];
+            hole = next;
+        }
+        next = (next + 1) & ki->mask;
+    }
+    ki->keys[hole] = KEY_INDEX_EMPTY;
+    ki->count--;
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef KEY_INDEX_H
+#define KEY_INDEX_H
+#include <stdint.h>
+#include "arena.h"
+
+//Open addressing hash table from key to its position in the local key array.
+//Unlike hsearch it is not global, so every worker thread can own one.
+//INT_MIN is used as the empty marker and cannot be stored.
+typedef struct{
+    int *keys;
+    int *values;
+    uint64_t mask;
+    uint64_t count;
+    Arena *arena;          //tables come from here when set, otherwise from malloc
+} KeyIndex;
+
+int key_index_init(KeyIndex *ki, uint64_t expected_keys);
+int key_index_init_in(KeyIndex *ki, uint64_t expected_keys, Arena *arena);
+void key_index_destroy(KeyIndex *ki);
+int key_index_insert(KeyIndex *ki, int key, int value);
+int key_index_find(const KeyIndex *ki, int key);
+int key_index_remove(KeyIndex *ki, int key);
+
+#endif
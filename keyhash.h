@@ -0,0 +1,52 @@
+#ifndef KEYHASH_H
+#define KEYHASH_H
+#include <stdint.h>
+
+//splitmix64 finalizer, cheap and mixes the low bits of small integer keys well.
+//Everything that splits keys between workers or receive queues has to use this one.
+static inline uint64_t key_hash64(uint64_t x){
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline int key_shard(int key, int num_shards){
+    if(num_shards <= 1) return 0;
+    return (int)(key_hash64((uint64_t)(uint32_t)key) % (uint64_t)num_shards);
+}
+
+//How the manager places keys, passed to the processes so they can compute a key's home themselves
+#define KEY_PLACEMENT_POSITION 0  //keys_per_process keys in a row, the home is unknown and filters decide
+#define KEY_PLACEMENT_SHARD 1     //key_process_shard, a hash over the processes
+#define KEY_PLACEMENT_JUMP 2      //jump consistent hash, only 1/n of the keys move when a process is added
+
+//Jump consistent hash (Lamping and Veach), no table and the same answer everywhere
+static inline int key_jump_owner(int key, int num_buckets){
+    uint64_t k = key_hash64((uint64_t)(uint32_t)key);
+    int64_t b = -1, j = 0;
+    while(j < num_buckets){
+        b = j;
+        k = k * 2862933555777941757ULL + 1;
+        j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((k >> 33) + 1)));
+    }
+    return (int)b;
+}
+
+//Processes get their own salted hash: with key_shard the keys of one process would all have the
+//same key_shard(key, num_workers) whenever the worker or queue count shares a factor with the processes
+static inline int key_process_shard(int key, int num_processes){
+    if(num_processes <= 1) return 0;
+    return (int)(key_hash64((uint64_t)(uint32_t)key ^ 0x6a09e667f3bcc909ULL) % (uint64_t)num_processes);
+}
+
+//Home process of a key, -1 when the placement does not say
+static inline int key_home(int key, int placement, int num_processes){
+    if(placement == KEY_PLACEMENT_SHARD) return key_process_shard(key, num_processes);
+    if(placement == KEY_PLACEMENT_JUMP) return key_jump_owner(key, num_processes);
+    return -1;
+}
+
+#endif
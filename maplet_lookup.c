@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include "maplet_lookup.h"
+
+//One probe: the iterator is placed on the smallest (hash, value) >= (key_hash, 0) and every
+//owner of the key follows it in the same run, so walking until the hash changes finds them all.
+//owners is cleared first, returns how many owners were added.
+int maplet_owners(const QF *qf, uint64_t key_hash, ProcessSet *owners){
+    QFi qfi;
+    int found = 0;
+
+    process_set_clear(owners);
+    if(qf_iterator_from_key_value(qf, &qfi, key_hash, 0, QF_KEY_IS_HASH) < 0){
+        return 0;
+    }
+    while(!qfi_end(&qfi)){
+        uint64_t hash, value, count;
+        qfi_get_hash(&qfi, &hash, &value, &count);
+        if(hash != key_hash) break;
+        if(value < (uint64_t)owners->num_words * 64){
+            process_set_add(owners, (int)value);
+            found++;
+        }
+        qfi_next(&qfi);
+    }
+    return found;
+}
@@ -0,0 +1,28 @@
+#ifndef MAPLET_LOOKUP_H
+#define MAPLET_LOOKUP_H
+#include <stdint.h>
+#include "gqf.h"
+#include "keyhash.h"
+#include "process_set.h"
+
+//The maplet stores every key once per owner, as (hash, owner id) pairs in the same run.
+//These helpers are shared by Process_maplet.c and maplet_lookup_test.c.
+
+//Owner ids are the stored values, the filter needs enough value bits for the highest one.
+//8 bits stay the minimum so filters built for up to 256 processes keep their layout.
+static inline int maplet_value_bits(int num_owners){
+    int bits = 8;
+    while(bits < 32 && (1 << bits) < num_owners){
+        bits++;
+    }
+    return bits;
+}
+
+//Keys are hashed by us (QF_HASH_NONE) so they can be staged, sorted and inserted in hash order
+static inline uint64_t maplet_key_hash(int key){
+    return key_hash64((uint64_t)(uint32_t)key);
+}
+
+int maplet_owners(const QF *qf, uint64_t key_hash, ProcessSet *owners);
+
+#endif
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gqf.h"
+#include "maplet_lookup.h"
+
+#define NUM_KEYS 20000
+#define NUM_OWNERS 300  //more than one word of the owner set and more than 8 value bits
+
+typedef struct{
+    uint64_t hash;
+    int owner;
+} Entry;
+
+static int compare_entries(const void *a, const void *b){
+    const Entry *x = a, *y = b;
+    if(x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->owner - y->owner;
+}
+
+//Builds a QF the way Process_maplet.c does and checks that the single probe
+//gives the same owners as asking qf_count_key_value for every owner.
+int main(){
+    QF qf;
+    if(!qf_malloc(&qf, 1 << 16, 64, maplet_value_bits(NUM_OWNERS), QF_HASH_NONE, 0)){
+        printf("[FAIL] could not allocate QF\n");
+        return 1;
+    }
+
+    //Every key gets 1 to 3 owners, key i+NUM_KEYS is never inserted
+    Entry *entries = malloc(NUM_KEYS * 3 * sizeof(Entry));
+    int num_entries = 0;
+    for(int k = 0; k < NUM_KEYS; k++){
+        int copies = 1 + k % 3;
+        for(int c = 0; c < copies; c++){
+            entries[num_entries].hash = maplet_key_hash(k);
+            entries[num_entries].owner = (k + c * 117) % NUM_OWNERS;
+            num_entries++;
+        }
+    }
+    qsort(entries, num_entries, sizeof(Entry), compare_entries);
+    for(int i = 0; i < num_entries; i++){
+        qf_insert(&qf, entries[i].hash, entries[i].owner, 1, QF_NO_LOCK | QF_KEY_IS_HASH);
+    }
+    printf("Inserted %d (key, owner) pairs\n", num_entries);
+
+    uint64_t owner_words[PROCESS_SET_WORDS(NUM_OWNERS)], expected_words[PROCESS_SET_WORDS(NUM_OWNERS)];
+    ProcessSet owners, expected;
+    process_set_init(&owners, owner_words, NUM_OWNERS);
+    process_set_init(&expected, expected_words, NUM_OWNERS);
+
+    int failures = 0;
+    for(int k = 0; k < 2 * NUM_KEYS; k++){
+        uint64_t hash = maplet_key_hash(k);
+        process_set_clear(&expected);
+        for(int p = 0; p < NUM_OWNERS; p++){
+            if(qf_count_key_value(&qf, hash, p, QF_KEY_IS_HASH) > 0){
+                process_set_add(&expected, p);
+            }
+        }
+        int found = maplet_owners(&qf, hash, &owners);
+        int matches = memcmp(owner_words, expected_words, sizeof(owner_words)) == 0;
+        if(!matches || found != process_set_count(&owners) || (k >= NUM_KEYS && found != 0) || (k < NUM_KEYS && found == 0)){
+            if(failures < 10){
+                printf("[FAIL] key %d: %d owners, expected %d, first 0x%lx\n", k, found, process_set_count(&expected),
+                       (unsigned long)process_set_next(&owners, 0));
+            }
+            failures++;
+        }
+    }
+
+    free(entries);
+    qf_free(&qf);
+
+    if(failures > 0){
+        printf("[FAIL] %d of %d lookups wrong\n", failures, 2 * NUM_KEYS);
+        return 1;
+    }
+    printf("[PASS] %d lookups match the per owner probes\n", 2 * NUM_KEYS);
+    return 0;
+}
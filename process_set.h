@@ -0,0 +1,62 @@
+#ifndef PROCESS_SET_H
+#define PROCESS_SET_H
+#include <stdint.h>
+#include <string.h>
+
+//Set of process ids as a bitmask of 64 bit words, sized for the process count at runtime.
+//Walking it only touches the set bits (one ctz per member, one load per empty word), so a key with
+//two owners or a round with three busy peers costs about the same at 1024 processes as at 64.
+//The words belong to the caller (arena or stack), PROCESS_SET_WORDS gives the size.
+
+#define PROCESS_SET_WORDS(num_processes) (((num_processes) + 63) / 64)
+
+typedef struct{
+    uint64_t *words;
+    int num_words;
+} ProcessSet;
+
+static inline void process_set_init(ProcessSet *s, uint64_t *words, int num_processes){
+    s->words = words;
+    s->num_words = PROCESS_SET_WORDS(num_processes);
+    memset(words, 0, s->num_words * sizeof(uint64_t));
+}
+
+static inline void process_set_clear(ProcessSet *s){
+    memset(s->words, 0, s->num_words * sizeof(uint64_t));
+}
+
+//Ids outside the set are ignored, e.g. an owner value from a filter built for more processes
+static inline void process_set_add(ProcessSet *s, int p){
+    if(p >= 0 && p / 64 < s->num_words) s->words[p / 64] |= 1ULL << (p % 64);
+}
+
+static inline void process_set_remove(ProcessSet *s, int p){
+    if(p >= 0 && p / 64 < s->num_words) s->words[p / 64] &= ~(1ULL << (p % 64));
+}
+
+static inline int process_set_has(const ProcessSet *s, int p){
+    return p >= 0 && p / 64 < s->num_words && (s->words[p / 64] >> (p % 64)) & 1;
+}
+
+//Smallest member >= from, -1 if there is none. for(p = next(s, 0); p >= 0; p = next(s, p + 1))
+static inline int process_set_next(const ProcessSet *s, int from){
+    if(from < 0) from = 0;
+    int w = from / 64;
+    if(w >= s->num_words) return -1;
+    uint64_t bits = s->words[w] & (~0ULL << (from % 64));
+    while(bits == 0){
+        if(++w >= s->num_words) return -1;
+        bits = s->words[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+static inline int process_set_count(const ProcessSet *s){
+    int count = 0;
+    for(int w = 0; w < s->num_words; w++){
+        count += __builtin_popcountll(s->words[w]);
+    }
+    return count;
+}
+
+#endif
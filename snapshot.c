@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+static uint64_t align_up(uint64_t n){
+    return (n + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+static int write_all(int fd, const void *data, uint64_t len, uint64_t offset){
+    const char *p = data;
+    while(len > 0){
+        ssize_t n = pwrite(fd, p, len, (off_t)offset);
+        if(n <= 0) return -1;
+        p += n;
+        len -= (uint64_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+//The header pages are left empty until commit
+int snapshot_writer_open(SnapshotWriter *sw, const char *path, size_t header_size){
+    snprintf(sw->path, sizeof(sw->path), "%s", path);
+    snprintf(sw->tmp_path, sizeof(sw->tmp_path), "%s.tmp", path);
+    sw->fd = open(sw->tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(sw->fd < 0){
+        perror("[ERROR HAPPENED] : Could not create snapshot");
+        return -1;
+    }
+    sw->size = align_up(header_size);
+    return 0;
+}
+
+//Returns the offset the section starts at, -1 if the write failed
+int64_t snapshot_write_section(SnapshotWriter *sw, const void *data, uint64_t len){
+    uint64_t offset = sw->size;
+    if(len > 0 && write_all(sw->fd, data, len, offset) != 0){
+        perror("[ERROR HAPPENED] : Could not write snapshot section");
+        return -1;
+    }
+    sw->size = align_up(offset + len);
+    return (int64_t)offset;
+}
+
+int snapshot_writer_commit(SnapshotWriter *sw, void *header, size_t header_size, uint32_t version){
+    SnapshotPrefix *prefix = header;
+    prefix->magic = SNAPSHOT_MAGIC;
+    prefix->version = version;
+    prefix->header_size = (uint32_t)header_size;
+    prefix->file_size = sw->size;
+
+    if(ftruncate(sw->fd, (off_t)sw->size) != 0 || write_all(sw->fd, header, header_size, 0) != 0 ||
+       fdatasync(sw->fd) != 0){
+        perror("[ERROR HAPPENED] : Could not finish snapshot");
+        snapshot_writer_abort(sw);
+        return -1;
+    }
+    close(sw->fd);
+    sw->fd = -1;
+    if(rename(sw->tmp_path, sw->path) != 0){
+        perror("[ERROR HAPPENED] : Could not publish snapshot");
+        unlink(sw->tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+void snapshot_writer_abort(SnapshotWriter *sw){
+    if(sw->fd >= 0) close(sw->fd);
+    sw->fd = -1;
+    unlink(sw->tmp_path);
+}
+
+//Private mapping, the restored tables can be changed without touching the file.
+//Returns NULL if the file is missing, from another version or cut off.
+void *snapshot_map(const char *path, size_t header_size, uint32_t version, uint64_t *size){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (uint64_t)st.st_size < header_size){
+        close(fd);
+        return NULL;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) return NULL;
+
+    const SnapshotPrefix *prefix = base;
+    if(prefix->magic != SNAPSHOT_MAGIC || prefix->version != version || prefix->header_size != header_size ||
+       prefix->file_size != (uint64_t)st.st_size){
+        fprintf(stderr, "Snapshot %s does not match this build, ignoring it\n", path);
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return base;
+}
+
+void snapshot_unmap(void *base, uint64_t size){
+    if(base != NULL) munmap(base, size);
+}
@@ -0,0 +1,36 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stdint.h>
+#include <stddef.h>
+
+//Checkpoint files that are mapped back instead of parsed. Every section starts on a page,
+//so a restore only points its tables into the mapping and the pages come in as they are touched.
+//The file is written next to its final name and renamed, a crash never leaves half a snapshot.
+//The header layout belongs to the caller, it only has to start with SnapshotPrefix.
+
+#define SNAPSHOT_MAGIC 0x31504e5350414e53ULL  //"SNAPSNP1"
+#define SNAPSHOT_ALIGN 4096
+
+typedef struct{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t file_size;
+} SnapshotPrefix;
+
+typedef struct{
+    int fd;
+    char path[256];
+    char tmp_path[264];
+    uint64_t size;
+} SnapshotWriter;
+
+int snapshot_writer_open(SnapshotWriter *sw, const char *path, size_t header_size);
+int64_t snapshot_write_section(SnapshotWriter *sw, const void *data, uint64_t len);
+int snapshot_writer_commit(SnapshotWriter *sw, void *header, size_t header_size, uint32_t version);
+void snapshot_writer_abort(SnapshotWriter *sw);
+
+void *snapshot_map(const char *path, size_t header_size, uint32_t version, uint64_t *size);
+void snapshot_unmap(void *base, uint64_t size);
+
+#endif
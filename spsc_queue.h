@@ -0,0 +1,64 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+#include <stdint.h>
+#include <stdlib.h>
+
+//Single producer / single consumer ring of work items between the dispatcher and one worker.
+//head is only written by the consumer and tail only by the producer, so no locks are needed.
+typedef struct{
+    int type;
+    int key;
+    int req_id;
+    int peer;
+    char *data;            //SET payload, the worker frees it
+    int len;
+} WorkItem;
+
+typedef struct{
+    WorkItem *items;
+    uint32_t mask;
+    char pad0[64];
+    volatile uint32_t head;
+    char pad1[64];
+    volatile uint32_t tail;
+    char pad2[64];
+} SpscQueue;
+
+static inline int spsc_init(SpscQueue *q, uint32_t capacity){
+    uint32_t size = 1;
+    while(size < capacity){
+        size <<= 1;
+    }
+    q->items = malloc(size * sizeof(WorkItem));
+    if(q->items == NULL) return -1;
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail = 0;
+    return 0;
+}
+
+static inline void spsc_destroy(SpscQueue *q){
+    free(q->items);
+    q->items = NULL;
+}
+
+//Returns 0 when the queue is full, the caller decides whether to spin or drop
+static inline int spsc_push(SpscQueue *q, const WorkItem *item){
+    uint32_t tail = q->tail;
+    uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if(tail - head > q->mask) return 0;
+    q->items[tail & q->mask] = *item;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static inline int spsc_pop(SpscQueue *q, WorkItem *item){
+    uint32_t head = q->head;
+    uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if(head == tail) return 0;
+    *item = q->items[head & q->mask];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "config.h"
+#include "sweep.h"
+
+#define MAX_SWEEP_AXES 8
+#define MAX_SWEEP_VALUES 32
+#define MAX_SWEEP_RUNS 4096
+#define SWEEP_LOG "sweep_%d.log"   //one log per run in the working directory, like bench.sh keeps them
+
+typedef struct{
+    char *name;
+    char *values[MAX_SWEEP_VALUES];
+    int num_values;
+    int width;                      //column width in the table
+} SweepAxis;
+
+typedef struct{
+    int status;                     //exit status of the run, -1 if it could not be started
+    int has_latency;
+    double latency_avg, latency_p50, latency_p95, latency_p99;
+    int answered;
+    int found;
+    double build_avg_ms;
+    double build_max_ms;
+    double rss_avg_kb;
+} SweepResult;
+
+//Every value is checked against the parameter here, a typo should not cost a whole grid of runs
+static int parse_spec(char *spec, SweepAxis *axes, int *num_axes){
+    *num_axes = 0;
+    for(char *save = NULL, *item = strtok_r(spec, " ;\t\n", &save); item != NULL; item = strtok_r(NULL, " ;\t\n", &save)){
+        char *eq = strchr(item, '=');
+        if(eq == NULL || eq == item || eq[1] == '\0'){
+            fprintf(stderr, "[ERROR HAPPENED] : Sweep axis %s is not name=v1,v2,...\n", item);
+            return -1;
+        }
+        if(*num_axes == MAX_SWEEP_AXES){
+            fprintf(stderr, "[ERROR HAPPENED] : A sweep takes at most %d parameters\n", MAX_SWEEP_AXES);
+            return -1;
+        }
+        SweepAxis *axis = &axes[(*num_axes)++];
+        *eq = '\0';
+        axis->name = item;
+        axis->num_values = 0;
+        axis->width = (int)strlen(item);
+        for(char *vsave = NULL, *value = strtok_r(eq + 1, ",", &vsave); value != NULL; value = strtok_r(NULL, ",", &vsave)){
+            if(axis->num_values == MAX_SWEEP_VALUES){
+                fprintf(stderr, "[ERROR HAPPENED] : Sweep axis %s has more than %d values\n", item, MAX_SWEEP_VALUES);
+                return -1;
+            }
+            if(config_set(item, value) != 0) return -1;
+            axis->values[axis->num_values++] = value;
+            if((int)strlen(value) > axis->width) axis->width = (int)strlen(value);
+        }
+    }
+    if(*num_axes == 0){
+        fprintf(stderr, "[ERROR HAPPENED] : The sweep has no parameters\n");
+        return -1;
+    }
+    return 0;
+}
+
+//The run is the manager itself with the sweep's arguments, the grid point's flags come last and win
+static int run_point(int run, int argc, char *argv[], const SweepAxis *axes, int num_axes, const int *choice, long seed){
+    char **args = calloc(argc + num_axes + 2, sizeof(char*));
+    char seed_arg[40];
+    char log_path[64];
+    int n = 0;
+    if(args == NULL) return -1;
+
+    for(int i = 0; i < argc; i++){
+        if(strncmp(argv[i], "--sweep=", 8) != 0) args[n++] = argv[i];
+    }
+    snprintf(seed_arg, sizeof(seed_arg), "--seed=%ld", seed);
+    args[n++] = seed_arg;
+    for(int a = 0; a < num_axes; a++){
+        size_t len = strlen(axes[a].name) + strlen(axes[a].values[choice[a]]) + 4;
+        args[n] = malloc(len);
+        if(args[n] == NULL) break;
+        snprintf(args[n], len, "--%s=%s", axes[a].name, axes[a].values[choice[a]]);
+        n++;
+    }
+    args[n] = NULL;
+    snprintf(log_path, sizeof(log_path), SWEEP_LOG, run);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0){
+        int fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0){
+            perror("[ERROR HAPPENED] : Could not create the sweep log");
+            _exit(127);
+        }
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+        execv("/proc/self/exe", args);
+        perror("[ERROR HAPPENED] : execv of the manager failed");
+        _exit(127);
+    }
+    int status = -1;
+    if(pid < 0){
+        perror("[ERROR HAPPENED] : fork for a sweep run failed");
+    } else if(waitpid(pid, &status, 0) == pid){
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    for(int i = n - num_axes; i < n; i++){
+        free(args[i]);
+    }
+    free(args);
+    return status;
+}
+
+//Same [BENCH] lines bench.sh reads
+static void read_results(int run, SweepResult *r){
+    char path[64];
+    char line[1024];
+    double build_sum = 0;
+    int builds = 0;
+    double rss_sum = 0;
+    int rss_count = 0;
+
+    snprintf(path, sizeof(path), SWEEP_LOG, run);
+    FILE *f = fopen(path, "r");
+    if(f == NULL) return;
+    while(fgets(line, sizeof(line), f) != NULL){
+        char *bench = strstr(line, "[BENCH]");
+        int p;
+        double build;
+        long rss;
+        if(bench == NULL) continue;
+        if(sscanf(bench, "[BENCH] latency_ms avg %lf p50 %lf p95 %lf p99 %lf answered %d found %d",
+                  &r->latency_avg, &r->latency_p50, &r->latency_p95, &r->latency_p99, &r->answered, &r->found) == 6){
+            r->has_latency = 1;
+        } else if(sscanf(bench, "[BENCH] Process %d build_ms %lf", &p, &build) == 2){
+            if(build < 0) continue;
+            build_sum += build;
+            builds++;
+            if(build > r->build_max_ms) r->build_max_ms = build;
+        } else if(sscanf(bench, "[BENCH] Process %d peak_rss_kb %ld", &p, &rss) == 2){
+            rss_sum += rss;
+            rss_count++;
+        }
+    }
+    fclose(f);
+    r->build_avg_ms = builds > 0 ? build_sum / builds : -1;
+    if(builds == 0) r->build_max_ms = -1;
+    r->rss_avg_kb = rss_count > 0 ? rss_sum / rss_count : -1;
+}
+
+int run_sweep(const char *spec, int argc, char *argv[]){
+    SweepAxis axes[MAX_SWEEP_AXES];
+    int num_axes;
+    int choice[MAX_SWEEP_AXES] = {0};
+    //Every point runs the same workload, a seed picked here if none was given
+    long seed = config.seed >= 0 ? config.seed : (long)(unsigned int)time(NULL);
+
+    char *spec_copy = strdup(spec);
+    if(spec_copy == NULL || parse_spec(spec_copy, axes, &num_axes) != 0){
+        free(spec_copy);
+        return 1;
+    }
+    int num_runs = 1;
+    for(int a = 0; a < num_axes; a++){
+        num_runs *= axes[a].num_values;
+        if(num_runs > MAX_SWEEP_RUNS){
+            fprintf(stderr, "[ERROR HAPPENED] : The sweep grid has more than %d points\n", MAX_SWEEP_RUNS);
+            free(spec_copy);
+            return 1;
+        }
+    }
+    SweepResult *results = calloc(num_runs, sizeof(SweepResult));
+    if(results == NULL){
+        free(spec_copy);
+        return 1;
+    }
+
+    printf("Sweep: %d runs with seed %ld, logs in " SWEEP_LOG " to " SWEEP_LOG "\n", num_runs, seed, 0, num_runs - 1);
+    for(int run = 0; run < num_runs; run++){
+        //Odometer over the axes, the last one changes fastest
+        int rest = run;
+        for(int a = num_axes - 1; a >= 0; a--){
+            choice[a] = rest % axes[a].num_values;
+            rest /= axes[a].num_values;
+        }
+        printf("Sweep run %d/%d:", run + 1, num_runs);
+        for(int a = 0; a < num_axes; a++){
+            printf(" %s=%s", axes[a].name, axes[a].values[choice[a]]);
+        }
+        printf("\n");
+        results[run].status = run_point(run, argc, argv, axes, num_axes, choice, seed);
+        read_results(run, &results[run]);
+    }
+
+    printf("\n");
+    for(int a = 0; a < num_axes; a++){
+        printf("%-*s  ", axes[a].width, axes[a].name);
+    }
+    printf("%12s %12s %12s %10s %10s %10s %10s %9s %7s %6s\n", "build_avg_ms", "build_max_ms", "rss_avg_kb",
+           "avg_ms", "p50_ms", "p95_ms", "p99_ms", "answered", "found", "exit");
+    for(int run = 0; run < num_runs; run++){
+        int rest = run;
+        for(int a = num_axes - 1; a >= 0; a--){
+            choice[a] = rest % axes[a].num_values;
+            rest /= axes[a].num_values;
+        }
+        for(int a = 0; a < num_axes; a++){
+            printf("%-*s  ", axes[a].width, axes[a].values[choice[a]]);
+        }
+        SweepResult *r = &results[run];
+        printf("%12.1f %12.1f %12.0f ", r->build_avg_ms, r->build_max_ms, r->rss_avg_kb);
+        if(r->has_latency){
+            printf("%10.3f %10.3f %10.3f %10.3f %9d %7d", r->latency_avg, r->latency_p50, r->latency_p95, r->latency_p99, r->answered, r->found);
+        } else {
+            printf("%10s %10s %10s %10s %9s %7s", "-", "-", "-", "-", "-", "-");
+        }
+        printf(" %6d\n", r->status);
+    }
+    free(results);
+    free(spec_copy);
+    return 0;
+}
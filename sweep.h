@@ -0,0 +1,10 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+//Parameter sweep: the manager runs itself once per point of a grid of parameters and prints one
+//table of the [BENCH] results. spec is "name=v1,v2 name=v1,v2 ..." (';' also separates),
+//argv the manager's own arguments, every run gets them plus one --name=value per axis.
+
+int run_sweep(const char *spec, int argc, char *argv[]);
+
+#endif
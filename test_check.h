@@ -0,0 +1,26 @@
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+#include <stdio.h>
+
+//Shared by the round trip tests: every failed check is printed and counted, test_result prints the
+//[PASS]/[FAIL] line that maplet_lookup_test.c ends with and gives the exit code
+
+static int test_failures = 0;
+
+static inline void check(int ok, const char *what){
+    if(!ok){
+        printf("[FAIL] %s\n", what);
+        test_failures++;
+    }
+}
+
+static inline int test_result(const char *passed){
+    if(test_failures > 0){
+        printf("[FAIL] %d checks failed\n", test_failures);
+        return 1;
+    }
+    printf("[PASS] %s\n", passed);
+    return 0;
+}
+
+#endif
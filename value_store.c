@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "value_store.h"
+
+int value_store_init(ValueStore *vs, const char *shm_prefix, Arena *arena){
+    memset(vs, 0, sizeof(*vs));
+    vs->free_entry = -1;
+    vs->arena = arena;
+    snprintf(vs->shm_prefix, sizeof(vs->shm_prefix), "%s", shm_prefix);
+    return 0;
+}
+
+void value_store_destroy(ValueStore *vs){
+    for(int i = 0; i < vs->num_slab_chunks && vs->arena == NULL; i++){
+        free(vs->slab_chunks[i]);
+    }
+    for(int i = 0; i < vs->num_shm_chunks; i++){
+        munmap(vs->shm_chunks[i].base, vs->shm_chunks[i].size);
+        unlink(vs->shm_chunks[i].path);
+        free(vs->shm_chunks[i].path);
+    }
+    free(vs->slab_chunks);
+    free(vs->shm_chunks);
+    free(vs->entries);
+    memset(vs, 0, sizeof(*vs));
+    vs->free_entry = -1;
+}
+
+//Returns a new empty slot, -1 if out of memory
+int value_store_new(ValueStore *vs, int runtime){
+    int slot;
+    if(vs->free_entry >= 0){
+        slot = vs->free_entry;
+        vs->free_entry = (int)vs->entries[slot].len - 1;
+    } else {
+        if(vs->num_entries == vs->capacity){
+            int new_capacity = vs->capacity == 0 ? 1024 : vs->capacity * 2;
+            ValueEntry *bigger = realloc(vs->entries, new_capacity * sizeof(ValueEntry));
+            if(bigger == NULL) return -1;
+            vs->entries = bigger;
+            vs->capacity = new_capacity;
+        }
+        slot = vs->num_entries++;
+    }
+    memset(&vs->entries[slot], 0, sizeof(ValueEntry));
+    vs->entries[slot].slab_class = 0;
+    vs->entries[slot].runtime = (uint8_t)runtime;
+    return slot;
+}
+
+static int slab_class_for(uint32_t len){
+    int c = 0;
+    while((uint32_t)(VALUE_SLAB_MIN << c) < len) c++;
+    return c;
+}
+
+static char *slab_alloc(ValueStore *vs, int c){
+    if(vs->free_blocks[c] != NULL){
+        char *block = vs->free_blocks[c];
+        memcpy(&vs->free_blocks[c], block, sizeof(void*));
+        return block;
+    }
+    uint64_t size = (uint64_t)VALUE_SLAB_MIN << c;
+    if(vs->slab_left < size){
+        char **more = realloc(vs->slab_chunks, (vs->num_slab_chunks + 1) * sizeof(char*));
+        if(more == NULL) return NULL;
+        vs->slab_chunks = more;
+        char *chunk = vs->arena != NULL ? arena_alloc(vs->arena, VALUE_SLAB_CHUNK) : malloc(VALUE_SLAB_CHUNK);
+        if(chunk == NULL) return NULL;
+        vs->slab_chunks[vs->num_slab_chunks++] = chunk;
+        //The tail of the old block is lost, at most one block of the largest class
+        vs->slab_next = chunk;
+        vs->slab_left = VALUE_SLAB_CHUNK;
+    }
+    char *block = vs->slab_next;
+    vs->slab_next += size;
+    vs->slab_left -= size;
+    return block;
+}
+
+static void slab_release(ValueStore *vs, ValueEntry *e){
+    if(e->data == NULL || e->slab_class < 0) return;
+    memcpy(e->data, &vs->free_blocks[(int)e->slab_class], sizeof(void*));
+    vs->free_blocks[(int)e->slab_class] = e->data;
+}
+
+//Appends to the last shared memory chunk, opening a new one when it is full
+static int shm_alloc(ValueStore *vs, uint32_t len, ValueEntry *e){
+    ValueChunk *last = vs->num_shm_chunks > 0 ? &vs->shm_chunks[vs->num_shm_chunks - 1] : NULL;
+    if(last == NULL || last->size - last->used < len){
+        ValueChunk *more = realloc(vs->shm_chunks, (vs->num_shm_chunks + 1) * sizeof(ValueChunk));
+        if(more == NULL) return -1;
+        vs->shm_chunks = more;
+        ValueChunk *chunk = &vs->shm_chunks[vs->num_shm_chunks];
+        chunk->size = len > VALUE_SHM_CHUNK ? len : VALUE_SHM_CHUNK;
+        chunk->used = 0;
+        char path[160];
+        snprintf(path, sizeof(path), "%s_%d.val", vs->shm_prefix, vs->num_shm_chunks);
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0 || ftruncate(fd, (off_t)chunk->size) != 0){
+            perror("[ERROR HAPPENED] : Could not create value chunk");
+            if(fd >= 0) close(fd);
+            return -1;
+        }
+        chunk->base = mmap(NULL, chunk->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(chunk->base == MAP_FAILED){
+            perror("[ERROR HAPPENED] : Could not map value chunk");
+            unlink(path);
+            return -1;
+        }
+        chunk->path = strdup(path);
+        last = chunk;
+        vs->num_shm_chunks++;
+    }
+    e->slab_class = -1;
+    e->shm_chunk = (uint16_t)(vs->num_shm_chunks - 1);
+    e->shm_offset = last->used;
+    e->data = last->base + last->used;
+    last->used += (len + 63) & ~63ULL; //keep values cache line aligned
+    return 0;
+}
+
+//Replaces the value of slot, returns -1 if there is no room
+int value_store_set(ValueStore *vs, int slot, const void *data, uint32_t len){
+    ValueEntry *e = &vs->entries[slot];
+    if(e->slab_class >= 0 && len <= VALUE_SLAB_MAX && e->data != NULL && slab_class_for(len) == e->slab_class){
+        memcpy(e->data, data, len); //same class, overwrite in place
+        e->len = len;
+        return 0;
+    }
+    slab_release(vs, e);
+    e->data = NULL;
+    e->len = 0;
+    e->slab_class = 0;
+    if(len == 0) return 0;
+
+    if(len <= VALUE_SLAB_MAX){
+        int c = slab_class_for(len);
+        char *block = slab_alloc(vs, c);
+        if(block == NULL) return -1;
+        e->data = block;
+        e->slab_class = (int8_t)c;
+    } else if(shm_alloc(vs, len, e) != 0){
+        return -1;
+    }
+    memcpy(e->data, data, len);
+    e->len = len;
+    return 0;
+}
+
+const ValueEntry *value_store_get(const ValueStore *vs, int slot){
+    if(slot < 0 || slot >= vs->num_entries) return NULL;
+    return &vs->entries[slot];
+}
+
+//Path of the chunk file a large value is in, NULL for values that are sent inline
+const char *value_store_shm_path(const ValueStore *vs, const ValueEntry *entry){
+    if(entry->slab_class >= 0 || entry->data == NULL) return NULL;
+    return vs->shm_chunks[entry->shm_chunk].path;
+}
+
+void value_store_free(ValueStore *vs, int slot){
+    if(slot < 0 || slot >= vs->num_entries) return;
+    ValueEntry *e = &vs->entries[slot];
+    slab_release(vs, e);
+    e->data = NULL;
+    e->len = (uint32_t)(vs->free_entry + 1);
+    vs->free_entry = slot;
+}
+
+//One VALUE_SLOT_* per slot, states has room for num_entries
+void value_store_slot_states(const ValueStore *vs, uint8_t *states){
+    for(int i = 0; i < vs->num_entries; i++){
+        states[i] = vs->entries[i].runtime ? VALUE_SLOT_RUNTIME : VALUE_SLOT_USED;
+    }
+    for(int slot = vs->free_entry; slot >= 0; slot = (int)vs->entries[slot].len - 1){
+        states[slot] = VALUE_SLOT_FREE;
+    }
+}
+
+//Gives an empty store the same slot numbers back, every value is empty afterwards
+int value_store_restore_slots(ValueStore *vs, const uint8_t *states, int num_slots){
+    for(int i = 0; i < num_slots; i++){
+        if(value_store_new(vs, states[i] == VALUE_SLOT_RUNTIME) != i) return -1;
+    }
+    for(int i = num_slots - 1; i >= 0; i--){
+        if(states[i] == VALUE_SLOT_FREE) value_store_free(vs, i);
+    }
+    return 0;
+}
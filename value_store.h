@@ -0,0 +1,65 @@
+#ifndef VALUE_STORE_H
+#define VALUE_STORE_H
+#include <stdint.h>
+#include "arena.h"
+
+//Values of the keys of one worker, addressed by a slot number that the key index stores.
+//Small values live in power of two slab classes with free lists. Values above VALUE_INLINE_MAX
+//(IPC.h) are appended to shared memory chunk files that readers map themselves, so a GET
+//reply only carries the path and offset. Chunk space is not reused, a reader may still be on it.
+
+#define VALUE_SLAB_MIN 16
+#define VALUE_SLAB_CLASSES 11            //16 B .. 16 KiB
+#define VALUE_SLAB_MAX (VALUE_SLAB_MIN << (VALUE_SLAB_CLASSES - 1))  //same as VALUE_INLINE_MAX
+#define VALUE_SLAB_CHUNK (1 << 20)       //Small values are carved from 1 MiB blocks
+#define VALUE_SHM_CHUNK (64ULL << 20)    //Large values, chunk files are sparse until written
+
+#define VALUE_SLOT_FREE 0                //slot states for a checkpoint, the values themselves are not kept
+#define VALUE_SLOT_USED 1
+#define VALUE_SLOT_RUNTIME 2
+
+typedef struct{
+    char *data;
+    uint32_t len;
+    int8_t slab_class;     //-1 for a value in a shared memory chunk
+    uint8_t runtime;       //key was added by PUT/SET after the initial load
+    uint16_t shm_chunk;
+    uint64_t shm_offset;
+} ValueEntry;
+
+typedef struct{
+    char *path;
+    char *base;
+    uint64_t size;
+    uint64_t used;
+} ValueChunk;
+
+typedef struct{
+    ValueEntry *entries;
+    int num_entries;
+    int capacity;
+    int free_entry;        //chain of unused entries through their len field, -1 if none
+
+    void *free_blocks[VALUE_SLAB_CLASSES];
+    Arena *arena;          //slab blocks come from here when set, otherwise from malloc
+    char **slab_chunks;
+    int num_slab_chunks;
+    char *slab_next;
+    uint64_t slab_left;
+
+    ValueChunk *shm_chunks;
+    int num_shm_chunks;
+    char shm_prefix[96];
+} ValueStore;
+
+int value_store_init(ValueStore *vs, const char *shm_prefix, Arena *arena);
+void value_store_destroy(ValueStore *vs);
+int value_store_new(ValueStore *vs, int runtime);
+int value_store_set(ValueStore *vs, int slot, const void *data, uint32_t len);
+const ValueEntry *value_store_get(const ValueStore *vs, int slot);
+const char *value_store_shm_path(const ValueStore *vs, const ValueEntry *entry);
+void value_store_free(ValueStore *vs, int slot);
+void value_store_slot_states(const ValueStore *vs, uint8_t *states);
+int value_store_restore_slots(ValueStore *vs, const uint8_t *states, int num_slots);
+
+#endif
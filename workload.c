@@ -0,0 +1,147 @@
+#include <math.h>
+#include "keyhash.h"
+#include "workload.h"
+
+void workload_rng_seed(WorkloadRng *rng, uint64_t seed, uint64_t stream){
+    uint64_t x = key_hash64(seed) ^ (stream * 0xd1b54a32d192ed03ULL);
+    for(int i = 0; i < 4; i++){
+        x += 0x9e3779b97f4a7c15ULL;
+        rng->s[i] = key_hash64(x);
+    }
+}
+
+//log1p(x)/x and expm1(x)/x, both go to 1 around 0 where the division loses everything
+static double zipf_helper1(double x){
+    if(fabs(x) > 1e-8) return log1p(x) / x;
+    return 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static double zipf_helper2(double x){
+    if(fabs(x) > 1e-8) return expm1(x) / x;
+    return 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x));
+}
+
+static double zipf_h(const ZipfSampler *z, double x){
+    return exp(-z->exponent * log(x));
+}
+
+static double zipf_h_integral(const ZipfSampler *z, double x){
+    double log_x = log(x);
+    return zipf_helper2((1 - z->exponent) * log_x) * log_x;
+}
+
+static double zipf_h_integral_inverse(const ZipfSampler *z, double x){
+    double t = x * (1 - z->exponent);
+    if(t < -1) t = -1;
+    return exp(zipf_helper1(t) * x);
+}
+
+void zipf_init(ZipfSampler *z, long n, double exponent){
+    z->n = n > 0 ? n : 1;
+    z->exponent = exponent;
+    z->h_integral_x1 = zipf_h_integral(z, 1.5) - 1;
+    z->h_integral_n = zipf_h_integral(z, z->n + 0.5);
+    z->s = 2 - zipf_h_integral_inverse(z, zipf_h_integral(z, 2.5) - zipf_h(z, 2));
+}
+
+//Rank 0 is the most popular one
+long zipf_sample(const ZipfSampler *z, WorkloadRng *rng){
+    for(;;){
+        double u = z->h_integral_n + workload_unit(rng) * (z->h_integral_x1 - z->h_integral_n);
+        double x = zipf_h_integral_inverse(z, u);
+        long k = (long)(x + 0.5);
+        if(k < 1) k = 1;
+        if(k > z->n) k = z->n;
+        if(k - x <= z->s || u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, k)){
+            return k - 1;
+        }
+    }
+}
+
+//Rounds of odd multiply, xorshift and add on the smallest power of two domain, all of them invertible.
+//Indexes that land past the real domain walk the cycle until they are back inside it.
+void permutation_init(KeyPermutation *p, uint64_t domain, uint64_t seed){
+    int bits = 0;
+    while(bits < 63 && (1ULL << bits) < domain) bits++;
+    p->domain = domain;
+    p->mask = bits > 0 ? (1ULL << bits) - 1 : 0;
+    p->shift = (bits + 1) / 2;
+    uint64_t x = key_hash64(seed ^ 0x5851f42d4c957f2dULL);
+    for(int r = 0; r < 4; r++){
+        x = key_hash64(x + 0x9e3779b97f4a7c15ULL);
+        p->multipliers[r] = x | 1;
+        x = key_hash64(x + 0x9e3779b97f4a7c15ULL);
+        p->offsets[r] = x;
+    }
+}
+
+static uint64_t permutation_round(const KeyPermutation *p, uint64_t x){
+    for(int r = 0; r < 4; r++){
+        x = (x * p->multipliers[r]) & p->mask;
+        x ^= x >> p->shift;
+        x = (x + p->offsets[r]) & p->mask;
+    }
+    return x;
+}
+
+uint64_t permutation_apply(const KeyPermutation *p, uint64_t index){
+    if(p->mask == 0) return 0;
+    uint64_t x = permutation_round(p, index);
+    while(x >= p->domain){
+        x = permutation_round(p, x);
+    }
+    return x;
+}
+
+void key_generator_init(KeyGenerator *g, int distribution, long total, int key_space, double zipf_exponent,
+                        int cluster_size, uint64_t seed){
+    g->distribution = distribution;
+    g->total = total;
+    g->index = 0;
+    g->cluster_size = cluster_size > 0 ? cluster_size : 1;
+    workload_rng_seed(&g->rng, seed, WORKLOAD_STREAM_KEYS);
+    uint64_t domain = (uint64_t)key_space;
+    if(distribution == KEY_DIST_CLUSTERED){
+        domain = (uint64_t)(key_space / g->cluster_size);
+    }
+    permutation_init(&g->permutation, domain > 0 ? domain : 1, seed);
+    if(distribution == KEY_DIST_ZIPF){
+        zipf_init(&g->zipf, key_space, zipf_exponent);
+    }
+}
+
+int key_generator_next(KeyGenerator *g, int *key){
+    if(g->index >= g->total) return 0;
+    long i = g->index++;
+    switch(g->distribution){
+    case KEY_DIST_ZIPF:
+        //The popular ranks are scattered over the key space, not the smallest keys
+        *key = (int)permutation_apply(&g->permutation, (uint64_t)zipf_sample(&g->zipf, &g->rng));
+        break;
+    case KEY_DIST_SEQUENTIAL:
+        *key = (int)i;
+        break;
+    case KEY_DIST_CLUSTERED:
+        *key = (int)(permutation_apply(&g->permutation, (uint64_t)(i / g->cluster_size)) * g->cluster_size + i % g->cluster_size);
+        break;
+    default:
+        *key = (int)permutation_apply(&g->permutation, (uint64_t)i);
+        break;
+    }
+    return 1;
+}
+
+long key_generator_capacity(int distribution, int key_space, int cluster_size){
+    if(distribution == KEY_DIST_ZIPF) return -1;
+    if(distribution == KEY_DIST_CLUSTERED){
+        if(cluster_size <= 0) return 0;
+        return (long)(key_space / cluster_size) * cluster_size;
+    }
+    return key_space;
+}
+
+const char *key_distribution_name(int distribution){
+    static const char *names[KEY_DIST_COUNT] = {"uniform", "zipf", "sequential", "clustered"};
+    if(distribution < 0 || distribution >= KEY_DIST_COUNT) return "unknown";
+    return names[distribution];
+}
@@ -0,0 +1,94 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+#include <stdint.h>
+
+//Seeded workload generation for the manager: the same seed gives the same keys, the same query
+//stream and the same update keys on every run and every build, whatever engine is measured.
+//Every part of the workload draws from its own stream, so changing the number of queries does
+//not change the keys, and re-streaming the keys after a re-spawn does not change the queries.
+
+#define WORKLOAD_STREAM_KEYS 0
+#define WORKLOAD_STREAM_SAMPLE 1    //reservoir of loaded keys the queries and deletes are picked from
+#define WORKLOAD_STREAM_QUERIES 2
+#define WORKLOAD_STREAM_UPDATES 3
+
+//Key sets the manager generates when no key file is given
+#define KEY_DIST_UNIFORM 0     //distinct keys spread over the whole key space
+#define KEY_DIST_ZIPF 1        //drawn with Zipf popularity over the key space, hot keys repeat
+#define KEY_DIST_SEQUENTIAL 2  //0, 1, 2, ...
+#define KEY_DIST_CLUSTERED 3   //distinct runs of key_cluster_size consecutive keys at random places
+#define KEY_DIST_COUNT 4
+
+//xoshiro256**, seeded through splitmix64
+typedef struct{
+    uint64_t s[4];
+} WorkloadRng;
+
+void workload_rng_seed(WorkloadRng *rng, uint64_t seed, uint64_t stream);
+
+static inline uint64_t workload_next(WorkloadRng *rng){
+    uint64_t *s = rng->s;
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+//0 .. n-1, multiply and shift instead of a modulo (the bias is below 2^-32 for our ranges)
+static inline uint64_t workload_below(WorkloadRng *rng, uint64_t n){
+    return (uint64_t)(((unsigned __int128)workload_next(rng) * n) >> 64);
+}
+
+//[0, 1)
+static inline double workload_unit(WorkloadRng *rng){
+    return (double)(workload_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+//Zipf ranks 0 .. n-1 by rejection inversion (Hoermann and Derflinger), no table however big n is
+typedef struct{
+    long n;
+    double exponent;
+    double h_integral_x1;
+    double h_integral_n;
+    double s;
+} ZipfSampler;
+
+void zipf_init(ZipfSampler *z, long n, double exponent);
+long zipf_sample(const ZipfSampler *z, WorkloadRng *rng);
+
+//Seeded bijection of 0 .. domain-1 onto itself, turns an index into a distinct key without a table
+typedef struct{
+    uint64_t domain;
+    uint64_t mask;
+    int shift;
+    uint64_t multipliers[4];
+    uint64_t offsets[4];
+} KeyPermutation;
+
+void permutation_init(KeyPermutation *p, uint64_t domain, uint64_t seed);
+uint64_t permutation_apply(const KeyPermutation *p, uint64_t index);
+
+typedef struct{
+    int distribution;
+    long total;           //keys still to produce
+    long index;
+    int cluster_size;
+    WorkloadRng rng;
+    ZipfSampler zipf;
+    KeyPermutation permutation;
+} KeyGenerator;
+
+//The caller checks that total fits key_generator_capacity
+void key_generator_init(KeyGenerator *g, int distribution, long total, int key_space, double zipf_exponent,
+                        int cluster_size, uint64_t seed);
+int key_generator_next(KeyGenerator *g, int *key);   //returns 0 once total keys were produced
+long key_generator_capacity(int distribution, int key_space, int cluster_size); //distinct keys it can produce, -1 if unlimited
+const char *key_distribution_name(int distribution);
+
+#endif